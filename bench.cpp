@@ -0,0 +1,1995 @@
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include "bst.h"
+#include "avlbst.h"
+#include "rbbst.h"
+#include "weightedbst.h"
+#include "durable_avl.h"
+#include "buffered_avl.h"
+#include "parallel.h"
+#include "intrusive_avl.h"
+#include "compressed_map.h"
+#include "bench.h"
+#include "bench_baseline.h"
+
+using namespace std;
+
+// Benchmark driver.  Usage:
+//   ./bench [options] [suite...]
+// Options:
+//   --n=N              keys preloaded into each structure (default 10000)
+//   --ops=N            timed operations per run (default 10000)
+//   --seed=S           random seed (default 104)
+//   --engines=a,b      bst,avl,rb,splay,semisplay,map (default bst,avl,rb,map)
+//   --keys=a,b         key types: u64,string,blob64 (default all)
+//   --workloads=a,b    sequential,random,zipfian,hotset,sliding (default all)
+//   --reads=a,b        read percentages (default 100,95,50,5,0)
+//   --baseline=PATH    timing baseline file for "regress" (default bench_baseline.json)
+//   --record           "regress" records a new baseline instead of comparing
+//   --threshold=F      "regress" fails when slower by more than F (default 0.10)
+//   --trials=N         samples per size for "regress" (default 15)
+//   --threads=N        most threads for the parallel suites (default: hardware threads)
+//   --list             list the available suites
+// Results are written to stdout as CSV, one header per suite.  The bench-profile build reports
+// per-operation hardware counters split by tree phase instead of timings.
+
+struct BenchConfig
+{
+    size_t n;
+    size_t ops;
+    RandomSeed seed;
+    vector<string> engines;
+    vector<string> keys;
+    vector<string> workloads;
+    vector<int> readPcts;
+    string baselinePath;
+    bool recordBaseline;
+    double regressionThreshold;
+    int trials;
+    unsigned threads;
+};
+
+// splits a comma-separated option value
+static vector<string> splitList(const string& value)
+{
+    vector<string> items;
+    stringstream ss(value);
+    string item;
+    while(getline(ss, item, ',')) {
+        if(!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+static bool contains(const vector<string>& items, const string& item)
+{
+    for(size_t i = 0; i < items.size(); ++i) {
+        if(items[i] == item) return true;
+    }
+    return false;
+}
+
+/*
+  -----------------------------------------
+  Begin workload plans.
+  -----------------------------------------
+*/
+
+// the keys to preload and the timed operation stream for one run
+struct WorkloadPlan
+{
+    vector<uint64_t> preload;
+    vector<BenchOp> ops;
+};
+
+/**
+* Builds the operation stream for a workload.  Writes alternate between
+* inserts and removes so the structure size stays roughly constant, except
+* for the sequential workload, which is append-only.
+*   sequential - keys preloaded in ascending order; reads walk the keys in
+*                order, writes append increasing keys
+*   random     - uniform keys over twice the preloaded key space
+*   zipfian    - Zipfian(0.99) keys over the same space, hot keys scattered
+*   hotset     - 80% of operations on 1% of the preloaded keys, the rest
+*                uniform over the random workload's space
+*   sliding    - ascending IDs; writes insert the newest and remove the
+*                oldest ID, reads target the current window
+*/
+static WorkloadPlan makeWorkloadPlan(const string& workload, size_t n, size_t ops, int readPct, RandomSeed seed)
+{
+    WorkloadPlan plan;
+    vector<uint64_t> coins = makeRandomNumberVector<uint64_t>(ops, 0, 99, seed + 1, true);
+    plan.ops.reserve(ops);
+
+    if(workload == "sequential" || workload == "sliding") {
+        for(uint64_t i = 0; i < n; ++i) {
+            plan.preload.push_back(i);
+        }
+    }
+    else {
+        plan.preload = makeRandomNumberVector<uint64_t>(n, 0, 2 * n - 1, seed, false);
+    }
+
+    if(workload == "sequential") {
+        uint64_t readCursor = 0, writeCursor = n;
+        for(size_t i = 0; i < ops; ++i) {
+            BenchOp op;
+            if((int)coins[i] < readPct) {
+                op.kind = OP_FIND;
+                op.key = readCursor++ % n;
+            }
+            else {
+                op.kind = OP_INSERT;
+                op.key = writeCursor++;
+            }
+            plan.ops.push_back(op);
+        }
+    }
+    else if(workload == "sliding") {
+        // the window advances by one key every two writes
+        double step = (100.0 - readPct) / 200.0;
+        vector<uint64_t> reads = makeSlidingWindowNumberVector<uint64_t>(ops, 0, n, step, seed + 2);
+        uint64_t oldest = 0, newest = n;
+        for(size_t i = 0; i < ops; ++i) {
+            BenchOp op;
+            if((int)coins[i] < readPct) {
+                op.kind = OP_FIND;
+                op.key = reads[i];
+            }
+            else if(newest - oldest <= n) {
+                op.kind = OP_INSERT;
+                op.key = newest++;
+            }
+            else {
+                op.kind = OP_REMOVE;
+                op.key = oldest++;
+            }
+            plan.ops.push_back(op);
+        }
+    }
+    else {
+        vector<uint64_t> keys;
+        if(workload == "zipfian") {
+            // scatter popularity ranks over the key space so hot keys are not adjacent
+            vector<uint64_t> ranks = makeZipfianNumberVector<uint64_t>(ops, 0, 2 * n - 1, 0.99, seed + 2);
+            vector<uint64_t> scatter(2 * n);
+            for(uint64_t i = 0; i < scatter.size(); ++i) scatter[i] = i;
+            std::mt19937 randEngine(seed + 3);
+            std::shuffle(scatter.begin(), scatter.end(), randEngine);
+            for(size_t i = 0; i < ranks.size(); ++i) {
+                keys.push_back(scatter[ranks[i]]);
+            }
+        }
+        else if(workload == "hotset") {
+            size_t hot = n / 100 > 0 ? n / 100 : 1;
+            vector<uint64_t> picks = makeRandomNumberVector<uint64_t>(ops, 0, 99, seed + 3, true);
+            vector<uint64_t> hotIndex = makeRandomNumberVector<uint64_t>(ops, 0, hot - 1, seed + 4, true);
+            keys = makeRandomNumberVector<uint64_t>(ops, 0, 2 * n - 1, seed + 2, true);
+            for(size_t i = 0; i < ops && n > 0; ++i) {
+                if(picks[i] < 80) keys[i] = plan.preload[hotIndex[i]];
+            }
+        }
+        else {
+            keys = makeRandomNumberVector<uint64_t>(ops, 0, 2 * n - 1, seed + 2, true);
+        }
+
+        bool insertNext = true;
+        for(size_t i = 0; i < ops; ++i) {
+            BenchOp op;
+            op.key = keys[i];
+            if((int)coins[i] < readPct) {
+                op.kind = OP_FIND;
+            }
+            else {
+                op.kind = insertNext ? OP_INSERT : OP_REMOVE;
+                insertNext = !insertNext;
+            }
+            plan.ops.push_back(op);
+        }
+    }
+
+    return plan;
+}
+
+/**
+* Builds a random-key stream with the given percentages of inserts and
+* removes; the rest are finds.  Removes take preloaded keys in random order,
+* then keys inserted during the run, so nearly all of them delete a node.
+*/
+static WorkloadPlan makeMixPlan(size_t n, size_t ops, int insertPct, int removePct, RandomSeed seed)
+{
+    WorkloadPlan plan;
+    plan.preload = makeRandomNumberVector<uint64_t>(n, 0, 4 * n - 1, seed, false);
+    vector<uint64_t> coins = makeRandomNumberVector<uint64_t>(ops, 0, 99, seed + 1, true);
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(ops, 0, 4 * n - 1, seed + 2, true);
+
+    vector<uint64_t> victims = plan.preload;
+    std::mt19937 randEngine(seed + 3);
+    std::shuffle(victims.begin(), victims.end(), randEngine);
+    size_t nextVictim = 0;
+
+    for(size_t i = 0; i < ops; ++i) {
+        BenchOp op;
+        op.key = keys[i];
+        if((int)coins[i] < insertPct) {
+            op.kind = OP_INSERT;
+            victims.push_back(keys[i]);
+        }
+        else if((int)coins[i] < insertPct + removePct) {
+            op.kind = OP_REMOVE;
+            if(nextVictim < victims.size()) {
+                op.key = victims[nextVictim++];
+            }
+        }
+        else {
+            op.kind = OP_FIND;
+        }
+        plan.ops.push_back(op);
+    }
+    return plan;
+}
+
+/*
+  -----------------------------------------
+  End workload plans.
+  -----------------------------------------
+*/
+
+/**
+* Preloads an engine, then times the plan's operation stream against it.
+*/
+template<typename Engine, typename Key>
+BenchResult runPlan(const string& engineName, const string& workload, int readPct, const WorkloadPlan& plan)
+{
+    typedef uint64_t Value;
+
+    // convert keys up front so conversion cost is not timed
+    vector<Key> preloadKeys, opKeys;
+    preloadKeys.reserve(plan.preload.size());
+    opKeys.reserve(plan.ops.size());
+    for(size_t i = 0; i < plan.preload.size(); ++i) {
+        preloadKeys.push_back(BenchKey<Key>::make(plan.preload[i]));
+    }
+    for(size_t i = 0; i < plan.ops.size(); ++i) {
+        opKeys.push_back(BenchKey<Key>::make(plan.ops[i].key));
+    }
+
+    BenchResult result;
+    result.engine = engineName;
+    result.key = BenchKey<Key>::name();
+    result.workload = workload;
+    result.readPct = readPct;
+    result.n = plan.preload.size();
+    result.ops = plan.ops.size();
+    result.hits = 0;
+
+    benchReleaseMemory();
+    uint64_t rssBefore = benchRssKb();
+    {
+        Engine engine;
+        for(size_t i = 0; i < preloadKeys.size(); ++i) {
+            benchInsert(engine, preloadKeys[i], (Value)i);
+        }
+
+#ifdef BST_PROFILE
+        BstProfiler::instance().reset();
+#endif
+        BenchTimer timer;
+        for(size_t i = 0; i < opKeys.size(); ++i) {
+#ifdef BST_PROFILE
+            BstProfiler::instance().setOperation(plan.ops[i].kind);
+#endif
+            switch(plan.ops[i].kind) {
+            case OP_FIND:
+                if(benchFind(engine, opKeys[i])) result.hits++;
+                break;
+            case OP_INSERT:
+                benchInsert(engine, opKeys[i], (Value)i);
+                break;
+            case OP_REMOVE:
+                benchRemove(engine, opKeys[i]);
+                break;
+            default:
+                break;
+            }
+        }
+        result.seconds = timer.seconds();
+#ifdef BST_PROFILE
+        BstProfiler::instance().setOperation(0);
+        result.profile.collect(BstProfiler::instance());
+#endif
+
+        uint64_t rssAfter = benchRssKb();
+        result.rssKb = rssAfter > rssBefore ? rssAfter - rssBefore : 0;
+    }
+
+    return result;
+}
+
+template<typename Key>
+void runEngines(const BenchConfig& cfg, const string& suite, const string& workload, int readPct, const WorkloadPlan& plan)
+{
+    typedef uint64_t Value;
+
+    for(size_t i = 0; i < cfg.engines.size(); ++i) {
+        const string& engine = cfg.engines[i];
+        BenchResult result;
+        if(engine == "bst") {
+            result = runPlan<BinarySearchTree<Key, Value>, Key>(engine, workload, readPct, plan);
+        }
+        else if(engine == "avl") {
+            result = runPlan<AVLTree<Key, Value>, Key>(engine, workload, readPct, plan);
+        }
+        else if(engine == "rb") {
+            result = runPlan<RedBlackTree<Key, Value>, Key>(engine, workload, readPct, plan);
+        }
+        else if(engine == "splay") {
+            result = runPlan<SplayTree<Key, Value>, Key>(engine, workload, readPct, plan);
+        }
+        else if(engine == "semisplay") {
+            result = runPlan<BenchSemiSplayTree<Key, Value>, Key>(engine, workload, readPct, plan);
+        }
+        else if(engine == "map") {
+            result = runPlan<std::map<Key, Value>, Key>(engine, workload, readPct, plan);
+        }
+        else {
+            cerr << "bench: unknown engine " << engine << endl;
+            continue;
+        }
+        result.suite = suite;
+#ifdef BST_PROFILE
+        printBenchProfile(cout, result);
+#else
+        printBenchResult(cout, result);
+#endif
+    }
+}
+
+/**
+* Suite "engines": every engine x key type x workload x read/write mix.
+*/
+static int runEnginesSuite(const BenchConfig& cfg)
+{
+#ifdef BST_PROFILE
+    printBenchProfileHeader(cout);
+#else
+    printBenchHeader(cout);
+#endif
+    for(size_t w = 0; w < cfg.workloads.size(); ++w) {
+        for(size_t r = 0; r < cfg.readPcts.size(); ++r) {
+            WorkloadPlan plan = makeWorkloadPlan(cfg.workloads[w], cfg.n, cfg.ops, cfg.readPcts[r], cfg.seed);
+            if(contains(cfg.keys, "u64")) {
+                runEngines<uint64_t>(cfg, "engines", cfg.workloads[w], cfg.readPcts[r], plan);
+            }
+            if(contains(cfg.keys, "string")) {
+                runEngines<std::string>(cfg, "engines", cfg.workloads[w], cfg.readPcts[r], plan);
+            }
+            if(contains(cfg.keys, "blob64")) {
+                runEngines<BenchBlob64>(cfg, "engines", cfg.workloads[w], cfg.readPcts[r], plan);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+* Suite "rb-vs-avl": red-black and AVL trees (std::map for reference) on
+* insert-heavy, delete-heavy and lookup-heavy mixes of random u64 keys.
+*/
+static int runRbVsAvlSuite(const BenchConfig& cfg)
+{
+    struct { const char* name; int insertPct; int removePct; } mixes[] = {
+        { "insert-heavy", 80, 10 },
+        { "delete-heavy", 10, 80 },
+        { "lookup-heavy", 5, 5 },
+    };
+    BenchConfig engines = cfg;
+    engines.engines = splitList("avl,rb,map");
+
+#ifdef BST_PROFILE
+    printBenchProfileHeader(cout);
+#else
+    printBenchHeader(cout);
+#endif
+    for(size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); ++m) {
+        WorkloadPlan plan = makeMixPlan(cfg.n, cfg.ops, mixes[m].insertPct, mixes[m].removePct, cfg.seed);
+        int readPct = 100 - mixes[m].insertPct - mixes[m].removePct;
+        runEngines<uint64_t>(engines, "rb-vs-avl", mixes[m].name, readPct, plan);
+    }
+    return 0;
+}
+
+/**
+* Suite "splay": splay and semi-splay trees against AVL (std::map for
+* reference) on skewed lookups - Zipfian keys and a 1% hot set taking 80%
+* of operations - with uniform keys as the control.  Also reports the
+* splay trees' rotations per operation, their amortized restructuring cost.
+*/
+static int runSplaySuite(const BenchConfig& cfg)
+{
+    const char* workloads[] = { "zipfian", "hotset", "random" };
+    const int readPcts[] = { 100, 95 };
+    BenchConfig engines = cfg;
+    engines.engines = splitList("avl,splay,semisplay,map");
+
+#ifdef BST_PROFILE
+    printBenchProfileHeader(cout);
+#else
+    printBenchHeader(cout);
+#endif
+    vector<string> rotations;
+    for(size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); ++w) {
+        for(size_t r = 0; r < sizeof(readPcts) / sizeof(readPcts[0]); ++r) {
+            WorkloadPlan plan = makeWorkloadPlan(workloads[w], cfg.n, cfg.ops, readPcts[r], cfg.seed);
+            runEngines<uint64_t>(engines, "splay", workloads[w], readPcts[r], plan);
+
+            for(int semi = 0; semi < 2; ++semi) {
+                SplayTree<uint64_t, uint64_t> tree(semi ? SPLAY_SEMI : SPLAY_FULL);
+                for(size_t i = 0; i < plan.preload.size(); ++i) benchInsert(tree, plan.preload[i], (uint64_t)i);
+                uint64_t before = tree.rotationCount();
+                for(size_t i = 0; i < plan.ops.size(); ++i) {
+                    if(plan.ops[i].kind == OP_FIND) benchFind(tree, plan.ops[i].key);
+                    else if(plan.ops[i].kind == OP_INSERT) benchInsert(tree, plan.ops[i].key, (uint64_t)i);
+                    else benchRemove(tree, plan.ops[i].key);
+                }
+                char buf[160];
+                snprintf(buf, sizeof(buf), "%s,%s,%d,%.2f", semi ? "semisplay" : "splay", workloads[w], readPcts[r],
+                    plan.ops.empty() ? 0.0 : (double)(tree.rotationCount() - before) / plan.ops.size());
+                rotations.push_back(buf);
+            }
+        }
+    }
+
+    cout << "engine,workload,read_pct,rotations_per_op\n";
+    for(size_t i = 0; i < rotations.size(); ++i) cout << rotations[i] << '\n';
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "reoptimize": an AVL tree samples the lookups of one run, then a
+* ReadOptimizedTree is built from it.  Reports both trees' average probe
+* depth under the sampled distribution next to its entropy, and times a
+* second run with the same distribution against each.
+*/
+static int runReoptimizeSuite(const BenchConfig& cfg)
+{
+    typedef uint64_t Value;
+    const char* workloads[] = { "zipfian", "hotset", "random" };
+    const unsigned samplePeriod = 16;
+
+    cout << "workload,n,ops,sample_period,entropy_bits,avl_probe_depth,reoptimized_probe_depth,"
+            "rebuild_s,avl_ns_per_find,reoptimized_ns_per_find,hits\n";
+    for(size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); ++w) {
+        WorkloadPlan training = makeWorkloadPlan(workloads[w], cfg.n, cfg.ops, 100, cfg.seed);
+        WorkloadPlan measured = makeWorkloadPlan(workloads[w], cfg.n, cfg.ops, 100, cfg.seed + 100);
+
+        AVLTree<uint64_t, Value> avl;
+        for(size_t i = 0; i < training.preload.size(); ++i) benchInsert(avl, training.preload[i], (Value)i);
+        avl.enableAccessSampling(samplePeriod);
+        for(size_t i = 0; i < training.ops.size(); ++i) benchFind(avl, training.ops[i].key);
+
+        double entropy = 0, total = 0;
+        const std::map<uint64_t, uint64_t>& counts = *avl.accessCounts();
+        for(std::map<uint64_t, uint64_t>::const_iterator it = counts.begin(); it != counts.end(); ++it) {
+            total += it->second;
+        }
+        for(std::map<uint64_t, uint64_t>::const_iterator it = counts.begin(); it != counts.end(); ++it) {
+            double p = it->second / total;
+            entropy -= p * std::log2(p);
+        }
+
+        BenchTimer timer;
+        ReadOptimizedTree<uint64_t, Value> reoptimized(avl);
+        double rebuildSeconds = timer.seconds();
+        double avlDepth = avl.averageProbeDepth();
+        double reoptimizedDepth = reoptimized.averageProbeDepth();
+        avl.disableAccessSampling();
+        reoptimized.disableAccessSampling();
+
+        uint64_t avlHits = 0, hits = 0;
+        timer.restart();
+        for(size_t i = 0; i < measured.ops.size(); ++i) {
+            if(benchFind(avl, measured.ops[i].key)) avlHits++;
+        }
+        double avlNs = timer.nanoseconds() / measured.ops.size();
+        timer.restart();
+        for(size_t i = 0; i < measured.ops.size(); ++i) {
+            if(benchFind(reoptimized, measured.ops[i].key)) hits++;
+        }
+        double reoptimizedNs = timer.nanoseconds() / measured.ops.size();
+        if(hits != avlHits) {
+            cerr << "bench: reoptimized tree found " << hits << " keys, AVL found " << avlHits << endl;
+        }
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s,%zu,%zu,%u,%.2f,%.2f,%.2f,%.6f,%.1f,%.1f,%llu",
+            workloads[w], cfg.n, measured.ops.size(), samplePeriod, entropy, avlDepth, reoptimizedDepth,
+            rebuildSeconds, avlNs, reoptimizedNs, (unsigned long long)hits);
+        cout << buf << '\n';
+    }
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "sorted": n keys inserted in ascending order, the append-only ID
+* stream that turns a plain BST into a list.  Compares the plain BST, the
+* plain BST rebalanced once with rebalance() after loading, scapegoat
+* mode and AVL, on load time and on uniform lookups afterwards.
+*/
+static int runSortedSuite(const BenchConfig& cfg)
+{
+    typedef uint64_t Value;
+    const char* engines[] = { "bst", "bst+rebalance", "scapegoat", "avl" };
+    vector<uint64_t> lookups = makeRandomNumberVector<uint64_t>(cfg.ops, 0, cfg.n - 1, cfg.seed, true);
+
+    cout << "engine,n,ops,insert_s,rebalance_s,ns_per_find,hits\n";
+    for(size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+        const string engine = engines[e];
+        BinarySearchTree<uint64_t, Value>* tree;
+        if(engine == "avl") tree = new AVLTree<uint64_t, Value>();
+        else tree = new BinarySearchTree<uint64_t, Value>();
+        if(engine == "scapegoat") tree->enableScapegoat();
+
+        BenchTimer timer;
+        for(uint64_t i = 0; i < cfg.n; ++i) benchInsert(*tree, i, (Value)i);
+        double insertSeconds = timer.seconds();
+
+        double rebalanceSeconds = 0;
+        if(engine == "bst+rebalance") {
+            timer.restart();
+            tree->rebalance();
+            rebalanceSeconds = timer.seconds();
+        }
+
+        uint64_t hits = 0;
+        timer.restart();
+        for(size_t i = 0; i < lookups.size(); ++i) {
+            if(benchFind(*tree, lookups[i])) hits++;
+        }
+        double findNs = lookups.empty() ? 0 : timer.nanoseconds() / lookups.size();
+        delete tree;
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s,%zu,%zu,%.6f,%.6f,%.1f,%llu", engine.c_str(), cfg.n, lookups.size(),
+            insertSeconds, rebalanceSeconds, findNs, (unsigned long long)hits);
+        cout << buf << '\n';
+    }
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "hinted": AVL insert and find from the root against the finger
+* versions that start from the previous operation's result, on a sorted
+* key stream, a nearly sorted one (a quarter of the keys swapped with a
+* key up to 16 places later) and a random one.  Lookups replay the stream
+* in the same order against the loaded tree.
+*/
+static int runHintedSuite(const BenchConfig& cfg)
+{
+    typedef uint64_t Value;
+    typedef AVLTree<uint64_t, Value> Tree;
+    const char* streams[] = { "sorted", "nearly-sorted", "random" };
+
+    cout << "stream,n,insert_ns,hinted_insert_ns,find_ns,find_from_ns,hits\n";
+    for(size_t s = 0; s < sizeof(streams) / sizeof(streams[0]); ++s) {
+        const string stream = streams[s];
+        vector<uint64_t> keys;
+        if(stream == "random") {
+            keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, 2 * cfg.n - 1, cfg.seed, false);
+        }
+        else {
+            for(uint64_t i = 0; i < cfg.n; ++i) keys.push_back(i);
+        }
+        if(stream == "nearly-sorted") {
+            vector<uint64_t> coins = makeRandomNumberVector<uint64_t>(cfg.n, 0, 63, cfg.seed, true);
+            for(size_t i = 0; i < keys.size(); ++i) {
+                if(coins[i] < 16 && i + coins[i] < keys.size()) std::swap(keys[i], keys[i + coins[i]]);
+            }
+        }
+
+        Tree plain, hinted;
+        BenchTimer timer;
+        for(size_t i = 0; i < keys.size(); ++i) plain.insert(std::make_pair(keys[i], (Value)i));
+        double insertNs = timer.nanoseconds() / keys.size();
+
+        timer.restart();
+        Tree::iterator hint = hinted.end();
+        for(size_t i = 0; i < keys.size(); ++i) hint = hinted.insert(hint, std::make_pair(keys[i], (Value)i));
+        double hintedInsertNs = timer.nanoseconds() / keys.size();
+
+        uint64_t hits = 0, fingerHits = 0;
+        timer.restart();
+        for(size_t i = 0; i < keys.size(); ++i) {
+            if(plain.find(keys[i]) != plain.end()) hits++;
+        }
+        double findNs = timer.nanoseconds() / keys.size();
+
+        timer.restart();
+        hint = hinted.end();
+        for(size_t i = 0; i < keys.size(); ++i) {
+            Tree::iterator it = hinted.find_from(hint, keys[i]);
+            if(it != hinted.end()) {
+                fingerHits++;
+                hint = it;
+            }
+        }
+        double findFromNs = timer.nanoseconds() / keys.size();
+        if(fingerHits != hits) {
+            cerr << "bench: find_from found " << fingerHits << " keys, find found " << hits << endl;
+        }
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s,%zu,%.1f,%.1f,%.1f,%.1f,%llu", stream.c_str(), cfg.n,
+            insertNs, hintedInsertNs, findNs, findFromNs, (unsigned long long)hits);
+        cout << buf << '\n';
+    }
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "batch": uniform random lookups (half of them misses) on an AVL
+* tree of n keys, one find() at a time against find_batch() over chunks
+* of 1024 keys.  Run it with --n large enough that the tree dwarfs the
+* last-level cache to see the overlap of the batched misses.
+*/
+static int runBatchSuite(const BenchConfig& cfg)
+{
+    typedef uint64_t Value;
+    typedef AVLTree<uint64_t, Value> Tree;
+    const size_t chunk = 1024;
+
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, 2 * cfg.n - 1, cfg.seed, false);
+    vector<uint64_t> probes = makeRandomNumberVector<uint64_t>(cfg.ops, 0, 2 * cfg.n - 1, cfg.seed + 1, true);
+    Tree tree;
+    for(size_t i = 0; i < keys.size(); ++i) tree.insert(std::make_pair(keys[i], (Value)i));
+
+    uint64_t hits = 0, batchHits = 0;
+    vector<Tree::iterator> single(probes.size()), batched(probes.size());
+    BenchTimer timer;
+    for(size_t i = 0; i < probes.size(); ++i) {
+        single[i] = tree.find(probes[i]);
+    }
+    double findNs = timer.nanoseconds() / probes.size();
+
+    timer.restart();
+    for(size_t i = 0; i < probes.size(); i += chunk) {
+        tree.find_batch(&probes[i], std::min(chunk, probes.size() - i), &batched[i]);
+    }
+    double batchNs = timer.nanoseconds() / probes.size();
+
+    for(size_t i = 0; i < probes.size(); ++i) {
+        if(single[i] != tree.end()) hits++;
+        if(batched[i] != tree.end()) batchHits++;
+        if(single[i] != batched[i]) {
+            cerr << "bench: find_batch differs from find for key " << probes[i] << endl;
+            return 1;
+        }
+    }
+
+    cout << "n,ops,chunk,find_ns,find_batch_ns,speedup,hits\n";
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%zu,%zu,%zu,%.1f,%.1f,%.2f,%llu", cfg.n, probes.size(), chunk,
+        findNs, batchNs, batchNs > 0 ? findNs / batchNs : 0.0, (unsigned long long)batchHits);
+    cout << buf << '\n';
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "sorted-probe": batches of m sorted random keys (half of them
+* misses) looked up in an AVL tree of n keys, per key with find() against
+* one find_sorted() walk per batch.  The walk's advantage grows with m/n,
+* as more of the probes share path prefixes.
+*/
+static int runSortedProbeSuite(const BenchConfig& cfg)
+{
+    typedef uint64_t Value;
+    typedef AVLTree<uint64_t, Value> Tree;
+    const size_t batchSizes[] = { 16, 256, 4096, 65536, 1048576 };
+
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, 2 * cfg.n - 1, cfg.seed, false);
+    Tree tree;
+    for(size_t i = 0; i < keys.size(); ++i) tree.insert(std::make_pair(keys[i], (Value)i));
+
+    cout << "n,batch,batches,find_ns,find_sorted_ns,speedup,hits\n";
+    for(size_t b = 0; b < sizeof(batchSizes) / sizeof(batchSizes[0]); ++b) {
+        size_t m = batchSizes[b];
+        size_t batches = std::max((size_t)1, cfg.ops / m);
+        vector<vector<uint64_t> > probes(batches);
+        for(size_t i = 0; i < batches; ++i) {
+            probes[i] = makeRandomNumberVector<uint64_t>(m, 0, 2 * cfg.n - 1, cfg.seed + 1 + i, true);
+            std::sort(probes[i].begin(), probes[i].end());
+        }
+
+        uint64_t hits = 0, walkHits = 0;
+        Value checksum = 0, walkChecksum = 0;
+        BenchTimer timer;
+        for(size_t i = 0; i < batches; ++i) {
+            for(size_t j = 0; j < m; ++j) {
+                Tree::iterator it = tree.find(probes[i][j]);
+                if(it != tree.end()) {
+                    hits++;
+                    checksum += it->second;
+                }
+            }
+        }
+        double findNs = timer.nanoseconds() / (batches * m);
+
+        timer.restart();
+        for(size_t i = 0; i < batches; ++i) {
+            tree.find_sorted(probes[i].begin(), probes[i].end(), [&](std::pair<const uint64_t, Value>& item) {
+                walkHits++;
+                walkChecksum += item.second;
+            });
+        }
+        double walkNs = timer.nanoseconds() / (batches * m);
+        if(walkHits != hits || walkChecksum != checksum) {
+            cerr << "bench: find_sorted found " << walkHits << " keys, find found " << hits << endl;
+            return 1;
+        }
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%zu,%zu,%zu,%.1f,%.1f,%.2f,%llu", cfg.n, m, batches, findNs, walkNs,
+            walkNs > 0 ? findNs / walkNs : 0.0, (unsigned long long)hits);
+        cout << buf << '\n';
+    }
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "apply-batch": sorted batches of m ops (half upserts, half
+* deletes, uniform keys) applied to AVL trees of n keys: plain
+* insert()/remove() calls, and apply_batch() per op, with a split/join
+* pass, with a rebuild and with BATCH_AUTO.  Up to 16 batches per size.
+* Reports ns per op and the smallest batch at which the rebuild beats the
+* join pass, the crossover BATCH_AUTO approximates.
+*/
+static int runApplyBatchSuite(const BenchConfig& cfg)
+{
+    typedef uint64_t Value;
+    typedef AVLTree<uint64_t, Value> Tree;
+    typedef BatchOp<uint64_t, Value> Op;
+
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, 2 * cfg.n - 1, cfg.seed, false);
+    // one tree at a time, so each tree's nodes are not interleaved with another's
+    Tree plain, perOp, joined, automatic, rebuilt;
+    Tree* trees[] = { &plain, &perOp, &joined, &automatic, &rebuilt };
+    for(size_t t = 0; t < 5; ++t) {
+        for(size_t i = 0; i < keys.size(); ++i) trees[t]->insert(std::make_pair(keys[i], (Value)i));
+    }
+
+    cout << "n,batch,batches,plain_ns,per_op_ns,join_ns,rebuild_ns,auto_ns\n";
+    size_t crossover = 0;
+    for(size_t m = std::max((size_t)1, cfg.n / 4096); m <= 16 * cfg.n; m *= 4) {
+        size_t batches = std::max((size_t)1, std::min(cfg.ops / m, (size_t)16));
+        vector<vector<Op> > plan(batches);
+        for(size_t b = 0; b < batches; ++b) {
+            vector<uint64_t> batchKeys = makeRandomNumberVector<uint64_t>(m, 0, 2 * cfg.n - 1, cfg.seed + 1 + b, true);
+            vector<uint64_t> coins = makeRandomNumberVector<uint64_t>(m, 0, 1, cfg.seed + 1001 + b, true);
+            std::sort(batchKeys.begin(), batchKeys.end());
+            plan[b].resize(m);
+            for(size_t i = 0; i < m; ++i) {
+                plan[b][i].kind = coins[i] ? BATCH_UPSERT : BATCH_DELETE;
+                plan[b][i].key = batchKeys[i];
+                plan[b][i].value = (Value)i;
+            }
+        }
+
+        BenchTimer timer;
+        for(size_t b = 0; b < batches; ++b) {
+            for(size_t i = 0; i < m; ++i) {
+                if(plan[b][i].kind == BATCH_UPSERT) plain.insert(std::make_pair(plan[b][i].key, plan[b][i].value));
+                else plain.remove(plan[b][i].key);
+            }
+        }
+        double plainNs = timer.nanoseconds() / (batches * m);
+
+        timer.restart();
+        for(size_t b = 0; b < batches; ++b) perOp.apply_batch(plan[b], BATCH_PER_OP);
+        double perOpNs = timer.nanoseconds() / (batches * m);
+
+        timer.restart();
+        for(size_t b = 0; b < batches; ++b) joined.apply_batch(plan[b], BATCH_JOIN);
+        double joinNs = timer.nanoseconds() / (batches * m);
+
+        timer.restart();
+        for(size_t b = 0; b < batches; ++b) automatic.apply_batch(plan[b]);
+        double autoNs = timer.nanoseconds() / (batches * m);
+
+        timer.restart();
+        for(size_t b = 0; b < batches; ++b) rebuilt.apply_batch(plan[b], BATCH_REBUILD);
+        double rebuildNs = timer.nanoseconds() / (batches * m);
+        if(crossover == 0 && rebuildNs < joinNs) crossover = m;
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%zu,%zu,%zu,%.1f,%.1f,%.1f,%.1f,%.1f", cfg.n, m, batches, plainNs, perOpNs, joinNs,
+                 rebuildNs, autoNs);
+        cout << buf << '\n';
+    }
+    cout << "n,crossover_batch,crossover_fraction\n";
+    cout << cfg.n << ',' << crossover << ',' << (double)crossover / cfg.n << '\n';
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "bulk-build": an AVLTree of n random keys (about a third of them
+* repeats) built by n inserts and by the bulk constructor on pools of 1,
+* 2, 4, ... up to --threads threads, each checked to hold the same items.
+* Speedup is against the bulk build on one thread; the parallel columns
+* only mean something with that many idle cores.
+*/
+static int runBulkBuildSuite(const BenchConfig& cfg)
+{
+    typedef AVLTree<uint64_t, uint64_t> Tree;
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, cfg.n, cfg.seed, false);
+    vector<std::pair<uint64_t, uint64_t> > items(keys.size());
+    for(size_t i = 0; i < keys.size(); ++i) items[i] = std::make_pair(keys[i], (uint64_t)i);
+
+    BenchTimer timer;
+    Tree inserted;
+    for(size_t i = 0; i < items.size(); ++i) inserted.insert(items[i]);
+    double insertMs = timer.nanoseconds() / 1e6;
+
+    cout << "n,cores,method,threads,build_ms,speedup\n";
+    double oneThreadMs = 0;
+    vector<unsigned> counts;
+    for(unsigned t = 1; t < cfg.threads; t *= 2) counts.push_back(t);
+    counts.push_back(cfg.threads);
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%zu,%u,inserts,1,%.2f,", cfg.n, parallelThreads(0), insertMs);
+    cout << buf << '\n';
+    for(size_t c = 0; c < counts.size(); ++c) {
+        WorkStealingPool pool(counts[c]);
+        timer.restart();
+        Tree built(items, pool);
+        double ms = timer.nanoseconds() / 1e6;
+        if(c == 0) oneThreadMs = ms;
+
+        Tree::iterator a = inserted.begin(), b = built.begin();
+        for(; a != inserted.end() && b != built.end() && *a == *b; ++a, ++b) { }
+        if(a != inserted.end() || b != built.end()) {
+            cerr << "bench: bulk build on " << counts[c] << " threads differs from inserts" << endl;
+            return 1;
+        }
+        snprintf(buf, sizeof(buf), "%zu,%u,bulk,%u,%.2f,%.2f", cfg.n, parallelThreads(0), counts[c], ms, oneThreadMs / ms);
+        cout << buf << '\n';
+    }
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "parallel-pass": whole-tree passes over an AVLTree of n random
+* keys, one iterator loop against parallel_reduce/parallel_for_each on
+* pools of 1, 2, 4, ... up to --threads threads: summing values, filtering
+* the even keys into a vector (a non-commutative, in-order reduce) and
+* incrementing every value.  Each parallel result is checked against the
+* serial one.  Speedup is against the serial loop; parallel columns only
+* mean something with that many idle cores.
+*/
+static int runParallelPassSuite(const BenchConfig& cfg)
+{
+    typedef AVLTree<uint64_t, uint64_t> Tree;
+    typedef std::pair<const uint64_t, uint64_t> Item;
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, 4 * cfg.n, cfg.seed, false);
+    Tree tree;
+    for(size_t i = 0; i < keys.size(); ++i) tree.insert(std::make_pair(keys[i], (uint64_t)i));
+
+    auto value = [](const Item& item) { return item.second; };
+    auto add = [](uint64_t a, uint64_t b) { return a + b; };
+    auto even = [](const Item& item) {
+        vector<uint64_t> kept;
+        if(item.first % 2 == 0) kept.push_back(item.first);
+        return kept;
+    };
+    auto append = [](vector<uint64_t> a, const vector<uint64_t>& b) {
+        a.insert(a.end(), b.begin(), b.end());
+        return a;
+    };
+    auto increment = [](Item& item) { item.second++; };
+
+    BenchTimer timer;
+    uint64_t sum = 0;
+    for(Tree::iterator it = tree.begin(); it != tree.end(); ++it) sum += it->second;
+    double sumMs = timer.nanoseconds() / 1e6;
+    timer.restart();
+    vector<uint64_t> filtered;
+    for(Tree::iterator it = tree.begin(); it != tree.end(); ++it) {
+        if(it->first % 2 == 0) filtered.push_back(it->first);
+    }
+    double filterMs = timer.nanoseconds() / 1e6;
+    timer.restart();
+    uint64_t size = 0;
+    for(Tree::iterator it = tree.begin(); it != tree.end(); ++it, ++size) it->second++;
+    double incrementMs = timer.nanoseconds() / 1e6;
+    // each increment pass adds size to the sum
+    sum += size;
+
+    cout << "n,cores,pass,threads,ms,speedup\n";
+    char buf[256];
+    const char* names[] = { "sum", "filter", "increment" };
+    double serialMs[] = { sumMs, filterMs, incrementMs };
+    for(size_t p = 0; p < 3; ++p) {
+        snprintf(buf, sizeof(buf), "%zu,%u,%s,serial,%.2f,1.00", cfg.n, parallelThreads(0), names[p], serialMs[p]);
+        cout << buf << '\n';
+    }
+
+    for(unsigned t = 1; ; t = std::min(2 * t, cfg.threads)) {
+        WorkStealingPool pool(t);
+        double ms[3];
+        timer.restart();
+        uint64_t parallelSum = tree.parallel_reduce((uint64_t)0, value, add, pool);
+        ms[0] = timer.nanoseconds() / 1e6;
+        timer.restart();
+        vector<uint64_t> parallelFiltered = tree.parallel_reduce(vector<uint64_t>(), even, append, pool);
+        ms[1] = timer.nanoseconds() / 1e6;
+        timer.restart();
+        tree.parallel_for_each(increment, pool);
+        ms[2] = timer.nanoseconds() / 1e6;
+
+        if(parallelSum != sum || parallelFiltered != filtered) {
+            cerr << "bench: parallel pass on " << t << " threads differs from the serial loop" << endl;
+            return 1;
+        }
+        for(size_t p = 0; p < 3; ++p) {
+            snprintf(buf, sizeof(buf), "%zu,%u,%s,%u,%.2f,%.2f", cfg.n, parallelThreads(0), names[p], t, ms[p],
+                     serialMs[p] / ms[p]);
+            cout << buf << '\n';
+        }
+        sum += size;
+        if(t == cfg.threads) break;
+    }
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "clone": copies of an AVLTree of n random keys, by iterating and
+* re-inserting, by the O(n) structural copy constructor, by the parallel
+* copy on pools of 1, 2, 4, ... up to --threads threads, and by a move.
+* Each copy is checked against the source and freed before the next.
+*/
+static int runCloneSuite(const BenchConfig& cfg)
+{
+    typedef AVLTree<uint64_t, uint64_t> Tree;
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, UINT64_MAX, cfg.seed, false);
+    Tree source;
+    for(size_t i = 0; i < keys.size(); ++i) source.insert(std::make_pair(keys[i], (uint64_t)i));
+
+    cout << "n,cores,method,threads,ms,speedup\n";
+    char buf[256];
+    double reinsertMs = 0;
+    unsigned t = 0;
+    for(int method = 0; method < 4; ++method) {
+        BenchTimer timer;
+        Tree* copy;
+        if(method == 0) {
+            copy = new Tree;
+            for(Tree::iterator it = source.begin(); it != source.end(); ++it) copy->insert(*it);
+        }
+        else if(method == 1) {
+            copy = new Tree(source);
+        }
+        else if(method == 2) {
+            t = t == 0 ? 1 : std::min(2 * t, cfg.threads);
+            WorkStealingPool pool(t);
+            timer.restart();
+            copy = new Tree(source, pool);
+        }
+        else {
+            Tree scratch(source);
+            timer.restart();
+            copy = new Tree(std::move(scratch));
+        }
+        double ms = timer.nanoseconds() / 1e6;
+        if(method == 0) reinsertMs = ms;
+
+        Tree::iterator a = source.begin(), b = copy->begin();
+        for(; a != source.end() && b != copy->end() && *a == *b; ++a, ++b) { }
+        bool same = a == source.end() && b == copy->end();
+        delete copy;
+        if(!same) {
+            cerr << "bench: clone method " << method << " differs from the source" << endl;
+            return 1;
+        }
+
+        const char* names[] = { "reinsert", "copy", "parallel", "move" };
+        snprintf(buf, sizeof(buf), "%zu,%u,%s,%u,%.3f,%.2f", cfg.n, parallelThreads(0), names[method],
+                 method == 2 ? t : 1, ms, reinsertMs / ms);
+        cout << buf << '\n';
+        // repeat the parallel copy for each thread count
+        if(method == 2 && t < cfg.threads) method--;
+    }
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "merge": an AVLTree of n random keys merges a smaller one of
+* n / ratio keys (about a third of them shared), relinking both trees'
+* nodes, moving the smaller's nodes in, and left to pick.  Trees are
+* built fresh, untimed, for each merge.  Throughput counts both trees'
+* items per second.
+*/
+static int runMergeSuite(const BenchConfig& cfg)
+{
+    typedef AVLTree<uint64_t, uint64_t> Tree;
+    auto add = [](const uint64_t&, const uint64_t& ours, const uint64_t& theirs) { return ours + theirs; };
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, 2 * cfg.n, cfg.seed, false);
+
+    cout << "n,small,ratio,rebuild_mitems_s,per_key_mitems_s,auto_mitems_s\n";
+    size_t crossover = 0;
+    for(size_t ratio = 1; ratio <= cfg.n && ratio <= 4096; ratio *= 2) {
+        size_t small = cfg.n / ratio;
+        vector<uint64_t> smallKeys = makeRandomNumberVector<uint64_t>(small, 0, 2 * cfg.n, cfg.seed + ratio, false);
+        double rate[3];
+        BatchStrategy strategies[] = { BATCH_REBUILD, BATCH_PER_OP, BATCH_AUTO };
+        for(int s = 0; s < 3; ++s) {
+            Tree large, other;
+            for(size_t i = 0; i < keys.size(); ++i) large.insert(std::make_pair(keys[i], (uint64_t)i));
+            for(size_t i = 0; i < smallKeys.size(); ++i) other.insert(std::make_pair(smallKeys[i], (uint64_t)i));
+            BenchTimer timer;
+            large.merge(other, add, strategies[s]);
+            rate[s] = (keys.size() + smallKeys.size()) / (timer.nanoseconds() / 1e3);
+        }
+        if(crossover == 0 && rate[1] > rate[0]) crossover = ratio;
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%zu,%zu,%zu,%.1f,%.1f,%.1f", cfg.n, small, ratio, rate[0], rate[1], rate[2]);
+        cout << buf << '\n';
+    }
+    cout << "n,crossover_ratio\n";
+    cout << cfg.n << ',' << crossover << '\n';
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "splice": moving --ops random entries, with 100-byte string
+* values, from an "active" AVLTree of n keys to an "expired" one: a find,
+* remove and insert per entry (a node freed, a node allocated, the value
+* copied twice) against an extract and a node-handle insert (the same
+* node relinked, nothing allocated or copied).
+*/
+static int runSpliceSuite(const BenchConfig& cfg)
+{
+    typedef AVLTree<uint64_t, string> Tree;
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, UINT64_MAX, cfg.seed, false);
+    vector<uint64_t> order = makeRandomNumberVector<uint64_t>(std::min(cfg.ops, cfg.n), 0, cfg.n - 1, cfg.seed + 1, true);
+    string payload(100, 'v');
+
+    cout << "n,moves,method,ns_per_move\n";
+    for(int method = 0; method < 2; ++method) {
+        Tree active, expired;
+        for(size_t i = 0; i < keys.size(); ++i) active.insert(std::make_pair(keys[i], payload));
+
+        BenchTimer timer;
+        for(size_t i = 0; i < order.size(); ++i) {
+            uint64_t key = keys[order[i]];
+            if(method == 0) {
+                Tree::iterator it = active.find(key);
+                if(it == active.end()) continue;
+                string value = it->second;
+                active.remove(key);
+                expired.insert(std::make_pair(key, value));
+            }
+            else {
+                Tree::node_type node = active.extract(key);
+                if(!node.empty()) expired.insert(std::move(node));
+            }
+        }
+        double ns = timer.nanoseconds() / order.size();
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%zu,%zu,%s,%.1f", cfg.n, order.size(), method == 0 ? "remove_insert" : "extract_insert", ns);
+        cout << buf << '\n';
+    }
+    cout.flush();
+    return 0;
+}
+
+// Slab objects for the "intrusive" suite: the same 64-byte payload, with
+// and without an embedded hook.  The hook sits next to the key, so a
+// descent step reads one cache line per object.
+struct BenchCacheObject
+{
+    uint64_t id;
+    char payload[56];
+};
+
+struct BenchHookedObject
+{
+    uint64_t id;
+    AVLHook byId;
+    char payload[56];
+};
+
+/**
+* Suite "intrusive": an index over n slab-allocated cache objects, as an
+* AVLTree<uint64_t, Object*> (a node allocated per object) and as an
+* IntrusiveAVLTree linking a hook inside each object.  Footprint is the
+* RSS growth for the slab plus the index, per object; throughput is n
+* inserts, n random finds and n removes, in ns per operation.
+*/
+static int runIntrusiveSuite(const BenchConfig& cfg)
+{
+    typedef AVLTree<uint64_t, BenchCacheObject*> PointerTree;
+    typedef IntrusiveAVLTree<BenchHookedObject, uint64_t, &BenchHookedObject::id, &BenchHookedObject::byId> HookTree;
+    vector<uint64_t> ids = makeRandomNumberVector<uint64_t>(cfg.n, 0, UINT64_MAX, cfg.seed, false);
+    vector<uint64_t> probes = makeRandomNumberVector<uint64_t>(cfg.n, 0, cfg.n - 1, cfg.seed + 1, true);
+
+    cout << "n,engine,object_bytes,bytes_per_object,insert_ns,find_ns,remove_ns,hits\n";
+    for(int engine = 0; engine < 2; ++engine) {
+        uint64_t ns[3];
+        uint64_t hits = 0;
+        size_t objectBytes = engine == 0 ? sizeof(BenchCacheObject) : sizeof(BenchHookedObject);
+        benchReleaseMemory();
+        uint64_t rssBefore = benchRssKb();
+        uint64_t rssAfter;
+        BenchTimer timer;
+        if(engine == 0) {
+            vector<BenchCacheObject> slab(ids.size());
+            PointerTree index;
+            timer.restart();
+            for(size_t i = 0; i < ids.size(); ++i) {
+                slab[i].id = ids[i];
+                index.insert(std::make_pair(ids[i], &slab[i]));
+            }
+            ns[0] = timer.nanoseconds();
+            rssAfter = benchRssKb();
+            timer.restart();
+            for(size_t i = 0; i < probes.size(); ++i) {
+                PointerTree::iterator it = index.find(ids[probes[i]]);
+                if(it != index.end() && it->second->id == ids[probes[i]]) hits++;
+            }
+            ns[1] = timer.nanoseconds();
+            timer.restart();
+            for(size_t i = 0; i < ids.size(); ++i) index.remove(ids[i]);
+            ns[2] = timer.nanoseconds();
+        }
+        else {
+            vector<BenchHookedObject> slab(ids.size());
+            HookTree index;
+            timer.restart();
+            for(size_t i = 0; i < ids.size(); ++i) {
+                slab[i].id = ids[i];
+                index.insert(slab[i]);
+            }
+            ns[0] = timer.nanoseconds();
+            rssAfter = benchRssKb();
+            timer.restart();
+            for(size_t i = 0; i < probes.size(); ++i) {
+                BenchHookedObject* object = index.find(ids[probes[i]]);
+                if(object != NULL && object->id == ids[probes[i]]) hits++;
+            }
+            ns[1] = timer.nanoseconds();
+            timer.restart();
+            for(size_t i = 0; i < ids.size(); ++i) index.erase(slab[i]);
+            ns[2] = timer.nanoseconds();
+        }
+        double perObject = rssAfter > rssBefore ? (rssAfter - rssBefore) * 1024.0 / ids.size() : 0;
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%zu,%s,%zu,%.1f,%.1f,%.1f,%.1f,%llu", cfg.n, engine == 0 ? "avl_pointer" : "intrusive",
+            objectBytes, perObject, (double)ns[0] / ids.size(), (double)ns[1] / probes.size(), (double)ns[2] / ids.size(),
+            (unsigned long long)hits);
+        cout << buf << '\n';
+    }
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "threaded": iteration over an AVLTree of n random keys, plain and
+* with enableThreads(): a full in-order scan, and --ops short range scans
+* (a find, then 16 or 256 steps of ++).  Also times n random inserts and
+* then n removes into each, the cost of keeping the threads.
+*/
+static int runThreadedSuite(const BenchConfig& cfg)
+{
+    typedef AVLTree<uint64_t, uint64_t> Tree;
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, UINT64_MAX, cfg.seed, false);
+    vector<uint64_t> starts = makeRandomNumberVector<uint64_t>(std::min(cfg.ops, cfg.n), 0, cfg.n - 1, cfg.seed + 1, true);
+    size_t lengths[] = { 16, 256 };
+
+    cout << "n,layout,insert_ns,scan_ns_per_item,range16_ns_per_item,range256_ns_per_item,remove_ns,checksum\n";
+    for(int threaded = 0; threaded < 2; ++threaded) {
+        Tree tree;
+        if(threaded) tree.enableThreads();
+        BenchTimer timer;
+        for(size_t i = 0; i < keys.size(); ++i) tree.insert(std::make_pair(keys[i], (uint64_t)i));
+        double insertNs = (double)timer.nanoseconds() / keys.size();
+
+        uint64_t checksum = 0;
+        timer.restart();
+        for(Tree::iterator it = tree.begin(); it != tree.end(); ++it) checksum += it->second;
+        double scanNs = (double)timer.nanoseconds() / keys.size();
+
+        double rangeNs[2];
+        for(int l = 0; l < 2; ++l) {
+            size_t items = 0;
+            timer.restart();
+            for(size_t i = 0; i < starts.size(); ++i) {
+                Tree::iterator it = tree.find(keys[starts[i]]);
+                for(size_t step = 0; step < lengths[l] && it != tree.end(); ++step, ++it, ++items) {
+                    checksum += it->second;
+                }
+            }
+            rangeNs[l] = (double)timer.nanoseconds() / std::max((size_t)1, items);
+        }
+
+        timer.restart();
+        for(size_t i = 0; i < keys.size(); ++i) tree.remove(keys[i]);
+        double removeNs = (double)timer.nanoseconds() / keys.size();
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%zu,%s,%.1f,%.2f,%.2f,%.2f,%.1f,%llu", cfg.n, threaded ? "threaded" : "plain",
+            insertNs, scanNs, rangeNs[0], rangeNs[1], removeNs, (unsigned long long)checksum);
+        cout << buf << '\n';
+    }
+    cout.flush();
+    return 0;
+}
+
+// Replaces rounds * keys.size() random keys of tree, one remove and one
+// insert at a time, so its nodes end up scattered over the heap.
+static void churnTree(AVLTree<uint64_t, uint64_t>& tree, vector<uint64_t>& keys, size_t rounds, RandomSeed seed)
+{
+    vector<uint64_t> picks = makeRandomNumberVector<uint64_t>(rounds * keys.size(), 0, keys.size() - 1, seed, true);
+    vector<uint64_t> fresh = makeRandomNumberVector<uint64_t>(picks.size(), 0, UINT64_MAX, seed + 1, true);
+    for(size_t i = 0; i < picks.size(); ++i) {
+        tree.remove(keys[picks[i]]);
+        keys[picks[i]] = fresh[i];
+        tree.insert(std::make_pair(fresh[i], (uint64_t)i));
+    }
+}
+
+/**
+* Suite "compact": an AVLTree of n keys after 2n random replacements,
+* then compacted into van Emde Boas order, then into key order, then
+* churned again and compacted incrementally, CompactBlockNodes nodes per
+* compact_step().  Each state reports the compaction time (and the
+* longest step), a full scan and --ops random finds.
+*/
+static int runCompactSuite(const BenchConfig& cfg)
+{
+    typedef AVLTree<uint64_t, uint64_t> Tree;
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, UINT64_MAX, cfg.seed, false);
+    Tree tree;
+    for(size_t i = 0; i < keys.size(); ++i) tree.insert(std::make_pair(keys[i], (uint64_t)i));
+    churnTree(tree, keys, 2, cfg.seed + 1);
+
+    cout << "n,state,compact_ms,max_step_us,scan_ns_per_item,find_ns,hits,checksum\n";
+    const char* states[] = { "churned", "veb", "key-order", "rechurned", "incremental" };
+    for(int state = 0; state < 5; ++state) {
+        double compactMs = 0, maxStepUs = 0;
+        BenchTimer timer;
+        if(state == 1) tree.compact(COMPACT_VEB);
+        if(state == 2) tree.compact(COMPACT_KEY_ORDER);
+        if(state == 3) churnTree(tree, keys, 2, cfg.seed + 2);
+        if(state == 4) {
+            bool done = false;
+            while(!done) {
+                BenchTimer step;
+                done = tree.compact_step(Tree::CompactBlockNodes);
+                maxStepUs = std::max(maxStepUs, step.nanoseconds() / 1e3);
+            }
+        }
+        if(state != 0 && state != 3) compactMs = timer.nanoseconds() / 1e6;
+
+        uint64_t sum = 0;
+        timer.restart();
+        for(Tree::iterator it = tree.begin(); it != tree.end(); ++it) sum += it->second;
+        double scanNs = (double)timer.nanoseconds() / keys.size();
+
+        vector<uint64_t> probes = makeRandomNumberVector<uint64_t>(cfg.ops, 0, keys.size() - 1, cfg.seed + 3, true);
+        size_t hits = 0;
+        timer.restart();
+        for(size_t i = 0; i < probes.size(); ++i) {
+            if(tree.find(keys[probes[i]]) != tree.end()) hits++;
+        }
+        double findNs = (double)timer.nanoseconds() / std::max((size_t)1, probes.size());
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%zu,%s,%.1f,%.1f,%.2f,%.1f,%zu,%llu", cfg.n, states[state], compactMs, maxStepUs,
+            scanNs, findNs, hits, (unsigned long long)sum);
+        cout << buf << '\n';
+    }
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "compressed": a cold map of n uint64_t keys, dense (drawn from
+* [0, 4n)) and sparse (the full 64-bit range), as an AVLTree and as the
+* CompressedMap exported from it.  Footprint is the RSS growth per key of
+* building each (values included); then --ops finds of present keys, --ops
+* finds of absent ones, --ops lower bounds (compressed only: the tree has
+* none; checked against a sorted copy of the keys) and a full scan.  Hits
+* and checksum cover the finds and the scan, so the engines must agree.
+*/
+static int runCompressedSuite(const BenchConfig& cfg)
+{
+    typedef AVLTree<uint64_t, uint64_t> Tree;
+    typedef CompressedMap<uint64_t> Compressed;
+    const char* spreads[] = { "dense", "sparse" };
+
+    cout << "keys,n,engine,build_ms,bytes_per_key,bits_per_key_index,find_ns,miss_ns,lower_bound_ns,"
+            "scan_ns_per_item,hits,checksum\n";
+    for(int spread = 0; spread < 2; ++spread) {
+        uint64_t top = spread == 0 ? 4 * (uint64_t)cfg.n : UINT64_MAX;
+        vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, top, cfg.seed, false);
+        vector<uint64_t> picks = makeRandomNumberVector<uint64_t>(cfg.ops, 0, keys.size() - 1, cfg.seed + 1, true);
+        vector<uint64_t> probes = makeRandomNumberVector<uint64_t>(cfg.ops, 0, top, cfg.seed + 2, true);
+        vector<uint64_t> sortedKeys(keys);
+        std::sort(sortedKeys.begin(), sortedKeys.end());
+        sortedKeys.erase(std::unique(sortedKeys.begin(), sortedKeys.end()), sortedKeys.end());
+        uint64_t wantBounds = 0;
+        for(size_t i = 0; i < probes.size(); ++i) {
+            wantBounds += std::lower_bound(sortedKeys.begin(), sortedKeys.end(), probes[i]) - sortedKeys.begin();
+        }
+
+        benchReleaseMemory();
+        uint64_t rssBefore = benchRssKb();
+        BenchTimer timer;
+        Tree tree;
+        for(size_t i = 0; i < keys.size(); ++i) tree.insert(std::make_pair(keys[i], keys[i] * 3));
+        double treeMs = timer.nanoseconds() / 1e6;
+        uint64_t rssTree = benchRssKb();
+        timer.restart();
+        Compressed compressed(tree);
+        double compressedMs = timer.nanoseconds() / 1e6;
+        benchReleaseMemory();
+        uint64_t rssCompressed = benchRssKb();
+
+        size_t avlHits = 0;
+        uint64_t avlSum = 0;
+        for(int engine = 0; engine < 2; ++engine) {
+            uint64_t grownKb = engine == 0 ? rssTree - std::min(rssTree, rssBefore)
+                                           : rssCompressed - std::min(rssCompressed, rssTree);
+            double bytesPerKey = (double)grownKb * 1024 / keys.size();
+            // the packed keys and sparse index, without the values
+            double keyBits = engine == 0 ? 0 : (compressed.memoryBytes() - keys.size() * sizeof(uint64_t)) * 8.0 / keys.size();
+
+            size_t hits = 0;
+            uint64_t sum = 0, value;
+            timer.restart();
+            for(size_t i = 0; i < picks.size(); ++i) {
+                if(engine == 0) {
+                    Tree::iterator it = tree.find(keys[picks[i]]);
+                    if(it != tree.end()) { hits++; sum += it->second; }
+                }
+                else if(compressed.find(keys[picks[i]], value)) { hits++; sum += value; }
+            }
+            double findNs = (double)timer.nanoseconds() / std::max((size_t)1, picks.size());
+
+            timer.restart();
+            for(size_t i = 0; i < probes.size(); ++i) {
+                if(engine == 0) {
+                    if(tree.find(probes[i]) != tree.end()) hits++;
+                }
+                else if(compressed.find(probes[i], value)) hits++;
+            }
+            double missNs = (double)timer.nanoseconds() / std::max((size_t)1, probes.size());
+
+            double lowerBoundNs = 0;
+            if(engine == 1) {
+                uint64_t bounds = 0;
+                timer.restart();
+                for(size_t i = 0; i < probes.size(); ++i) bounds += compressed.lowerBound(probes[i]);
+                lowerBoundNs = (double)timer.nanoseconds() / std::max((size_t)1, probes.size());
+                if(bounds != wantBounds) {
+                    cerr << "bench: compressed lower bounds differ from a sorted search" << endl;
+                    return 1;
+                }
+            }
+
+            timer.restart();
+            if(engine == 0) {
+                for(Tree::iterator it = tree.begin(); it != tree.end(); ++it) sum += it->first ^ it->second;
+            }
+            else {
+                compressed.for_each([&sum](uint64_t key, const uint64_t& v) { sum += key ^ v; });
+            }
+            double scanNs = (double)timer.nanoseconds() / keys.size();
+            if(engine == 0) {
+                avlHits = hits;
+                avlSum = sum;
+            }
+            else if(hits != avlHits || sum != avlSum) {
+                cerr << "bench: compressed map results differ from the tree's" << endl;
+                return 1;
+            }
+
+            char buf[256];
+            snprintf(buf, sizeof(buf), "%s,%zu,%s,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f,%zu,%llu", spreads[spread],
+                cfg.n, engine == 0 ? "avl" : "compressed", engine == 0 ? treeMs : compressedMs, bytesPerKey, keyBits,
+                findNs, missNs, lowerBoundNs, scanNs, hits, (unsigned long long)sum);
+            cout << buf << '\n';
+        }
+    }
+    cout.flush();
+    return 0;
+}
+
+// the p-th percentile (0-100) of samples, which it sorts
+static uint64_t percentile(vector<uint64_t>& samples, double p)
+{
+    if(samples.empty()) {
+        return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t index = (size_t)(p / 100 * (samples.size() - 1) + 0.5);
+    return samples[index];
+}
+
+/**
+* Suite "buffered": random inserts into trees preloaded with n keys, each
+* timed on its own, straight into an AVLTree and through a
+* BufferedAVLTree merging in the background and inline.  Then random
+* lookups (half misses) against the unflushed maps, with the buffered
+* maps' probes per read: the read amplification of the buffer.
+*/
+static int runBufferedSuite(const BenchConfig& cfg)
+{
+    typedef uint64_t Value;
+    const char* engines[] = { "avl", "buffered-bg", "buffered-inline" };
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.n, 0, 2 * cfg.n - 1, cfg.seed, false);
+    vector<uint64_t> writes = makeRandomNumberVector<uint64_t>(cfg.ops, 0, 2 * cfg.n - 1, cfg.seed + 1, true);
+    vector<uint64_t> reads = makeRandomNumberVector<uint64_t>(cfg.ops, 0, 2 * cfg.n - 1, cfg.seed + 2, true);
+
+    cout << "engine,n,ops,insert_mean_ns,insert_p50_ns,insert_p99_ns,insert_p999_ns,insert_max_ns,"
+            "find_ns,probes_per_read,hits\n";
+    for(size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+        const string engine = engines[e];
+        BufferedOptions options;
+        options.backgroundMerge = engine == "buffered-bg";
+        AVLTree<uint64_t, Value> direct;
+        BufferedAVLTree<uint64_t, Value> buffered(options);
+        bool isDirect = engine == "avl";
+        for(size_t i = 0; i < keys.size(); ++i) {
+            if(isDirect) direct.insert(std::make_pair(keys[i], (Value)i));
+            else buffered.insert(std::make_pair(keys[i], (Value)i));
+        }
+        buffered.flush();
+
+        vector<uint64_t> latencies(writes.size());
+        BenchTimer total;
+        for(size_t i = 0; i < writes.size(); ++i) {
+            BenchTimer timer;
+            if(isDirect) direct.insert(std::make_pair(writes[i], (Value)i));
+            else buffered.insert(std::make_pair(writes[i], (Value)i));
+            latencies[i] = timer.nanoseconds();
+        }
+        double meanNs = writes.empty() ? 0 : (double)total.nanoseconds() / writes.size();
+
+        uint64_t hits = 0;
+        uint64_t readsBefore = buffered.reads(), probesBefore = buffered.probes();
+        BenchTimer timer;
+        for(size_t i = 0; i < reads.size(); ++i) {
+            Value value;
+            if(isDirect ? direct.find(reads[i]) != direct.end() : buffered.find(reads[i], value)) hits++;
+        }
+        double findNs = reads.empty() ? 0 : (double)timer.nanoseconds() / reads.size();
+        double probes = isDirect ? 1.0 : (double)(buffered.probes() - probesBefore) /
+                                         std::max((uint64_t)1, buffered.reads() - readsBefore);
+
+        char buf[320];
+        uint64_t p50 = percentile(latencies, 50), p99 = percentile(latencies, 99);
+        uint64_t p999 = percentile(latencies, 99.9), worst = latencies.empty() ? 0 : latencies.back();
+        snprintf(buf, sizeof(buf), "%s,%zu,%zu,%.1f,%llu,%llu,%llu,%llu,%.1f,%.2f,%llu", engine.c_str(), cfg.n,
+            writes.size(), meanNs, (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999,
+            (unsigned long long)worst, findNs, probes, (unsigned long long)hits);
+        cout << buf << '\n';
+    }
+    cout.flush();
+    return 0;
+}
+
+/*
+  -----------------------------------------
+  Begin regression snippets.
+  These follow hw4_tests/bst_tests/bst_runtime_tests.cpp and keep its test
+  names, but time a batch of operations instead of one so that the samples
+  are well above the clock resolution.
+  -----------------------------------------
+*/
+
+static const uint64_t regressBatch = 32;
+
+// keys 1..numElements-1 in an order that builds a perfectly balanced BST
+static vector<uint64_t> makeBalancedOrder(uint64_t numElements)
+{
+    vector<uint64_t> elems;
+    uint64_t numPerLevel = 1;
+    for(uint64_t start = numElements / 2; start >= 1; start /= 2, numPerLevel *= 2) {
+        uint64_t val = start, step = start * 2;
+        for(uint64_t j = 0; j < numPerLevel; j++) {
+            elems.push_back(val);
+            val += step;
+        }
+    }
+    return elems;
+}
+
+template<typename Tree>
+static void fillTree(Tree& tree, const vector<uint64_t>& keys)
+{
+    for(size_t i = 0; i < keys.size(); ++i) {
+        tree.insert(std::make_pair(keys[i], keys[i]));
+    }
+}
+
+static uint64_t snippetInsertBalanced(uint64_t numElements, RandomSeed)
+{
+    BinarySearchTree<uint64_t, uint64_t> tree;
+    fillTree(tree, makeBalancedOrder(numElements));
+
+    BenchTimer timer;
+    for(uint64_t i = 0; i < regressBatch; ++i) {
+        tree.insert(std::make_pair(numElements + 1 + i, i));
+    }
+    return timer.nanoseconds();
+}
+
+static uint64_t snippetRemoveBalancedRoot(uint64_t numElements, RandomSeed)
+{
+    BinarySearchTree<uint64_t, uint64_t> tree;
+    vector<uint64_t> elems = makeBalancedOrder(numElements);
+    fillTree(tree, elems);
+
+    // the first keys of the balanced order sit at the top of the tree
+    BenchTimer timer;
+    for(uint64_t i = 0; i < regressBatch && i < elems.size(); ++i) {
+        tree.remove(elems[i]);
+    }
+    return timer.nanoseconds();
+}
+
+static uint64_t snippetRemoveBalancedMin(uint64_t numElements, RandomSeed)
+{
+    BinarySearchTree<uint64_t, uint64_t> tree;
+    fillTree(tree, makeBalancedOrder(numElements));
+
+    BenchTimer timer;
+    for(uint64_t i = 1; i <= regressBatch && i < numElements; ++i) {
+        tree.remove(i);
+    }
+    return timer.nanoseconds();
+}
+
+static uint64_t snippetGetSmallestNodeBalanced(uint64_t numElements, RandomSeed)
+{
+    BinarySearchTree<uint64_t, uint64_t> tree;
+    fillTree(tree, makeBalancedOrder(numElements));
+
+    // getSmallestNode() is protected; begin() is a thin wrapper around it
+    uint64_t sum = 0;
+    BenchTimer timer;
+    for(uint64_t i = 0; i < regressBatch; ++i) {
+        sum += tree.begin()->first;
+    }
+    uint64_t time = timer.nanoseconds();
+    return sum == 0 ? 0 : time;
+}
+
+static uint64_t snippetFindNodeBalanced(uint64_t numElements, RandomSeed seed)
+{
+    BinarySearchTree<uint64_t, uint64_t> tree;
+    fillTree(tree, makeBalancedOrder(numElements));
+    vector<uint64_t> probes = makeRandomNumberVector<uint64_t>(regressBatch, 1, numElements - 1, seed, true);
+
+    uint64_t hits = 0;
+    BenchTimer timer;
+    for(size_t i = 0; i < probes.size(); ++i) {
+        if(tree.find(probes[i]) != tree.end()) hits++;
+    }
+    uint64_t time = timer.nanoseconds();
+    return hits == 0 ? 0 : time;
+}
+
+static uint64_t snippetIteratorBalanced(uint64_t numElements, RandomSeed)
+{
+    BinarySearchTree<uint64_t, uint64_t> tree;
+    fillTree(tree, makeBalancedOrder(numElements));
+
+    uint64_t sum = 0;
+    BenchTimer timer;
+    for(BinarySearchTree<uint64_t, uint64_t>::iterator it = tree.begin(); it != tree.end(); ++it) {
+        sum += it->second;
+    }
+    uint64_t time = timer.nanoseconds();
+    return sum == 0 ? 0 : time;
+}
+
+static uint64_t snippetAVLInsertRandom(uint64_t numElements, RandomSeed seed)
+{
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(numElements + regressBatch, 0, 4 * numElements, seed, false);
+    AVLTree<uint64_t, uint64_t> tree;
+    fillTree(tree, vector<uint64_t>(keys.begin(), keys.begin() + numElements));
+
+    BenchTimer timer;
+    for(size_t i = numElements; i < keys.size(); ++i) {
+        tree.insert(std::make_pair(keys[i], keys[i]));
+    }
+    return timer.nanoseconds();
+}
+
+static uint64_t snippetAVLRemoveRandom(uint64_t numElements, RandomSeed seed)
+{
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(numElements, 0, 4 * numElements, seed, false);
+    AVLTree<uint64_t, uint64_t> tree;
+    fillTree(tree, keys);
+
+    BenchTimer timer;
+    for(uint64_t i = 0; i < regressBatch && i < keys.size(); ++i) {
+        tree.remove(keys[i]);
+    }
+    return timer.nanoseconds();
+}
+
+static uint64_t snippetAVLFindRandom(uint64_t numElements, RandomSeed seed)
+{
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(numElements, 0, 4 * numElements, seed, false);
+    AVLTree<uint64_t, uint64_t> tree;
+    fillTree(tree, keys);
+
+    uint64_t hits = 0;
+    BenchTimer timer;
+    for(uint64_t i = 0; i < regressBatch; ++i) {
+        if(tree.find(keys[(i * 7919) % keys.size()]) != tree.end()) hits++;
+    }
+    uint64_t time = timer.nanoseconds();
+    return hits == 0 ? 0 : time;
+}
+
+/*
+  -----------------------------------------
+  End regression snippets.
+  -----------------------------------------
+*/
+
+/**
+* Suite "regress": times the runtime snippets per size and compares them
+* with the baseline file, or records it with --record.  Returns nonzero if
+* any test regressed beyond the threshold at a majority of its sizes.
+* Record and compare on a quiet machine; shared hosts can drift by more
+* than the default 10% between runs.
+*/
+static int runRegressSuite(const BenchConfig& cfg)
+{
+    struct { const char* name; RuntimeBaseline::Snippet snippet; } tests[] = {
+        { "BSTRuntime.InsertBalanced", snippetInsertBalanced },
+        { "BSTRuntime.RemoveBalancedRoot", snippetRemoveBalancedRoot },
+        { "BSTRuntime.RemoveBalancedMin", snippetRemoveBalancedMin },
+        { "BSTRuntime.GetSmallestNodeBalanced", snippetGetSmallestNodeBalanced },
+        { "BSTRuntime.FindNodeBalanced", snippetFindNodeBalanced },
+        { "BSTRuntime.IteratorBalanced", snippetIteratorBalanced },
+        { "AVLRuntime.InsertRandom", snippetAVLInsertRandom },
+        { "AVLRuntime.RemoveRandom", snippetAVLRemoveRandom },
+        { "AVLRuntime.FindRandom", snippetAVLFindRandom },
+    };
+    const size_t numTests = sizeof(tests) / sizeof(tests[0]);
+
+    // largest size is the power of two at or below --n
+    uint8_t maxExp = 6;
+    while(maxExp < 40 && ((uint64_t)2 << maxExp) <= cfg.n) ++maxExp;
+
+    BaselineStore store;
+    store.load(cfg.baselinePath);
+
+    cout << "test,n,trials,baseline_median_ns,current_median_ns,ratio,ci_low,ci_high,status\n";
+    int regressed = 0;
+    for(size_t t = 0; t < numTests; ++t) {
+        RuntimeBaseline baseline(tests[t].name, 6, maxExp, (uint8_t)cfg.trials, tests[t].snippet);
+        baseline.evaluate();
+
+        if(cfg.recordBaseline || !store.has(tests[t].name)) {
+            const RuntimeBaseline::DataSet& data = baseline.data();
+            for(size_t i = 0; i < data.size(); i += cfg.trials) {
+                cout << tests[t].name << ',' << data[i].first << ',' << cfg.trials << ",,,,,,"
+                     << (cfg.recordBaseline ? "recorded" : "no-baseline") << '\n';
+            }
+            if(cfg.recordBaseline) store.set(tests[t].name, baseline.data());
+            continue;
+        }
+
+        vector<BaselineComparison> cmps = baseline.compare(store.get(tests[t].name), cfg.regressionThreshold);
+        // a test fails when most of its sizes regress, so one noisy size does not fail it
+        size_t sizesRegressed = 0;
+        for(size_t i = 0; i < cmps.size(); ++i) {
+            const BaselineComparison& c = cmps[i];
+            const char* status = c.regressed ? "regressed" : (c.ciHigh < 1.0 - cfg.regressionThreshold ? "improved" : "ok");
+            char buf[160];
+            snprintf(buf, sizeof(buf), "%llu,%zu,%.0f,%.0f,%.3f,%.3f,%.3f,%s",
+                (unsigned long long)c.numElements, c.trials, c.baselineMedian, c.currentMedian,
+                c.ratio, c.ciLow, c.ciHigh, status);
+            cout << tests[t].name << ',' << buf << '\n';
+            if(c.regressed) sizesRegressed++;
+        }
+        if(!cmps.empty() && 2 * sizesRegressed > cmps.size()) regressed++;
+    }
+    cout.flush();
+
+    if(cfg.recordBaseline) {
+        store.save(cfg.baselinePath);
+        cerr << "bench: recorded baseline in " << cfg.baselinePath << endl;
+    }
+    else if(regressed > 0) {
+        cerr << "bench: " << regressed << " of " << numTests << " tests regressed by more than "
+             << cfg.regressionThreshold * 100 << "%" << endl;
+    }
+    return regressed > 0 ? 1 : 0;
+}
+
+/**
+* Suite "snapshot": cold-start cost of an AVL tree of n keys, rebuilt by n
+* inserts, loaded from a snapshot, or opened as a mapped snapshot without
+* materializing nodes, plus lookups against the mapped file.
+*/
+template<typename Key>
+static void runSnapshot(const BenchConfig& cfg, const string& keyName)
+{
+    typedef uint64_t Value;
+    const string path = "bench.snapshot";
+
+    vector<uint64_t> raw = makeRandomNumberVector<uint64_t>(cfg.n, 0, 4 * (uint64_t)cfg.n, cfg.seed, false);
+    vector<Key> keys;
+    for(size_t i = 0; i < raw.size(); ++i) keys.push_back(BenchKey<Key>::make(raw[i]));
+
+    BenchTimer timer;
+    AVLTree<Key, Value> built;
+    for(size_t i = 0; i < keys.size(); ++i) built.insert(std::make_pair(keys[i], (Value)i));
+    double insertSeconds = timer.seconds();
+
+    timer.restart();
+    built.save(path);
+    double saveSeconds = timer.seconds();
+
+    timer.restart();
+    AVLTree<Key, Value> loaded;
+    loaded.load(path);
+    double loadSeconds = timer.seconds();
+
+    timer.restart();
+    { MappedSnapshot<Key, Value> verified(path); }
+    double openSeconds = timer.seconds();
+
+    timer.restart();
+    MappedSnapshot<Key, Value> mapped(path, false);
+    double openNoVerifySeconds = timer.seconds();
+
+    vector<uint64_t> probes = makeRandomNumberVector<uint64_t>(cfg.ops, 0, 4 * (uint64_t)cfg.n, cfg.seed + 1, false);
+    uint64_t hits = 0, treeHits = 0;
+    Value value;
+    timer.restart();
+    for(size_t i = 0; i < probes.size(); ++i) {
+        if(mapped.find(BenchKey<Key>::make(probes[i]), value)) hits++;
+    }
+    double findNs = probes.empty() ? 0 : timer.nanoseconds() / probes.size();
+    for(size_t i = 0; i < probes.size(); ++i) {
+        if(loaded.find(BenchKey<Key>::make(probes[i])) != loaded.end()) treeHits++;
+    }
+    if(hits != treeHits || !loaded.isBalanced()) {
+        cerr << "bench: snapshot of " << keyName << " keys does not match the tree" << endl;
+    }
+
+    FILE* f = fopen(path.c_str(), "rb");
+    long bytes = 0;
+    if(f != NULL) {
+        fseek(f, 0, SEEK_END);
+        bytes = ftell(f);
+        fclose(f);
+    }
+    remove(path.c_str());
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%zu,%ld,%.6f,%.6f,%.6f,%.6f,%.6f,%.1f,%llu",
+        mapped.size(), bytes, insertSeconds, saveSeconds, loadSeconds, openSeconds,
+        openNoVerifySeconds, findNs, (unsigned long long)hits);
+    cout << keyName << ',' << buf << '\n';
+}
+
+static int runSnapshotSuite(const BenchConfig& cfg)
+{
+    cout << "key,n,file_bytes,insert_build_s,save_s,load_s,map_open_s,map_open_noverify_s,map_find_ns,hits\n";
+    if(contains(cfg.keys, "u64")) runSnapshot<uint64_t>(cfg, "u64");
+    if(contains(cfg.keys, "string")) runSnapshot<std::string>(cfg, "string");
+    cout.flush();
+    return 0;
+}
+
+/**
+* Suite "durable": committed operations per second of DurableAVLTree with an
+* fsync per operation and with group commit at two latency bounds, and the
+* time to recover a tree of n checkpointed keys plus the ops-long log tail.
+* Each run ends with sync(), so every timed operation is on disk.
+*/
+static int runDurableSuite(const BenchConfig& cfg)
+{
+    typedef uint64_t Value;
+    const string path = "bench.durable";
+    const unsigned latencies[] = { 0, 1000, 10000 };
+
+    vector<uint64_t> preload = makeRandomNumberVector<uint64_t>(cfg.n, 0, 4 * (uint64_t)cfg.n, cfg.seed, false);
+    vector<uint64_t> keys = makeRandomNumberVector<uint64_t>(cfg.ops, 0, 4 * (uint64_t)cfg.n, cfg.seed + 1, true);
+
+    cout << "mode,latency_us,n,ops,seconds,committed_ops_per_sec,fsyncs,recovery_s,replayed\n";
+    for(size_t m = 0; m < sizeof(latencies) / sizeof(latencies[0]); ++m) {
+        remove((path + ".snap").c_str());
+        remove((path + ".wal").c_str());
+
+        DurableOptions options;
+        options.groupCommitMicros = latencies[m];
+        double seconds;
+        uint64_t fsyncs;
+        {
+            DurableOptions loadOptions;
+            DurableAVLTree<uint64_t, Value> tree(path, loadOptions);
+            for(size_t i = 0; i < preload.size(); ++i) tree.insert(std::make_pair(preload[i], (Value)i));
+            tree.checkpoint();
+        }
+        {
+            DurableAVLTree<uint64_t, Value> tree(path, options);
+            BenchTimer timer;
+            for(size_t i = 0; i < keys.size(); ++i) {
+                // three inserts to every remove
+                if(i % 4 == 3) tree.remove(keys[i]);
+                else tree.insert(std::make_pair(keys[i], (Value)i));
+            }
+            tree.sync();
+            seconds = timer.seconds();
+            fsyncs = tree.syncCount();
+        }
+
+        BenchTimer timer;
+        DurableAVLTree<uint64_t, Value> recovered(path, options);
+        double recoverySeconds = timer.seconds();
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s,%u,%zu,%zu,%.6f,%.0f,%llu,%.6f,%llu",
+            latencies[m] == 0 ? "fsync-per-op" : "group-commit", latencies[m], cfg.n, keys.size(),
+            seconds, keys.size() / seconds, (unsigned long long)fsyncs, recoverySeconds,
+            (unsigned long long)recovered.recoveredRecords());
+        cout << buf << '\n';
+    }
+    remove((path + ".snap").c_str());
+    remove((path + ".wal").c_str());
+    cout.flush();
+    return 0;
+}
+
+struct BenchSuite
+{
+    const char* name;
+    const char* description;
+    int (*run)(const BenchConfig& cfg);   // returns nonzero on failure
+};
+
+static const BenchSuite suites[] = {
+    { "engines", "BST vs AVL vs red-black vs std::map across workloads, key types and read/write mixes", runEnginesSuite },
+    { "rb-vs-avl", "red-black vs AVL on insert-, delete- and lookup-heavy mixes", runRbVsAvlSuite },
+    { "splay", "splay and semi-splay vs AVL on Zipfian and hot-set lookups", runSplaySuite },
+    { "reoptimize", "sampled AVL vs access-weighted rebuild: probe depth and lookup time", runReoptimizeSuite },
+    { "sorted", "ascending inserts: plain BST vs DSW rebalance() vs scapegoat mode vs AVL", runSortedSuite },
+    { "hinted", "AVL insert/find from the root vs from the previous result on sorted, nearly sorted and random keys", runHintedSuite },
+    { "batch", "AVL random lookups: find() one at a time vs interleaved, prefetching find_batch()", runBatchSuite },
+    { "sorted-probe", "sorted key batches: per-key find() vs one find_sorted() walk per batch", runSortedProbeSuite },
+    { "apply-batch", "sorted upsert/delete batches on AVL: per-op calls vs apply_batch() per op, split/join, rebuilt and auto", runApplyBatchSuite },
+    { "buffered", "insert latency percentiles and lookup cost: AVL vs write-buffered AVL (background and inline merge)", runBufferedSuite },
+    { "bulk-build", "AVL from unsorted keys: n inserts vs the parallel bulk constructor on 1..--threads threads", runBulkBuildSuite },
+    { "parallel-pass", "AVL whole-tree sum, filter and update: iterator loop vs parallel_reduce/for_each on 1..--threads threads", runParallelPassSuite },
+    { "clone", "AVL copies: iterate and re-insert vs O(n) structural copy vs parallel copy on 1..--threads threads vs move", runCloneSuite },
+    { "merge", "AVL merge of a tree n/ratio the size: relink both trees vs insert the smaller vs auto, across ratios", runMergeSuite },
+    { "splice", "moving AVL entries between trees: find/remove/insert vs extract and node-handle insert", runSpliceSuite },
+    { "intrusive", "index over slab objects: AVLTree<Key, Object*> vs an intrusive AVL tree, bytes per object and insert/find/remove time", runIntrusiveSuite },
+    { "threaded", "AVL full and short range scans, plain vs threaded layout, and the insert/remove cost of keeping threads", runThreadedSuite },
+    { "compact", "churned AVL scan and find speed before and after compact() (vEB and key order) and incremental compact_step()", runCompactSuite },
+    { "compressed", "cold u64 map: AVL vs exported CompressedMap, bytes per key and find/miss/lower-bound/scan time, dense and sparse keys", runCompressedSuite },
+    { "regress", "runtime snippets compared against the recorded timing baseline", runRegressSuite },
+    { "snapshot", "AVL cold start: n inserts vs snapshot load vs mapped snapshot", runSnapshotSuite },
+    { "durable", "write-ahead logged AVL: fsync per op vs group commit, and recovery time", runDurableSuite },
+};
+
+static const size_t numSuites = sizeof(suites) / sizeof(suites[0]);
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    cfg.n = 10000;
+    cfg.ops = 10000;
+    cfg.seed = 104;
+    cfg.engines = splitList("bst,avl,rb,map");
+    cfg.keys = splitList("u64,string,blob64");
+    cfg.workloads = splitList("sequential,random,zipfian,hotset,sliding");
+    cfg.readPcts.push_back(100);
+    cfg.readPcts.push_back(95);
+    cfg.readPcts.push_back(50);
+    cfg.readPcts.push_back(5);
+    cfg.readPcts.push_back(0);
+    cfg.baselinePath = "bench_baseline.json";
+    cfg.recordBaseline = false;
+    cfg.regressionThreshold = 0.10;
+    cfg.trials = 15;
+    cfg.threads = parallelThreads(0);
+
+    vector<string> selected;
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        string opt = arg.substr(0, eq);
+        string value = eq == string::npos ? "" : arg.substr(eq + 1);
+
+        if(opt == "--n") cfg.n = strtoull(value.c_str(), NULL, 10);
+        else if(opt == "--ops") cfg.ops = strtoull(value.c_str(), NULL, 10);
+        else if(opt == "--seed") cfg.seed = (RandomSeed)strtoul(value.c_str(), NULL, 10);
+        else if(opt == "--engines") cfg.engines = splitList(value);
+        else if(opt == "--keys") cfg.keys = splitList(value);
+        else if(opt == "--workloads") cfg.workloads = splitList(value);
+        else if(opt == "--reads") {
+            vector<string> pcts = splitList(value);
+            cfg.readPcts.clear();
+            for(size_t p = 0; p < pcts.size(); ++p) {
+                cfg.readPcts.push_back(atoi(pcts[p].c_str()));
+            }
+        }
+        else if(opt == "--baseline") cfg.baselinePath = value;
+        else if(opt == "--record") cfg.recordBaseline = true;
+        else if(opt == "--threshold") cfg.regressionThreshold = atof(value.c_str());
+        else if(opt == "--trials") cfg.trials = atoi(value.c_str());
+        else if(opt == "--threads") cfg.threads = (unsigned)strtoul(value.c_str(), NULL, 10);
+        else if(opt == "--list") {
+            for(size_t s = 0; s < numSuites; ++s) {
+                cout << suites[s].name << "\t" << suites[s].description << endl;
+            }
+            return 0;
+        }
+        else if(opt.compare(0, 2, "--") == 0) {
+            cerr << "bench: unknown option " << arg << endl;
+            return 1;
+        }
+        else selected.push_back(arg);
+    }
+    if(cfg.n == 0 || cfg.ops == 0 || cfg.threads == 0 || cfg.trials <= 0 || cfg.trials > 255) {
+        cerr << "bench: --n, --ops and --threads must be positive, --trials between 1 and 255" << endl;
+        return 1;
+    }
+    if(selected.empty()) {
+        selected.push_back("engines");
+    }
+
+#ifdef BST_PROFILE
+    if(!BstProfiler::instance().counters().anyAvailable()) {
+        cerr << "bench: perf events unavailable (check kernel.perf_event_paranoid or container seccomp);"
+             << " counter columns are left empty" << endl;
+    }
+#endif
+    int status = 0;
+    for(size_t i = 0; i < selected.size(); ++i) {
+        bool found = false;
+        for(size_t s = 0; s < numSuites; ++s) {
+            if(selected[i] == suites[s].name) {
+                if(suites[s].run(cfg) != 0) status = 1;
+                found = true;
+            }
+        }
+        if(!found) {
+            cerr << "bench: unknown suite " << selected[i] << endl;
+            return 1;
+        }
+    }
+
+    return status;
+}
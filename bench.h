@@ -0,0 +1,519 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "bst.h"
+#include "avlbst.h"
+#include "splaybst.h"
+
+// Shared helpers for the benchmark driver (bench.cpp): workload generators,
+// benchmark key types, engine adapters and CSV output.
+
+// type for random seeds (same as the one used by hw4_tests/testing_utils)
+typedef uint32_t RandomSeed;
+
+/*
+  -----------------------------------------
+  Begin workload generators.
+  -----------------------------------------
+*/
+
+/**
+* Generates a vector of random integers in [min, max].
+* Same contract as makeRandomNumberVector() in hw4_tests/testing_utils/random_generator.h,
+* which cannot be linked here since the test utilities pull in gtest.
+*/
+template<typename IntType>
+std::vector<IntType> makeRandomNumberVector(size_t count, IntType min, IntType max, RandomSeed seed, bool allowDuplicates)
+{
+    std::mt19937 randEngine;
+    randEngine.seed(seed);
+
+    std::uniform_int_distribution<IntType> distributor(min, max);
+
+    std::vector<IntType> randomVector;
+    randomVector.reserve(count);
+    std::set<IntType> usedValues;
+    while(randomVector.size() < count) {
+        IntType randInt = distributor(randEngine);
+
+        // skip value if it's a duplicate
+        if(!allowDuplicates) {
+            if(usedValues.find(randInt) != usedValues.end()) {
+                continue;
+            }
+            usedValues.insert(randInt);
+        }
+
+        randomVector.push_back(randInt);
+    }
+
+    return randomVector;
+}
+
+/**
+* Generates a vector of integers in [min, max] following a Zipfian distribution
+* with skew theta (0 < theta < 1; 0.99 is the usual "hot set" setting).
+* min is the most popular value, min + 1 the second most popular, and so on.
+* Uses the closed-form approximation from Gray et al., "Quickly Generating
+* Billion-Record Synthetic Databases" (the generator YCSB uses).
+*/
+template<typename IntType>
+std::vector<IntType> makeZipfianNumberVector(size_t count, IntType min, IntType max, double theta, RandomSeed seed)
+{
+    std::mt19937 randEngine;
+    randEngine.seed(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    double items = (double)(max - min) + 1.0;
+    double zetan = 0.0;
+    for(uint64_t i = 1; i <= (uint64_t)items; ++i) {
+        zetan += 1.0 / std::pow((double)i, theta);
+    }
+    double zeta2 = 1.0 + 1.0 / std::pow(2.0, theta);
+    double alpha = 1.0 / (1.0 - theta);
+    double eta = (1.0 - std::pow(2.0 / items, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+
+    std::vector<IntType> zipfVector;
+    zipfVector.reserve(count);
+    while(zipfVector.size() < count) {
+        double u = uniform(randEngine);
+        double uz = u * zetan;
+        uint64_t rank;
+        if(uz < 1.0) {
+            rank = 0;
+        }
+        else if(uz < zeta2) {
+            rank = 1;
+        }
+        else {
+            rank = (uint64_t)(items * std::pow(eta * u - eta + 1.0, alpha));
+        }
+        if(rank >= (uint64_t)items) {
+            rank = (uint64_t)items - 1;
+        }
+        zipfVector.push_back(min + (IntType)rank);
+    }
+
+    return zipfVector;
+}
+
+/**
+* Generates count integers where the i-th value is drawn uniformly from the
+* window [min + i*step, min + i*step + window).  Models lookups against a
+* sliding window of recent IDs.
+*/
+template<typename IntType>
+std::vector<IntType> makeSlidingWindowNumberVector(size_t count, IntType min, IntType window, double step, RandomSeed seed)
+{
+    std::mt19937 randEngine;
+    randEngine.seed(seed);
+    std::uniform_int_distribution<IntType> distributor(0, window - 1);
+
+    std::vector<IntType> windowVector;
+    windowVector.reserve(count);
+    for(size_t i = 0; i < count; ++i) {
+        IntType base = min + (IntType)(step * (double)i);
+        windowVector.push_back(base + distributor(randEngine));
+    }
+
+    return windowVector;
+}
+
+/*
+  -----------------------------------------
+  End workload generators.
+  -----------------------------------------
+*/
+
+/**
+* A 64-byte key.  Ordered by its first word; the remaining words are derived
+* from it so that equal first words mean equal keys.
+*/
+struct BenchBlob64
+{
+    uint64_t words[8];
+};
+
+inline bool operator<(const BenchBlob64& a, const BenchBlob64& b)
+{
+    return a.words[0] < b.words[0];
+}
+
+inline bool operator>(const BenchBlob64& a, const BenchBlob64& b)
+{
+    return a.words[0] > b.words[0];
+}
+
+inline bool operator==(const BenchBlob64& a, const BenchBlob64& b)
+{
+    return std::memcmp(a.words, b.words, sizeof(a.words)) == 0;
+}
+
+inline std::ostream& operator<<(std::ostream& out, const BenchBlob64& b)
+{
+    return out << b.words[0];
+}
+
+/**
+* Converts the integer keys produced by the workload generators into each
+* benchmark key type, preserving order.
+*/
+template<typename Key>
+struct BenchKey;
+
+template<>
+struct BenchKey<uint64_t>
+{
+    static const char* name() { return "u64"; }
+    static uint64_t make(uint64_t k) { return k; }
+};
+
+template<>
+struct BenchKey<std::string>
+{
+    static const char* name() { return "string"; }
+    static std::string make(uint64_t k)
+    {
+        // zero-padded so lexicographic order matches numeric order;
+        // long enough to defeat the small-string optimization
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "key:%020llu", (unsigned long long)k);
+        return std::string(buf);
+    }
+};
+
+template<>
+struct BenchKey<BenchBlob64>
+{
+    static const char* name() { return "blob64"; }
+    static BenchBlob64 make(uint64_t k)
+    {
+        BenchBlob64 b;
+        b.words[0] = k;
+        for(int i = 1; i < 8; ++i) {
+            b.words[i] = k * 0x9E3779B97F4A7C15ULL + (uint64_t)i;
+        }
+        return b;
+    }
+};
+
+/*
+  -----------------------------------------
+  Begin engine adapters.
+  Every engine derived from BinarySearchTree shares the tree overloads;
+  std::map is the reference engine.
+  -----------------------------------------
+*/
+
+template<typename Key, typename Value>
+bool benchFind(const BinarySearchTree<Key, Value>& tree, const Key& key)
+{
+    return tree.find(key) != tree.end();
+}
+
+template<typename Key, typename Value>
+void benchInsert(BinarySearchTree<Key, Value>& tree, const Key& key, const Value& value)
+{
+    tree.insert(std::make_pair(key, value));
+}
+
+template<typename Key, typename Value>
+void benchRemove(BinarySearchTree<Key, Value>& tree, const Key& key)
+{
+    tree.remove(key);
+}
+
+// operator[] throws for missing keys; returns whether the key was present
+template<typename Key, typename Value>
+bool benchIndex(BinarySearchTree<Key, Value>& tree, const Key& key)
+{
+    try {
+        (void)tree[key];
+        return true;
+    }
+    catch(const std::out_of_range&) {
+        return false;
+    }
+}
+
+// splay trees restructure on lookups, so they take the splaying overloads
+template<typename Key, typename Value>
+bool benchFind(SplayTree<Key, Value>& tree, const Key& key)
+{
+    return tree.find(key) != tree.end();
+}
+
+template<typename Key, typename Value>
+bool benchIndex(SplayTree<Key, Value>& tree, const Key& key)
+{
+    try {
+        (void)tree[key];
+        return true;
+    }
+    catch(const std::out_of_range&) {
+        return false;
+    }
+}
+
+// a default-constructible semi-splaying tree, for the engine tables
+template<typename Key, typename Value>
+class BenchSemiSplayTree : public SplayTree<Key, Value>
+{
+public:
+    BenchSemiSplayTree() : SplayTree<Key, Value>(SPLAY_SEMI) { }
+};
+
+// full in-order scan; returns the number of items visited
+template<typename Key, typename Value>
+uint64_t benchScan(const BinarySearchTree<Key, Value>& tree)
+{
+    uint64_t count = 0;
+    for(typename BinarySearchTree<Key, Value>::iterator it = tree.begin(); it != tree.end(); ++it) {
+        count++;
+    }
+    return count;
+}
+
+template<typename Key, typename Value>
+bool benchFind(const std::map<Key, Value>& m, const Key& key)
+{
+    return m.find(key) != m.end();
+}
+
+template<typename Key, typename Value>
+void benchInsert(std::map<Key, Value>& m, const Key& key, const Value& value)
+{
+    m[key] = value;
+}
+
+template<typename Key, typename Value>
+void benchRemove(std::map<Key, Value>& m, const Key& key)
+{
+    m.erase(key);
+}
+
+template<typename Key, typename Value>
+bool benchIndex(std::map<Key, Value>& m, const Key& key)
+{
+    try {
+        (void)m.at(key);
+        return true;
+    }
+    catch(const std::out_of_range&) {
+        return false;
+    }
+}
+
+template<typename Key, typename Value>
+uint64_t benchScan(const std::map<Key, Value>& m)
+{
+    uint64_t count = 0;
+    for(typename std::map<Key, Value>::const_iterator it = m.begin(); it != m.end(); ++it) {
+        count++;
+    }
+    return count;
+}
+
+/*
+  -----------------------------------------
+  End engine adapters.
+  -----------------------------------------
+*/
+
+/**
+* A simple wall-clock stopwatch.
+*/
+class BenchTimer
+{
+public:
+    BenchTimer() : start_(std::chrono::steady_clock::now()) { }
+
+    void restart() { start_ = std::chrono::steady_clock::now(); }
+
+    // seconds since construction or the last restart()
+    double seconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+    // nanoseconds since construction or the last restart()
+    uint64_t nanoseconds() const
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+/**
+* Returns the resident set size of this process in kilobytes, or 0 if it
+* cannot be read.
+*/
+inline uint64_t benchRssKb()
+{
+    FILE* statm = std::fopen("/proc/self/statm", "r");
+    if(statm == NULL) {
+        return 0;
+    }
+    unsigned long long size = 0, resident = 0;
+    int n = std::fscanf(statm, "%llu %llu", &size, &resident);
+    std::fclose(statm);
+    if(n != 2) {
+        return 0;
+    }
+    return (uint64_t)resident * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+}
+
+/**
+* Hands freed heap memory back to the OS so that RSS deltas between runs
+* reflect the structure being measured.
+*/
+inline void benchReleaseMemory()
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+/**
+* Operations in a benchmark stream.
+*/
+enum BenchOpKind { OP_FIND, OP_INSERT, OP_REMOVE, NUM_BENCH_OPS };
+
+inline const char* benchOpName(int kind)
+{
+    static const char* names[NUM_BENCH_OPS] = { "find", "insert", "remove" };
+    return names[kind];
+}
+
+struct BenchOp
+{
+    BenchOpKind kind;
+    uint64_t key;
+};
+
+#ifdef BST_PROFILE
+/**
+* Counter totals of one run, per operation kind and tree phase.
+*/
+struct BenchProfile
+{
+    uint64_t totals[NUM_BENCH_OPS][BST_NUM_PHASES][BST_NUM_COUNTERS];
+    uint64_t ops[NUM_BENCH_OPS];
+    bool available[BST_NUM_COUNTERS];
+
+    void collect(const BstProfiler& profiler)
+    {
+        for(int op = 0; op < NUM_BENCH_OPS; ++op) {
+            // the final setOperation(0) that closes a run is not an operation
+            ops[op] = profiler.operationCount(op) - (op == 0 ? 1 : 0);
+            for(int phase = 0; phase < BST_NUM_PHASES; ++phase) {
+                for(int c = 0; c < BST_NUM_COUNTERS; ++c) {
+                    totals[op][phase][c] = profiler.total(op, phase, c);
+                }
+            }
+        }
+        for(int c = 0; c < BST_NUM_COUNTERS; ++c) {
+            available[c] = profiler.counters().available(c);
+        }
+    }
+};
+#endif
+
+/**
+* One CSV row of benchmark output.
+*/
+struct BenchResult
+{
+    std::string suite;
+    std::string engine;
+    std::string key;
+    std::string workload;
+    int readPct;
+    uint64_t n;
+    uint64_t ops;
+    double seconds;
+    uint64_t rssKb;
+    uint64_t hits;
+#ifdef BST_PROFILE
+    BenchProfile profile;
+#endif
+};
+
+inline void printBenchHeader(std::ostream& out)
+{
+    out << "suite,engine,key,workload,read_pct,n,ops,seconds,ops_per_sec,ns_per_op,rss_kb,hits\n";
+}
+
+inline void printBenchResult(std::ostream& out, const BenchResult& r)
+{
+    double opsPerSec = r.seconds > 0 ? (double)r.ops / r.seconds : 0.0;
+    double nsPerOp = r.ops > 0 ? r.seconds * 1e9 / (double)r.ops : 0.0;
+    char buf[128];
+    std::snprintf(buf, sizeof(buf), "%.6f,%.0f,%.1f", r.seconds, opsPerSec, nsPerOp);
+    out << r.suite << ',' << r.engine << ',' << r.key << ',' << r.workload << ','
+        << r.readPct << ',' << r.n << ',' << r.ops << ',' << buf << ','
+        << r.rssKb << ',' << r.hits << '\n';
+    out.flush();
+}
+
+#ifdef BST_PROFILE
+inline void printBenchProfileHeader(std::ostream& out)
+{
+    out << "suite,engine,key,workload,read_pct,n,op,phase,ops";
+    for(int c = 0; c < BST_NUM_COUNTERS; ++c) {
+        out << ',' << bstCounterName(c) << "_per_op";
+    }
+    out << '\n';
+}
+
+/**
+* Prints one row per (operation, phase) with counter values averaged over
+* the operations of that kind.  Counters that could not be opened are left
+* empty.
+*/
+inline void printBenchProfile(std::ostream& out, const BenchResult& r)
+{
+    for(int op = 0; op < NUM_BENCH_OPS; ++op) {
+        if(r.profile.ops[op] == 0) continue;
+        for(int phase = 0; phase < BST_NUM_PHASES; ++phase) {
+            out << r.suite << ',' << r.engine << ',' << r.key << ',' << r.workload << ','
+                << r.readPct << ',' << r.n << ',' << benchOpName(op) << ','
+                << bstPhaseName(phase) << ',' << r.profile.ops[op];
+            for(int c = 0; c < BST_NUM_COUNTERS; ++c) {
+                out << ',';
+                if(r.profile.available[c]) {
+                    char buf[32];
+                    std::snprintf(buf, sizeof(buf), "%.2f",
+                        (double)r.profile.totals[op][phase][c] / (double)r.profile.ops[op]);
+                    out << buf;
+                }
+            }
+            out << '\n';
+        }
+    }
+    out.flush();
+}
+#endif
+
+#endif
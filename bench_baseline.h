@@ -0,0 +1,388 @@
+#ifndef BENCH_BASELINE_H
+#define BENCH_BASELINE_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+// Absolute-timing baselines for the runtime snippets.  The complexity checks
+// in hw4_tests (RuntimeEvaluator) only fit a big-O class, so a constant-factor
+// slowdown passes them; RuntimeBaseline records the raw per-size samples
+// under the test's name in a local JSON file and compares later runs against
+// them.  Snippets have the same shape as RuntimeEvaluator::Snippet.
+
+typedef uint32_t RandomSeed;
+
+/**
+* A minimal JSON reader/writer covering what the baseline file uses:
+* objects, arrays, strings and non-negative integers.
+*/
+class BaselineJson
+{
+public:
+    enum Type { NUMBER, STRING, ARRAY, OBJECT };
+
+    BaselineJson() : type_(OBJECT), number_(0) { }
+    explicit BaselineJson(uint64_t number) : type_(NUMBER), number_(number) { }
+    explicit BaselineJson(const std::string& str) : type_(STRING), number_(0), string_(str) { }
+
+    static BaselineJson array() { BaselineJson j; j.type_ = ARRAY; return j; }
+    static BaselineJson parse(const std::string& text);
+
+    Type type() const { return type_; }
+    uint64_t number() const { return number_; }
+    const std::string& str() const { return string_; }
+    std::vector<BaselineJson>& items() { return items_; }
+    const std::vector<BaselineJson>& items() const { return items_; }
+    std::map<std::string, BaselineJson>& members() { return members_; }
+    const std::map<std::string, BaselineJson>& members() const { return members_; }
+
+    void write(std::ostream& out, int indent = 0) const;
+
+private:
+    static void skipSpace(const std::string& text, size_t& pos);
+    static BaselineJson parseValue(const std::string& text, size_t& pos);
+    static std::string parseString(const std::string& text, size_t& pos);
+
+    Type type_;
+    uint64_t number_;
+    std::string string_;
+    std::vector<BaselineJson> items_;
+    std::map<std::string, BaselineJson> members_;
+};
+
+inline void BaselineJson::skipSpace(const std::string& text, size_t& pos)
+{
+    while(pos < text.size() && (text[pos] == ' ' || text[pos] == '\n' || text[pos] == '\t' || text[pos] == '\r')) {
+        ++pos;
+    }
+}
+
+inline std::string BaselineJson::parseString(const std::string& text, size_t& pos)
+{
+    // names are test names and sizes, so escapes other than \" and \\ are not needed
+    std::string result;
+    ++pos;
+    while(pos < text.size() && text[pos] != '"') {
+        if(text[pos] == '\\' && pos + 1 < text.size()) ++pos;
+        result += text[pos++];
+    }
+    if(pos >= text.size()) throw std::runtime_error("baseline: unterminated string");
+    ++pos;
+    return result;
+}
+
+inline BaselineJson BaselineJson::parseValue(const std::string& text, size_t& pos)
+{
+    skipSpace(text, pos);
+    if(pos >= text.size()) throw std::runtime_error("baseline: unexpected end of file");
+
+    char c = text[pos];
+    if(c == '{') {
+        BaselineJson obj;
+        ++pos;
+        skipSpace(text, pos);
+        if(pos < text.size() && text[pos] == '}') { ++pos; return obj; }
+        while(true) {
+            skipSpace(text, pos);
+            if(pos >= text.size() || text[pos] != '"') throw std::runtime_error("baseline: expected member name");
+            std::string name = parseString(text, pos);
+            skipSpace(text, pos);
+            if(pos >= text.size() || text[pos] != ':') throw std::runtime_error("baseline: expected ':'");
+            ++pos;
+            obj.members_[name] = parseValue(text, pos);
+            skipSpace(text, pos);
+            if(pos < text.size() && text[pos] == ',') { ++pos; continue; }
+            if(pos < text.size() && text[pos] == '}') { ++pos; return obj; }
+            throw std::runtime_error("baseline: expected ',' or '}'");
+        }
+    }
+    else if(c == '[') {
+        BaselineJson arr = array();
+        ++pos;
+        skipSpace(text, pos);
+        if(pos < text.size() && text[pos] == ']') { ++pos; return arr; }
+        while(true) {
+            arr.items_.push_back(parseValue(text, pos));
+            skipSpace(text, pos);
+            if(pos < text.size() && text[pos] == ',') { ++pos; continue; }
+            if(pos < text.size() && text[pos] == ']') { ++pos; return arr; }
+            throw std::runtime_error("baseline: expected ',' or ']'");
+        }
+    }
+    else if(c == '"') {
+        return BaselineJson(parseString(text, pos));
+    }
+    else if(c >= '0' && c <= '9') {
+        uint64_t value = 0;
+        while(pos < text.size() && text[pos] >= '0' && text[pos] <= '9') {
+            value = value * 10 + (uint64_t)(text[pos++] - '0');
+        }
+        return BaselineJson(value);
+    }
+    throw std::runtime_error("baseline: unexpected character");
+}
+
+inline BaselineJson BaselineJson::parse(const std::string& text)
+{
+    size_t pos = 0;
+    return parseValue(text, pos);
+}
+
+inline void BaselineJson::write(std::ostream& out, int indent) const
+{
+    std::string pad(indent + 2, ' ');
+    if(type_ == NUMBER) {
+        out << number_;
+    }
+    else if(type_ == STRING) {
+        out << '"';
+        for(size_t i = 0; i < string_.size(); ++i) {
+            if(string_[i] == '"' || string_[i] == '\\') out << '\\';
+            out << string_[i];
+        }
+        out << '"';
+    }
+    else if(type_ == ARRAY) {
+        // arrays hold samples, so keep them on one line
+        out << '[';
+        for(size_t i = 0; i < items_.size(); ++i) {
+            if(i > 0) out << ", ";
+            items_[i].write(out, indent + 2);
+        }
+        out << ']';
+    }
+    else {
+        out << "{";
+        bool first = true;
+        for(std::map<std::string, BaselineJson>::const_iterator it = members_.begin(); it != members_.end(); ++it) {
+            out << (first ? "\n" : ",\n") << pad;
+            BaselineJson(it->first).write(out);
+            out << ": ";
+            it->second.write(out, indent + 2);
+            first = false;
+        }
+        out << (first ? "}" : "\n" + std::string(indent, ' ') + "}");
+    }
+}
+
+/**
+* Per-size comparison of a run against its baseline.
+*/
+struct BaselineComparison
+{
+    uint64_t numElements;
+    size_t trials;
+    double baselineMedian;
+    double currentMedian;
+    double ratio;     // current / baseline medians
+    double ciLow;     // bootstrap 95% confidence interval of the ratio
+    double ciHigh;
+    bool regressed;   // ciLow is above 1 + threshold
+};
+
+/**
+* Baseline datasets keyed by test name (e.g. "BSTRuntime.InsertBalanced"),
+* persisted as JSON.
+*/
+class BaselineStore
+{
+public:
+    // represents a set of data points: (# of elements, runtime in ns),
+    // same layout as RuntimeEvaluator's DataSet
+    typedef std::vector<std::pair<uint64_t, uint64_t> > DataSet;
+
+    // loads path; a missing file is an empty store
+    void load(const std::string& path);
+    void save(const std::string& path) const;
+
+    bool has(const std::string& test) const { return tests_.find(test) != tests_.end(); }
+    const DataSet& get(const std::string& test) const { return tests_.find(test)->second; }
+    void set(const std::string& test, const DataSet& data) { tests_[test] = data; }
+
+private:
+    std::map<std::string, DataSet> tests_;
+};
+
+inline void BaselineStore::load(const std::string& path)
+{
+    std::ifstream in(path.c_str());
+    if(!in) {
+        return;
+    }
+    std::stringstream buf;
+    buf << in.rdbuf();
+    BaselineJson root = BaselineJson::parse(buf.str());
+
+    const std::map<std::string, BaselineJson>& tests = root.members()["tests"].members();
+    for(std::map<std::string, BaselineJson>::const_iterator t = tests.begin(); t != tests.end(); ++t) {
+        DataSet data;
+        const std::map<std::string, BaselineJson>& sizes = t->second.members();
+        for(std::map<std::string, BaselineJson>::const_iterator s = sizes.begin(); s != sizes.end(); ++s) {
+            uint64_t n = strtoull(s->first.c_str(), NULL, 10);
+            for(size_t i = 0; i < s->second.items().size(); ++i) {
+                data.push_back(std::make_pair(n, s->second.items()[i].number()));
+            }
+        }
+        std::sort(data.begin(), data.end());
+        tests_[t->first] = data;
+    }
+}
+
+inline void BaselineStore::save(const std::string& path) const
+{
+    BaselineJson root;
+    root.members()["version"] = BaselineJson((uint64_t)1);
+    BaselineJson& tests = root.members()["tests"];
+    for(std::map<std::string, DataSet>::const_iterator t = tests_.begin(); t != tests_.end(); ++t) {
+        BaselineJson& sizes = tests.members()[t->first];
+        for(size_t i = 0; i < t->second.size(); ++i) {
+            std::stringstream n;
+            n << t->second[i].first;
+            std::map<std::string, BaselineJson>::iterator s = sizes.members().find(n.str());
+            if(s == sizes.members().end()) {
+                s = sizes.members().insert(std::make_pair(n.str(), BaselineJson::array())).first;
+            }
+            s->second.items().push_back(BaselineJson(t->second[i].second));
+        }
+    }
+
+    std::ofstream out(path.c_str());
+    if(!out) {
+        throw std::runtime_error("baseline: cannot write " + path);
+    }
+    root.write(out);
+    out << '\n';
+}
+
+/**
+* Runs a snippet over a range of sizes and compares the samples with a
+* stored baseline.
+*/
+class RuntimeBaseline
+{
+public:
+    typedef BaselineStore::DataSet DataSet;
+    typedef std::function<uint64_t(uint64_t, RandomSeed)> Snippet;
+
+    // testName - key under which the dataset is stored
+    // evalRangeStart, evalRangeEnd - input sizes, as exponents of 2
+    // numTrialsPerSize - samples taken for each size
+    RuntimeBaseline(std::string testName, uint8_t evalRangeStart, uint8_t evalRangeEnd, uint8_t numTrialsPerSize, Snippet const & snippet) :
+        _testName(testName),
+        _evalRangeStart(evalRangeStart),
+        _evalRangeEnd(evalRangeEnd),
+        _numTrialsPerSize(numTrialsPerSize),
+        _snippet(snippet)
+    {
+
+    }
+
+    const std::string& name() const { return _testName; }
+    const DataSet& data() const { return _recordedData; }
+
+    // runs the snippet numTrialsPerSize times for each size, interleaving
+    // sizes so slow drift in machine state affects all sizes alike
+    void evaluate();
+
+    // compares the recorded data with baseline, size by size
+    std::vector<BaselineComparison> compare(const DataSet& baseline, double threshold) const;
+
+private:
+    static double median(std::vector<uint64_t> samples);
+
+    std::string _testName;
+    uint8_t _evalRangeStart, _evalRangeEnd;
+    uint8_t _numTrialsPerSize;
+    Snippet _snippet;
+    DataSet _recordedData;
+};
+
+inline void RuntimeBaseline::evaluate()
+{
+    _recordedData.clear();
+    std::mt19937 seedEngine(104);
+
+    // untimed warm-up pass so the first trial does not pay for cold caches
+    for(uint8_t exp = _evalRangeStart; exp <= _evalRangeEnd; ++exp) {
+        _snippet((uint64_t)1 << exp, (RandomSeed)seedEngine());
+    }
+    for(uint8_t trial = 0; trial < _numTrialsPerSize; ++trial) {
+        for(uint8_t exp = _evalRangeStart; exp <= _evalRangeEnd; ++exp) {
+            uint64_t numElements = (uint64_t)1 << exp;
+            _recordedData.push_back(std::make_pair(numElements, _snippet(numElements, (RandomSeed)seedEngine())));
+        }
+    }
+    std::sort(_recordedData.begin(), _recordedData.end());
+}
+
+inline double RuntimeBaseline::median(std::vector<uint64_t> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    size_t mid = samples.size() / 2;
+    if(samples.size() % 2 == 1) return (double)samples[mid];
+    return ((double)samples[mid - 1] + (double)samples[mid]) / 2.0;
+}
+
+inline std::vector<BaselineComparison> RuntimeBaseline::compare(const DataSet& baseline, double threshold) const
+{
+    const int resamples = 2000;
+    std::vector<BaselineComparison> results;
+    std::mt19937 randEngine(104);
+
+    size_t i = 0;
+    while(i < _recordedData.size()) {
+        uint64_t n = _recordedData[i].first;
+        std::vector<uint64_t> current, base;
+        for(; i < _recordedData.size() && _recordedData[i].first == n; ++i) {
+            current.push_back(_recordedData[i].second);
+        }
+        for(size_t b = 0; b < baseline.size(); ++b) {
+            if(baseline[b].first == n) base.push_back(baseline[b].second);
+        }
+        if(base.empty()) {
+            continue;
+        }
+
+        BaselineComparison cmp;
+        cmp.numElements = n;
+        cmp.trials = current.size();
+        cmp.baselineMedian = median(base);
+        cmp.currentMedian = median(current);
+        cmp.ratio = cmp.baselineMedian > 0 ? cmp.currentMedian / cmp.baselineMedian : 1.0;
+
+        // percentile bootstrap of the ratio of medians
+        std::vector<double> ratios;
+        ratios.reserve(resamples);
+        std::uniform_int_distribution<size_t> pickCurrent(0, current.size() - 1);
+        std::uniform_int_distribution<size_t> pickBase(0, base.size() - 1);
+        std::vector<uint64_t> c(current.size()), b(base.size());
+        for(int r = 0; r < resamples; ++r) {
+            for(size_t k = 0; k < c.size(); ++k) c[k] = current[pickCurrent(randEngine)];
+            for(size_t k = 0; k < b.size(); ++k) b[k] = base[pickBase(randEngine)];
+            double bm = median(b);
+            ratios.push_back(bm > 0 ? median(c) / bm : 1.0);
+        }
+        std::sort(ratios.begin(), ratios.end());
+        cmp.ciLow = ratios[(size_t)(0.025 * (resamples - 1))];
+        cmp.ciHigh = ratios[(size_t)(0.975 * (resamples - 1))];
+        cmp.regressed = cmp.ciLow > 1.0 + threshold;
+
+        results.push_back(cmp);
+    }
+
+    return results;
+}
+
+#endif
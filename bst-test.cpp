@@ -1,13 +1,57 @@
 #include <iostream>
 #include <map>
+#include <set>
+#include <vector>
+#include <thread>
 #include "bst.h"
 #include "avlbst.h"
+#include "rbbst.h"
+#include "splaybst.h"
+#include "weightedbst.h"
+#include "intrusive_avl.h"
+#include "compressed_map.h"
+#include "durable_avl.h"
+#include "buffered_avl.h"
 
 using namespace std;
 
+// a key with no default constructor, which the trees must not need
+struct TicketKey
+{
+    explicit TicketKey(int n) : number(n) { }
+    int number;
+    bool operator<(const TicketKey& other) const { return number < other.number; }
+    bool operator>(const TicketKey& other) const { return number > other.number; }
+    bool operator==(const TicketKey& other) const { return number == other.number; }
+};
+
+ostream& operator<<(ostream& out, const TicketKey& key)
+{
+    return out << '#' << key.number;
+}
+
+// a splay tree that shows where lookups leave the keys
+struct SplayProbe : SplayTree<int, int>
+{
+    explicit SplayProbe(SplayMode mode) : SplayTree<int, int>(mode) { }
+    int rootKey() const { return root_ != NULL ? root_->getKey() : -1; }
+    size_t depth(int key) const { return probeDepth(key); }
+};
+
+// an object indexed by two intrusive trees at once
+struct CacheEntry
+{
+    int id;
+    AVLHook byId;
+    int expiry;
+    AVLHook byExpiry;
+};
 
 int main(int argc, char *argv[])
 {
+    // cleared by any failed check, for the exit status
+    bool ok = true;
+
     // Binary Search Tree tests
     BinarySearchTree<char,int> bt;
     bt.insert(std::make_pair('a',1));
@@ -26,6 +70,43 @@ int main(int argc, char *argv[])
     cout << "Erasing b" << endl;
     bt.remove('b');
 
+    // Binary Search Tree tests: sorted inserts, scapegoat mode and rebalance()
+    BinarySearchTree<int,int> sg;
+    sg.enableScapegoat();
+    BinarySearchTree<int,int> dsw;
+    for(int i = 0; i < 31; ++i) {
+        sg.insert(std::make_pair(i, i));
+        dsw.insert(std::make_pair(i, i));
+    }
+    dsw.rebalance();
+    cout << "\nRebalanced sorted tree:" << endl;
+    dsw.print();
+    if(!dsw.isBalanced() || dsw.find(17) == dsw.end()) {
+        cout << "Rebalance FAILED" << endl;
+        ok = false;
+    }
+    // scapegoat trees are weight-balanced, not height-balanced: check contents
+    int expected = 0;
+    for(BinarySearchTree<int,int>::iterator it = sg.begin(); it != sg.end(); ++it, ++expected) {
+        if(it->first != expected) break;
+    }
+    if(expected != 31) {
+        cout << "Scapegoat insert FAILED" << endl;
+        ok = false;
+    }
+    // an AVL tree reached through a BinarySearchTree reference refuses both
+    AVLTree<int, int> balanced;
+    for(int i = 0; i < 31; ++i) balanced.insert(std::make_pair(i, i));
+    BinarySearchTree<int, int>& balancedAsPlain = balanced;
+    bool refusedRebalance = false, refusedScapegoat = false;
+    try { balancedAsPlain.rebalance(); } catch(const std::logic_error&) { refusedRebalance = true; }
+    try { balancedAsPlain.enableScapegoat(); } catch(const std::logic_error&) { refusedScapegoat = true; }
+    balanced.remove(15);
+    if(!refusedRebalance || !refusedScapegoat || balanced.find(16) == balanced.end()) {
+        cout << "Rebalance of a self-balancing tree FAILED" << endl;
+        ok = false;
+    }
+
     // AVL Tree Tests
     AVLTree<char,int> at;
     at.insert(std::make_pair('a',1));
@@ -44,6 +125,384 @@ int main(int argc, char *argv[])
     cout << "Erasing b" << endl;
     at.remove('b');
 
+    // AVL Tree tests: hinted insert and find_from
+    AVLTree<int,int> ht;
+    AVLTree<int,int>::iterator hint = ht.end();
+    for(int i = 0; i < 100; ++i) {
+        hint = ht.insert(hint, std::make_pair(i % 2 ? i - 1 : i + 1, i));
+    }
+    if(!ht.isBalanced() || ht.find_from(hint, 3) == ht.end() || ht.find_from(hint, 3)->second != 2
+       || ht.find_from(ht.begin(), 100) != ht.end()) {
+        cout << "Hinted insert FAILED" << endl;
+        ok = false;
+    }
+
+    // AVL Tree tests: bulk build from unsorted items, last duplicate wins
+    vector<pair<int, int> > bulkItems;
+    for(int i = 0; i < 200; ++i) {
+        bulkItems.push_back(make_pair((i * 37) % 101, i));
+    }
+    WorkStealingPool pool(1);
+    AVLTree<int, int> bulk(bulkItems, pool);
+    int bulkCount = 0;
+    for(AVLTree<int, int>::iterator it = bulk.begin(); it != bulk.end(); ++it) bulkCount++;
+    if(bulkCount != 101 || !bulk.isBalanced() || bulk[37] != 102 || bulk[0] != 101) {
+        cout << "Bulk build FAILED" << endl;
+        ok = false;
+    }
+    // large enough to be split into pool tasks
+    vector<pair<int, int> > manyItems;
+    for(int i = 0; i < 50000; ++i) manyItems.push_back(make_pair((i * 7919) % 30011, i));
+    WorkStealingPool builders(2);
+    AVLTree<int, int> manyBuilt(manyItems, builders);
+    map<int, int> manyModel;
+    for(size_t i = 0; i < manyItems.size(); ++i) manyModel[manyItems[i].first] = manyItems[i].second;
+    for(int k = 0; k < 30011; k += 3) {
+        manyBuilt.remove(k);
+        manyModel.erase(k);
+    }
+    map<int, int>::iterator manyWant = manyModel.begin();
+    AVLTree<int, int>::iterator manyGot = manyBuilt.begin();
+    for(; manyWant != manyModel.end() && manyGot != manyBuilt.end() && *manyWant == *manyGot; ++manyWant, ++manyGot) { }
+    if(manyWant != manyModel.end() || manyGot != manyBuilt.end() || !manyBuilt.isBalanced()) {
+        cout << "Parallel bulk build FAILED" << endl;
+        ok = false;
+    }
+
+    // AVL Tree tests: an in-order reduce matches the iterator's order
+    vector<int> reduced = bulk.parallel_reduce(vector<int>(), [](const pair<const int, int>& item) {
+        return vector<int>(1, item.first);
+    }, [](vector<int> a, const vector<int>& b) {
+        a.insert(a.end(), b.begin(), b.end());
+        return a;
+    }, pool);
+    bulk.parallel_for_each([](pair<const int, int>& item) { item.second = -item.first; }, pool);
+    size_t position = 0;
+    for(AVLTree<int, int>::iterator it = bulk.begin(); it != bulk.end(); ++it, ++position) {
+        if(position >= reduced.size() || reduced[position] != it->first || it->second != -it->first) break;
+    }
+    if(position != reduced.size() || position != 101) {
+        cout << "Parallel reduce FAILED" << endl;
+        ok = false;
+    }
+    // a task that runs a batch on its own pool: nested batches run inline
+    // instead of waiting on the outer one
+    std::atomic<size_t> innerBuilds(0), innerItems(0);
+    manyBuilt.parallel_for_each([&innerBuilds, &innerItems, &manyItems, &builders](pair<const int, int>& item) {
+        if(item.first % 5000 != 1) return;
+        AVLTree<int, int> inner(manyItems, builders);
+        innerBuilds++;
+        for(AVLTree<int, int>::iterator it = inner.begin(); it != inner.end(); ++it) innerItems++;
+    }, builders);
+    if(innerBuilds != 5 || innerItems != innerBuilds * 30011) {
+        cout << "Nested parallel batch FAILED" << endl;
+        ok = false;
+    }
+
+    // AVL Tree tests: copies keep the shape, moves leave the source empty
+    AVLTree<int, int> copied(bulk);
+    AVLTree<int, int> cloned(bulk, pool);
+    AVLTree<int, int> moved(std::move(copied));
+    copied = cloned;
+    AVLTree<int, int>::iterator c1 = copied.begin(), c2 = moved.begin(), c3 = bulk.begin();
+    for(; c3 != bulk.end() && c1 != copied.end() && c2 != moved.end() && *c1 == *c3 && *c2 == *c3; ++c1, ++c2, ++c3) { }
+    if(c3 != bulk.end() || c1 != copied.end() || c2 != moved.end() || !copied.isBalanced()) {
+        cout << "AVL copy FAILED" << endl;
+        ok = false;
+    }
+
+    // AVL Tree tests: merges sum shared keys and empty the other tree
+    AVLTree<int, int> hourA, hourB, hourC;
+    for(int i = 0; i < 50; ++i) {
+        hourA.insert(make_pair(2 * i, 1));
+        hourB.insert(make_pair(3 * i, 1));
+        hourC.insert(make_pair(3 * i, 1));
+    }
+    AVLTree<int, int> perKey(hourA);
+    // the per-key path moves nodes across rather than copying them
+    const int* movedValue = &hourC.find(3)->second;
+    hourA.merge(hourB, [](const int&, const int& ours, const int& theirs) { return ours + theirs; }, BATCH_REBUILD);
+    perKey.merge(hourC, [](const int&, const int& ours, const int& theirs) { return ours + theirs; }, BATCH_PER_OP);
+    AVLTree<int, int>::iterator m1 = hourA.begin(), m2 = perKey.begin();
+    for(; m1 != hourA.end() && m2 != perKey.end() && *m1 == *m2; ++m1, ++m2) { }
+    if(m1 != hourA.end() || m2 != perKey.end() || !hourB.empty() || !hourC.empty() || !hourA.isBalanced()
+       || hourA[6] != 2 || hourA[4] != 1 || hourA[147] != 1 || &perKey.find(3)->second != movedValue
+       || !perKey.isBalanced()) {
+        cout << "AVL merge FAILED" << endl;
+        ok = false;
+    }
+    AVLTree<int, int> fewer, donor(perKey);
+    fewer.insert(make_pair(3, 5));
+    movedValue = &donor.find(4)->second;
+    fewer.merge(donor, [](const int&, const int& ours, const int& theirs) { return ours + theirs; }, BATCH_PER_OP);
+    AVLTree<int, int>::iterator f1 = fewer.begin(), f2 = perKey.begin();
+    for(; f1 != fewer.end() && f2 != perKey.end() && f1->first == f2->first; ++f1, ++f2) { }
+    if(!donor.empty() || f1 != fewer.end() || f2 != perKey.end() || fewer[3] != perKey[3] + 5
+       || &fewer.find(4)->second != movedValue || !fewer.isBalanced()) {
+        cout << "AVL merge into smaller FAILED" << endl;
+        ok = false;
+    }
+
+    // AVL Tree tests: a node moves between trees, and may be rekeyed on the way
+    AVLTree<int, int>::node_type handle = hourA.extract(6);
+    const int* valueAddress = handle.empty() ? NULL : &handle.value();
+    handle.key() = 1000;
+    AVLTree<int, int>::iterator spliced = perKey.insert(std::move(handle));
+    if(!handle.empty() || hourA.find(6) != hourA.end() || spliced->first != 1000 || &spliced->second != valueAddress
+       || !hourA.isBalanced() || !perKey.isBalanced() || !hourA.extract(6).empty()) {
+        cout << "AVL extract FAILED" << endl;
+        ok = false;
+    }
+    handle = perKey.extract(0);
+    if(perKey.insert(std::move(handle)) == perKey.end() || !handle.empty() || perKey.find(0) == perKey.end()) {
+        cout << "AVL node reinsert FAILED" << endl;
+        ok = false;
+    }
+
+    // AVL Tree tests: the plain node handles refuse a self-balancing tree
+    // reached through a BinarySearchTree reference
+    BinarySearchTree<int, int> plainSource;
+    plainSource.insert(make_pair(7, 7));
+    plainSource.insert(make_pair(8, 8));
+    BinarySearchTree<int, int>& asPlain = perKey;
+    BinarySearchTree<int, int>::node_type plainHandle = plainSource.extract(7);
+    bool refusedExtract = false, refusedInsert = false;
+    try { asPlain.extract(2); } catch(const std::logic_error&) { refusedExtract = true; }
+    try { asPlain.insert(std::move(plainHandle)); } catch(const std::logic_error&) { refusedInsert = true; }
+    if(!refusedExtract || !refusedInsert || plainHandle.empty() || perKey.find(2) == perKey.end()
+       || perKey.find(7) != perKey.end() || plainSource.find(7) != plainSource.end()
+       || plainSource.insert(std::move(plainHandle)) == plainSource.end() || plainSource.find(7) == plainSource.end()) {
+        cout << "AVL plain node handle FAILED" << endl;
+        ok = false;
+    }
+
+    // AVL Tree tests: a threaded tree iterates the same through inserts,
+    // removes (with node swaps) and rotations
+    AVLTree<int, int> threadedTree, plainTree;
+    threadedTree.enableThreads();
+    for(int i = 0; i < 200; ++i) {
+        int key = (i * 37) % 101;
+        if(i % 3 == 2) {
+            threadedTree.remove(key / 2);
+            plainTree.remove(key / 2);
+        }
+        else {
+            threadedTree.insert(make_pair(key, i));
+            plainTree.insert(make_pair(key, i));
+        }
+    }
+    AVLTree<int, int>::iterator t1 = threadedTree.begin(), t2 = plainTree.begin();
+    for(; t1 != threadedTree.end() && t2 != plainTree.end() && *t1 == *t2; ++t1, ++t2) { }
+    if(t1 != threadedTree.end() || t2 != plainTree.end() || !threadedTree.threaded() || !threadedTree.isBalanced()) {
+        cout << "AVL threads FAILED" << endl;
+        ok = false;
+    }
+
+    // AVL Tree tests: compacting moves every node but keeps the contents,
+    // and the tree stays usable between and after incremental steps
+    threadedTree.compact();
+    plainTree.compact(COMPACT_KEY_ORDER);
+    plainTree.insert(make_pair(500, 0));
+    plainTree.remove(500);
+    while(!threadedTree.compact_step(7)) {
+        threadedTree.remove(threadedTree.begin()->first);
+        plainTree.remove(plainTree.begin()->first);
+    }
+    t1 = threadedTree.begin();
+    t2 = plainTree.begin();
+    for(; t1 != threadedTree.end() && t2 != plainTree.end() && *t1 == *t2; ++t1, ++t2) { }
+    if(t1 != threadedTree.end() || t2 != plainTree.end() || !threadedTree.isBalanced() || !plainTree.isBalanced()
+       || threadedTree.extract(threadedTree.begin()->first).empty()) {
+        cout << "AVL compact FAILED" << endl;
+        ok = false;
+    }
+
+    // AVL Tree tests: a compacted node is handed over in place, and its
+    // block outlives the tree it came from
+    AVLTree<int, int> shelved;
+    AVLTree<int, int>::node_type outlived;
+    bool inPlace = false;
+    {
+        AVLTree<int, int> packedTree;
+        for(int i = 0; i < 64; ++i) packedTree.insert(make_pair(i, i * 10));
+        packedTree.compact(COMPACT_KEY_ORDER);
+        const int* slot = &packedTree.find(20)->second;
+        AVLTree<int, int>::node_type moving = packedTree.extract(20);
+        inPlace = !moving.empty() && &moving.value() == slot;
+        AVLTree<int, int>::iterator landed = shelved.insert(std::move(moving));
+        inPlace = inPlace && landed != shelved.end() && &landed->second == slot;
+        outlived = packedTree.extract(21);
+    }
+    shelved.insert(make_pair(5, 50));
+    if(!inPlace || outlived.empty() || outlived.value() != 210 || shelved[20] != 200 || !shelved.isBalanced()) {
+        cout << "AVL compacted extract FAILED" << endl;
+        ok = false;
+    }
+    shelved.clear();
+
+    // AVL Tree tests: keys without a default constructor, through every
+    // node layout
+    AVLTree<TicketKey, int> tickets;
+    set<int> ticketNumbers;
+    for(int i = 0; i < 100; ++i) {
+        tickets.insert(make_pair(TicketKey((i * 37) % 101), i));
+        ticketNumbers.insert((i * 37) % 101);
+    }
+    tickets.enableThreads();
+    tickets.compact();
+    for(int removed = 0; !tickets.compact_step(16); removed += 7) {
+        tickets.remove(TicketKey(removed));
+        ticketNumbers.erase(removed);
+    }
+    set<int>::iterator wantTicket = ticketNumbers.begin();
+    AVLTree<TicketKey, int>::iterator gotTicket = tickets.begin();
+    for(; wantTicket != ticketNumbers.end() && gotTicket != tickets.end() && *wantTicket == gotTicket->first.number;
+        ++wantTicket, ++gotTicket) { }
+    if(wantTicket != ticketNumbers.end() || gotTicket != tickets.end() || !tickets.isBalanced()) {
+        cout << "AVL key without default constructor FAILED" << endl;
+        ok = false;
+    }
+    // and a bulk build of them, large enough for the sort to merge runs
+    vector<pair<TicketKey, int> > ticketItems;
+    for(int i = 0; i < 5000; ++i) ticketItems.push_back(make_pair(TicketKey((i * 37) % 2003), i));
+    AVLTree<TicketKey, int> bulkTickets(ticketItems, builders);
+    int bulkTicketCount = 0;
+    for(AVLTree<TicketKey, int>::iterator it = bulkTickets.begin(); it != bulkTickets.end(); ++it) bulkTicketCount++;
+    if(bulkTicketCount != 2003 || bulkTickets.find(TicketKey(37))->second != 4007 || !bulkTickets.isBalanced()) {
+        cout << "AVL bulk build without default constructor FAILED" << endl;
+        ok = false;
+    }
+
+    // Intrusive AVL tests: the same objects in two trees, unlinked from one
+    vector<CacheEntry> entries(40);
+    IntrusiveAVLTree<CacheEntry, int, &CacheEntry::id, &CacheEntry::byId> ids;
+    IntrusiveAVLTree<CacheEntry, int, &CacheEntry::expiry, &CacheEntry::byExpiry> expiries;
+    for(int i = 0; i < 40; ++i) {
+        entries[i].id = i;
+        entries[i].expiry = (i * 17) % 40;
+        ids.insert(entries[i]);
+        expiries.insert(entries[i]);
+    }
+    for(int i = 0; i < 40; i += 3) ids.erase(entries[i]);
+    int nextId = 1, inOrder = 0;
+    for(CacheEntry* e = ids.first(); e != NULL; e = ids.next(*e), ++nextId) {
+        if(nextId % 3 == 0) nextId++;
+        if(e->id == nextId) inOrder++;
+    }
+    // erasing an object that is not in the tree changes nothing
+    bool erasedUnlinked = ids.erase(entries[3]);
+    IntrusiveAVLTree<CacheEntry, int, &CacheEntry::id, &CacheEntry::byId> otherIds;
+    bool erasedForeign = otherIds.erase(entries[5]);
+    if(inOrder != 26 || ids.size() != 26 || ids.insert(entries[1]) || ids.find(3) != NULL || ids.erase(4) != &entries[4]
+       || expiries.size() != 40 || expiries.find(17) != &entries[1] || erasedUnlinked || erasedForeign
+       || ids.size() != 25 || ids.find(5) != &entries[5]) {
+        cout << "Intrusive AVL FAILED" << endl;
+        ok = false;
+    }
+
+    // Red-Black Tree tests
+    RedBlackTree<char,int> rt;
+    rt.insert(std::make_pair('a',1));
+    rt.insert(std::make_pair('b',2));
+    rt.insert(std::make_pair('c',3));
+
+    cout << "\nRedBlackTree contents:" << endl;
+    for(RedBlackTree<char,int>::iterator it = rt.begin(); it != rt.end(); ++it) {
+        cout << it->first << " " << it->second << endl;
+    }
+    cout << "Erasing b" << endl;
+    rt.remove('b');
+    RedBlackTree<char,int> rtCopy(rt);
+    if(!rt.checkInvariants() || !rtCopy.checkInvariants() || rtCopy.find('c') == rtCopy.end()) {
+        cout << "Red-black invariants FAILED" << endl;
+        ok = false;
+    }
+    // random inserts and removes, checked against std::map after each one
+    RedBlackTree<int,int> rtRandom;
+    map<int,int> rtModel;
+    unsigned rtSeed = 12345;
+    for(int i = 0; i < 2000; ++i) {
+        rtSeed = rtSeed * 1103515245 + 12345;
+        int k = (int)((rtSeed >> 16) % 300);
+        if((rtSeed >> 8) % 3 == 0) {
+            rtRandom.remove(k);
+            rtModel.erase(k);
+        }
+        else {
+            rtRandom.insert(std::make_pair(k, i));
+            rtModel.insert(std::make_pair(k, i));
+        }
+        if(!rtRandom.checkInvariants()) {
+            cout << "Red-black random invariants FAILED after op " << i << endl;
+            ok = false;
+            break;
+        }
+    }
+    map<int,int>::iterator rtWant = rtModel.begin();
+    RedBlackTree<int,int>::iterator rtGot = rtRandom.begin();
+    for(; rtWant != rtModel.end() && rtGot != rtRandom.end() && rtWant->first == rtGot->first; ++rtWant, ++rtGot) { }
+    if(rtWant != rtModel.end() || rtGot != rtRandom.end()) {
+        cout << "Red-black random contents FAILED" << endl;
+        ok = false;
+    }
+
+    // Splay Tree tests
+    SplayTree<char,int> sp;
+    sp.insert(std::make_pair('a',1));
+    sp.insert(std::make_pair('b',2));
+    sp.insert(std::make_pair('c',3));
+    if(sp.find('a') != sp.end()) {
+        cout << "\nFound a, splay tree is now:" << endl;
+        sp.print();
+    }
+    cout << "Erasing b" << endl;
+    sp.remove('b');
+    // random inserts and removes in both modes, checked against std::map;
+    // a lookup leaves its key at the root (full) or no deeper (semi), and
+    // peek() and the const find() change nothing
+    SplayMode splayModes[] = { SPLAY_FULL, SPLAY_SEMI };
+    for(int m = 0; m < 2; ++m) {
+        SplayProbe splayed(splayModes[m]);
+        map<int, int> splayModel;
+        unsigned splaySeed = 777;
+        bool splayOk = true;
+        for(int i = 0; i < 3000; ++i) {
+            splaySeed = splaySeed * 1103515245 + 12345;
+            int k = (int)((splaySeed >> 16) % 400);
+            if((splaySeed >> 8) % 3 == 0) {
+                splayed.remove(k);
+                splayModel.erase(k);
+            }
+            else if((splaySeed >> 8) % 3 == 1) {
+                splayed.insert(std::make_pair(k, i));
+                splayModel[k] = i;
+            }
+            else if(splayModel.count(k) != 0) {
+                size_t before = splayed.depth(k);
+                if(splayed.find(k) == splayed.end() || splayed.find(k)->second != splayModel[k]
+                   || (splayModes[m] == SPLAY_FULL ? splayed.rootKey() != k : splayed.depth(k) > before)) {
+                    splayOk = false;
+                }
+            }
+        }
+        map<int, int>::iterator splayWant = splayModel.begin();
+        SplayTree<int, int>::iterator splayGot = splayed.begin();
+        for(; splayWant != splayModel.end() && splayGot != splayed.end() && *splayWant == *splayGot; ++splayWant, ++splayGot) { }
+        int rootBefore = splayed.rootKey();
+        uint64_t rotationsBefore = splayed.rotationCount();
+        const SplayTree<int, int>& splayReader = splayed;
+        int deepest = splayModel.begin()->first;
+        if(splayReader.find(deepest) == splayed.end() || splayed.peek(splayModel.rbegin()->first) == splayed.end()
+           || splayed.peek(-1) != splayed.end() || splayReader[deepest] != splayModel[deepest]) {
+            splayOk = false;
+        }
+        if(!splayOk || splayWant != splayModel.end() || splayGot != splayed.end() || splayed.rotationCount() == 0
+           || splayed.rootKey() != rootBefore || splayed.rotationCount() != rotationsBefore) {
+            cout << "Splay " << (splayModes[m] == SPLAY_FULL ? "full" : "semi") << " FAILED" << endl;
+            ok = false;
+        }
+    }
+
     // AVL tree test: debugging
     AVLTree<int, int> ct;
     ct.insert(make_pair(-17, -17));
@@ -83,5 +542,329 @@ int main(int argc, char *argv[])
     ct.insert(make_pair(84, 84));
     ct.print();
 
-    return 0;
+    // AVL tree test: batched lookups match find()
+    int probes[] = { -17, -16, 84, 138, 139, -144, 0, 58 };
+    AVLTree<int, int>::iterator found[8];
+    ct.find_batch(probes, 8, found);
+    for(int i = 0; i < 8; ++i) {
+        if(found[i] != ct.find(probes[i])) {
+            cout << "find_batch FAILED for " << probes[i] << endl;
+            ok = false;
+        }
+    }
+    // AVL tree test: one sorted walk finds the same keys
+    int sortedProbes[] = { -144, -144, -143, -17, 0, 58, 84, 138, 139 };
+    int walkHits = 0;
+    ct.find_sorted(sortedProbes, sortedProbes + 9, [&](std::pair<const int, int>& item) {
+        if(item.second != item.first) {
+            cout << "find_sorted FAILED for " << item.first << endl;
+            ok = false;
+        }
+        walkHits++;
+    });
+    if(walkHits != 6) {
+        cout << "find_sorted FAILED: " << walkHits << " hits" << endl;
+        ok = false;
+    }
+
+    // AVL tree test: a sorted batch gives the same tree either way
+    vector<BatchOp<int, int> > batch(4);
+    batch[0].kind = BATCH_DELETE; batch[0].key = -144;
+    batch[1].kind = BATCH_UPSERT; batch[1].key = 0; batch[1].value = 1;
+    batch[2].kind = BATCH_UPSERT; batch[2].key = 84; batch[2].value = 85;
+    batch[3].kind = BATCH_DELETE; batch[3].key = 200;
+    AVLTree<int, int> perOp, rebuilt, joined;
+    for(AVLTree<int, int>::iterator it = ct.begin(); it != ct.end(); ++it) {
+        perOp.insert(*it);
+        rebuilt.insert(*it);
+        joined.insert(*it);
+    }
+    joined.enableThreads();
+    perOp.apply_batch(batch, BATCH_PER_OP);
+    rebuilt.apply_batch(batch, BATCH_REBUILD);
+    joined.apply_batch(batch, BATCH_JOIN);
+    AVLTree<int, int>::iterator a = perOp.begin(), b = rebuilt.begin(), j = joined.begin();
+    for(; a != perOp.end() && b != rebuilt.end() && j != joined.end() && *a == *b && *a == *j; ++a, ++b, ++j) { }
+    if(a != perOp.end() || b != rebuilt.end() || j != joined.end() || !rebuilt.isBalanced()
+       || perOp.find(-144) != perOp.end() || perOp[0] != 1 || rebuilt[84] != 85) {
+        cout << "apply_batch FAILED" << endl;
+        ok = false;
+    }
+
+    // AVL tree test: the split/join pass keeps the tree balanced and
+    // threaded through a batch that deletes a whole run of keys
+    AVLTree<int, int> runs;
+    vector<BatchOp<int, int> > sweep;
+    for(int i = 0; i < 300; ++i) {
+        runs.insert(make_pair(i, i));
+        sweep.push_back(BatchOp<int, int>{i < 200 ? BATCH_DELETE : BATCH_UPSERT, i < 200 ? i : 2 * i, -i});
+    }
+    runs.enableThreads();
+    runs.apply_batch(sweep, BATCH_JOIN);
+    vector<int> survivors;
+    for(int k = 200; k < 300; ++k) survivors.push_back(k);
+    for(int k = 400; k < 600; k += 2) survivors.push_back(k);
+    AVLTree<int, int>::iterator r = runs.begin();
+    size_t seen = 0;
+    for(; r != runs.end() && seen < survivors.size() && r->first == survivors[seen]; ++r, ++seen) { }
+    if(r != runs.end() || seen != survivors.size() || runs[450] != -225 || runs[250] != 250) {
+        cout << "apply_batch join FAILED" << endl;
+        ok = false;
+    }
+
+    // AVL tree test: snapshot round trip
+    ct.save("bst-test.snapshot");
+    AVLTree<int, int> st;
+    st.load("bst-test.snapshot");
+    cout << "\nLoaded snapshot:" << endl;
+    st.print();
+    if(!st.isBalanced() || st.find(-45) == st.end() || st.find(-45)->second != -45) {
+        cout << "Snapshot load FAILED" << endl;
+        ok = false;
+    }
+    MappedSnapshot<int, int> mapped("bst-test.snapshot");
+    int value;
+    if(mapped.size() != 30 || !mapped.find(84, value) || value != 84 || mapped.find(85, value)) {
+        cout << "Mapped snapshot FAILED" << endl;
+        ok = false;
+    }
+    remove("bst-test.snapshot");
+
+    // Durable AVL tests: a reopened tree replays its log, batches included,
+    // and a record torn off mid-write is dropped
+    remove("bst-test.durable.snap");
+    remove("bst-test.durable.wal");
+    DurableOptions eachOp;
+    eachOp.groupCommitMicros = 0;
+    map<int, int> logged;
+    long lastRecordAt = 0;
+    {
+        DurableAVLTree<int, int> durable("bst-test.durable", eachOp);
+        for(int i = 0; i < 20; ++i) {
+            durable.insert(make_pair(i, i * i));
+            logged[i] = i * i;
+        }
+        durable.remove(3);
+        logged.erase(3);
+        vector<BatchOp<int, int> > perOpBatch, rebuildBatch;
+        perOpBatch.push_back(BatchOp<int, int>{BATCH_UPSERT, 5, -5});
+        perOpBatch.push_back(BatchOp<int, int>{BATCH_DELETE, 7, 0});
+        perOpBatch.push_back(BatchOp<int, int>{BATCH_UPSERT, 100, 1});
+        durable.apply_batch(perOpBatch, BATCH_PER_OP);
+        rebuildBatch.push_back(BatchOp<int, int>{BATCH_DELETE, 0, 0});
+        rebuildBatch.push_back(BatchOp<int, int>{BATCH_UPSERT, 50, 2});
+        durable.apply_batch(rebuildBatch, BATCH_REBUILD);
+        logged[5] = -5;
+        logged.erase(7);
+        logged[100] = 1;
+        logged.erase(0);
+        logged[50] = 2;
+        durable.insert(durable.end(), make_pair(60, 3));
+        logged[60] = 3;
+        FILE* wal = fopen("bst-test.durable.wal", "rb");
+        if(wal != NULL) {
+            fseek(wal, 0, SEEK_END);
+            lastRecordAt = ftell(wal);
+            fclose(wal);
+        }
+        durable.insert(make_pair(200, 4));
+    }
+    {
+        DurableAVLTree<int, int> reopened("bst-test.durable", eachOp);
+        map<int, int>::iterator want = logged.begin();
+        AVLTree<int, int>::iterator got = reopened.begin();
+        for(; want != logged.end() && got != reopened.end() && *want == *got; ++want, ++got) { }
+        if(want != logged.end() || got == reopened.end() || got->first != 200 || ++got != reopened.end()
+           || reopened.recoveredRecords() != 28 || !reopened.isBalanced()) {
+            cout << "Durable replay FAILED" << endl;
+            ok = false;
+        }
+    }
+    if(lastRecordAt <= 0 || truncate("bst-test.durable.wal", lastRecordAt + 5) != 0) {
+        cout << "Durable torn record FAILED: cannot truncate the log" << endl;
+        ok = false;
+    }
+    {
+        DurableAVLTree<int, int> reopened("bst-test.durable", eachOp);
+        map<int, int>::iterator want = logged.begin();
+        AVLTree<int, int>::iterator got = reopened.begin();
+        for(; want != logged.end() && got != reopened.end() && *want == *got; ++want, ++got) { }
+        if(want != logged.end() || got != reopened.end() || reopened.recoveredRecords() != 27) {
+            cout << "Durable torn record FAILED" << endl;
+            ok = false;
+        }
+    }
+    remove("bst-test.durable.snap");
+    remove("bst-test.durable.wal");
+
+    // Read-optimized tree tests: rebuilding from sampled lookups keeps the
+    // items in order and moves the hot keys up, and readers sharing the
+    // sampled tree on several threads lose no samples
+    AVLTree<int, int> sampled;
+    for(int i = 0; i < 255; ++i) sampled.insert(make_pair(i, -i));
+    sampled.enableAccessSampling(1);
+    const AVLTree<int, int>& sampledReader = sampled;
+    vector<std::thread> readers;
+    for(int t = 0; t < 4; ++t) {
+        readers.push_back(std::thread([&sampledReader, t]() {
+            for(int i = 0; i < 250; ++i) sampledReader.find(t == 0 ? 7 : 200 + t);
+        }));
+    }
+    for(size_t t = 0; t < readers.size(); ++t) readers[t].join();
+    for(int i = 0; i < 255; ++i) sampled.find(i);
+    uint64_t sampledTotal = 0;
+    for(map<int, uint64_t>::const_iterator it = sampled.accessCounts()->begin(); it != sampled.accessCounts()->end(); ++it) {
+        sampledTotal += it->second;
+    }
+    ReadOptimizedTree<int, int> readTree(sampled);
+    double balancedDepth = sampled.averageProbeDepth();
+    double optimizedDepth = readTree.averageProbeDepth();
+    readTree.insert(make_pair(300, -300));
+    readTree.remove(100);
+    readTree.reoptimize();
+    sampled.insert(make_pair(300, -300));
+    sampled.remove(100);
+    AVLTree<int, int>::iterator r1 = sampled.begin();
+    ReadOptimizedTree<int, int>::iterator r2 = readTree.begin();
+    for(; r1 != sampled.end() && r2 != readTree.end() && *r1 == *r2; ++r1, ++r2) { }
+    if(sampledTotal != 1000 + 255 || r1 != sampled.end() || r2 != readTree.end()
+       || !(optimizedDepth < balancedDepth) || readTree.averageProbeDepth() > optimizedDepth + 0.5) {
+        cout << "Read-optimized tree FAILED" << endl;
+        ok = false;
+    }
+    // a splay tree samples its lookups too, splaying or not
+    SplayTree<int, int> sampledSplay;
+    for(int i = 0; i < 64; ++i) sampledSplay.insert(make_pair(i, i));
+    sampledSplay.enableAccessSampling(1);
+    for(int i = 0; i < 30; ++i) {
+        sampledSplay.find(5);
+        sampledSplay.peek(9);
+        sampledSplay[40];
+    }
+    ReadOptimizedTree<int, int> splayReadTree(sampledSplay);
+    map<int, uint64_t> wantCounts;
+    wantCounts[5] = wantCounts[9] = wantCounts[40] = 30;
+    if(splayReadTree.accessCounts() == NULL || *splayReadTree.accessCounts() != wantCounts) {
+        cout << "Splay access sampling FAILED" << endl;
+        ok = false;
+    }
+
+    // Buffered AVL tests, with the merge inline and in the background: every
+    // write is readable at once whether it sits in the open run, a sealed
+    // run or the tree, tombstones hide older values, iteration is in key
+    // order, and flush() leaves nothing buffered
+    for(int background = 0; background < 2; ++background) {
+        BufferedOptions small;
+        small.runEntries = 4;
+        small.bufferEntries = 16;
+        small.backgroundMerge = background != 0;
+        BufferedAVLTree<int, int> buffered(small);
+        map<int, int> bufferedModel;
+        bool readsOk = true, orderOk = true;
+        for(int i = 0; i < 300; ++i) {
+            int k = (i * 17) % 61;
+            if(i % 4 == 3) {
+                buffered.remove(k);
+                bufferedModel.erase(k);
+            }
+            else {
+                buffered.insert(make_pair(k, i));
+                bufferedModel[k] = i;
+            }
+            if(i == 150) buffered.flush();
+            for(int probe = 0; probe < 61; ++probe) {
+                int got = -1;
+                bool hit = buffered.find(probe, got);
+                map<int, int>::iterator want = bufferedModel.find(probe);
+                if(hit != (want != bufferedModel.end()) || (hit && got != want->second)) readsOk = false;
+            }
+            if(i % 50 == 49) {
+                map<int, int>::iterator want = bufferedModel.begin();
+                BufferedAVLTree<int, int>::iterator got = buffered.begin();
+                for(; want != bufferedModel.end() && got != buffered.end() && want->first == got->first && want->second == got->second; ++want, ++got) { }
+                if(want != bufferedModel.end() || got != buffered.end()) orderOk = false;
+            }
+        }
+        // a key merged into the tree, then removed while the tree still has it
+        buffered.flush();
+        int hidden = bufferedModel.begin()->first, unused = 0;
+        buffered.remove(hidden);
+        bool hiddenInOpenRun = !buffered.find(hidden, unused);
+        for(int k = 100; k < 103; ++k) buffered.insert(make_pair(k, k));
+        bool hiddenInSealedRun = !buffered.find(hidden, unused);
+        buffered.flush();
+        bufferedModel.erase(hidden);
+        for(int k = 100; k < 103; ++k) bufferedModel[k] = k;
+        map<int, int>::iterator want = bufferedModel.begin();
+        BufferedAVLTree<int, int>::iterator got = buffered.begin();
+        for(; want != bufferedModel.end() && got != buffered.end() && want->first == got->first && want->second == got->second; ++want, ++got) { }
+        if(!readsOk || !orderOk || !hiddenInOpenRun || !hiddenInSealedRun || buffered.find(hidden, unused)
+           || buffered.buffered() != 0 || want != bufferedModel.end() || got != buffered.end()) {
+            cout << "Buffered AVL FAILED" << (background ? " with background merge" : "") << endl;
+            ok = false;
+        }
+    }
+
+    // Compressed map test: an export spanning several blocks, with a run of
+    // consecutive keys and a jump to the top of the key range
+    AVLTree<uint64_t, uint64_t> cold;
+    for(uint64_t k = 0; k < 300; ++k) cold.insert(make_pair(k < 200 ? k * 7 : 5000 + k, k));
+    cold.insert(make_pair(UINT64_MAX, 1));
+    CompressedMap<uint64_t> packed(cold);
+    uint64_t packedValue = 0, packedSum = 0;
+    packed.for_each_range(1400, 5203, [&packedSum](uint64_t, const uint64_t& v) { packedSum += v; });
+    if(packed.size() != 301 || packed.blocks() != 3 || !packed.find(7 * 199, packedValue) || packedValue != 199
+       || packed.find(8, packedValue) || !packed.find(UINT64_MAX, packedValue) || packedValue != 1
+       || packed.lowerBound(8) != 2 || packed.lowerBound(5300) != 300 || packed.keyAt(250) != 5250
+       || packedSum != 200 + 201 + 202) {
+        cout << "Compressed map FAILED" << endl;
+        ok = false;
+    }
+
+    // Trace test: replaying a recorded trace rebuilds the recorded tree, and
+    // a failed write surfaces from flush()
+    AVLTree<int, int> traced;
+    {
+        TraceRecorder<int> recorder("bst-test.trace");
+        traced.setTraceRecorder(&recorder);
+        for(int i = 0; i < 200; ++i) {
+            int k = (i * 37) % 101 - 50;
+            if(i % 3 == 2) traced.remove(k);
+            else traced.insert(make_pair(k, k * 2));
+            traced.find(k + 1);
+        }
+        traced.begin();
+        recorder.flush();
+        traced.setTraceRecorder(NULL);
+    }
+    AVLTree<int, int> replayed;
+    size_t replayedOps = 0;
+    TraceReader traceIn("bst-test.trace");
+    uint64_t prevKey = 0;
+    while(traceIn.keyKind() == TRACE_KEY_SINT && traceIn.keySize() == sizeof(int) && !traceIn.atEnd()) {
+        TraceOp op = (TraceOp)traceIn.getByte();
+        replayedOps++;
+        if(op == TRACE_SCAN) continue;
+        int k = TraceKeyCodec<int>::decode(traceIn, prevKey);
+        if(op == TRACE_INSERT) replayed.insert(make_pair(k, k * 2));
+        else if(op == TRACE_REMOVE) replayed.remove(k);
+    }
+    AVLTree<int, int>::iterator tracedIt = traced.begin(), replayedIt = replayed.begin();
+    for(; tracedIt != traced.end() && replayedIt != replayed.end() && *tracedIt == *replayedIt; ++tracedIt, ++replayedIt) { }
+    if(replayedOps != 401 || tracedIt != traced.end() || replayedIt != replayed.end()) {
+        cout << "Trace record/replay FAILED" << endl;
+        ok = false;
+    }
+    remove("bst-test.trace");
+    try {
+        TraceRecorder<int> full("/dev/full");
+        full.record(TRACE_INSERT, 1);
+        full.flush();
+        cout << "Trace write error FAILED" << endl;
+        ok = false;
+    }
+    catch(const runtime_error&) {
+    }
+
+    return ok ? 0 : 1;
 }
@@ -6,6 +6,33 @@
 #include <cstdlib>
 #include <utility>
 #include <queue>
+#include <map>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include "trace.h"
+#include "parallel.h"
+
+// Phase markers for the hardware-counter profiling mode (see bst_profile.h).
+#ifdef BST_PROFILE
+#include "bst_profile.h"
+#else
+#define BST_PROFILE_PHASE(phase)
+#endif
+
+// Software prefetch hint for the batched lookups; a no-op on compilers
+// without the builtin.
+#if defined(__GNUC__)
+#define BST_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define BST_PREFETCH(addr)
+#endif
 
 /**
  * A templated class for a Node in a search tree.
@@ -36,7 +63,35 @@ public:
     void setRight(Node<Key, Value>* right);
     void setValue(const Value &value);
 
+    // In-order threads (see AVLTree::enableThreads()): a missing child's
+    // link may hold the in-order neighbor on that side instead, tagged in
+    // its low bit, or a tagged NULL at either end of the tree.  getLeft()
+    // and getRight() read a thread as no child; the thread getters return
+    // NULL unless the link is a thread.
+    bool hasLeftThread() const { return isThread(left_); }
+    bool hasRightThread() const { return isThread(right_); }
+    Node<Key, Value>* getLeftThread() const { return threadTarget(left_); }
+    Node<Key, Value>* getRightThread() const { return threadTarget(right_); }
+    void setLeftThread(Node<Key, Value>* pred) { left_ = tagThread(pred); }
+    void setRightThread(Node<Key, Value>* succ) { right_ = tagThread(succ); }
+
+    // A new node with this one's item and any balancing state the node
+    // type adds, linked to parent only; tree copies clone node by node.
+    virtual Node<Key, Value>* clone(Node<Key, Value>* parent) const;
+
 protected:
+    static bool isThread(Node<Key, Value>* link) { return (reinterpret_cast<uintptr_t>(link) & 1) != 0; }
+    // link if it is a real child, else NULL
+    static Node<Key, Value>* childOf(Node<Key, Value>* link) { return isThread(link) ? NULL : link; }
+    static Node<Key, Value>* threadTarget(Node<Key, Value>* link)
+    {
+        return isThread(link) ? reinterpret_cast<Node<Key, Value>*>(reinterpret_cast<uintptr_t>(link) & ~(uintptr_t)1) : NULL;
+    }
+    static Node<Key, Value>* tagThread(Node<Key, Value>* target)
+    {
+        return reinterpret_cast<Node<Key, Value>*>(reinterpret_cast<uintptr_t>(target) | 1);
+    }
+
     std::pair<const Key, Value> item_;
     Node<Key, Value>* parent_;
     Node<Key, Value>* left_;
@@ -133,7 +188,7 @@ Node<Key, Value>* Node<Key, Value>::getParent() const
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getLeft() const
 {
-    return left_;
+    return childOf(left_);
 }
 
 /**
@@ -142,7 +197,7 @@ Node<Key, Value>* Node<Key, Value>::getLeft() const
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getRight() const
 {
-    return right_;
+    return childOf(right_);
 }
 
 /**
@@ -181,12 +236,167 @@ void Node<Key, Value>::setValue(const Value& value)
     item_.second = value;
 }
 
+template<typename Key, typename Value>
+Node<Key, Value>* Node<Key, Value>::clone(Node<Key, Value>* parent) const
+{
+    return new Node<Key, Value>(item_.first, item_.second, parent);
+}
+
 /*
   ---------------------------------------
   End implementations for the Node class.
   ---------------------------------------
 */
 
+/**
+* Lookup counts kept by BinarySearchTree::enableAccessSampling(): one in
+* every period lookups is counted against its key.  Const lookups sample
+* too, so readers sharing a tree share the sampler: tick is atomic and
+* counts is only updated under mutex.
+*/
+template <typename Key>
+struct AccessSampler
+{
+    AccessSampler() : period(1), tick(0) { }
+    AccessSampler(const AccessSampler& other) : period(other.period), tick(other.tick.load()), counts(other.counts) { }
+
+    unsigned period;
+    std::atomic<unsigned> tick;
+    std::mutex mutex;
+    std::map<Key, uint64_t> counts;
+};
+
+template <typename Key, typename Value>
+class BinarySearchTree;
+template <class Key, class Value>
+class AVLTree;
+
+/**
+* A block of node slots for AVLTree::compact().  Slots are handed out in
+* order and never reused.  Each tree that may hold nodes from the block
+* holds the block, and a node handle holds its node's slot, so the block
+* is freed by whichever lets go last: once it has no holders and no live
+* nodes.
+*/
+template <typename NodeType>
+class NodeArena
+{
+public:
+    explicit NodeArena(size_t capacity) :
+        slots_(static_cast<NodeType*>(::operator new(capacity * sizeof(NodeType)))),
+        capacity_(capacity), used_(0), live_(0), holders_(0) { }
+    ~NodeArena() { ::operator delete(slots_); }
+
+    bool full() const { return used_ == capacity_; }
+    size_t live() const { return live_; }
+    const NodeType* begin() const { return slots_; }
+    bool owns(const NodeType* node) const
+    {
+        std::less<const NodeType*> before;
+        return !before(node, slots_) && before(node, slots_ + used_);
+    }
+    // raw storage for the next node, which the caller constructs
+    void* allocate() { live_++; return slots_ + used_++; }
+    // release() follows a node's destruction and drop() a tree's letting
+    // go; each returns true if the caller must now delete the block
+    bool release() { live_--; return unused(); }
+    void hold() { holders_++; }
+    bool drop() { holders_--; return unused(); }
+
+private:
+    bool unused() const { return live_ == 0 && holders_ == 0; }
+
+    NodeType* slots_;
+    size_t capacity_;
+    size_t used_;
+    size_t live_;
+    size_t holders_;
+
+    NodeArena(const NodeArena&);
+    NodeArena& operator=(const NodeArena&);
+};
+
+/**
+* Owns a node taken out of a tree with extract(), until insert() links it
+* into another tree (or the same one) or the handle is destroyed.  Moving
+* a node this way allocates and copies nothing.  While the node is
+* detached its key may be changed, as with std::map's node handles.
+* NodeType is the node class of the tree it came from; only trees of that
+* node class accept it.
+*/
+template <typename Key, typename Value, typename NodeType = Node<Key, Value> >
+class NodeHandle
+{
+public:
+    NodeHandle() : node_(NULL), arena_(NULL) { }
+    NodeHandle(NodeHandle&& other) noexcept : node_(other.node_), arena_(other.arena_)
+    {
+        other.node_ = NULL;
+        other.arena_ = NULL;
+    }
+    NodeHandle& operator=(NodeHandle&& other) noexcept;
+    ~NodeHandle() { destroy(); }
+
+    bool empty() const { return node_ == NULL; }
+    explicit operator bool() const { return node_ != NULL; }
+    Key& key() const;
+    Value& value() const { return node_->getValue(); }
+
+protected:
+    friend class BinarySearchTree<Key, Value>;
+    friend class AVLTree<Key, Value>;
+    explicit NodeHandle(NodeType* node, NodeArena<NodeType>* arena = NULL) : node_(node), arena_(arena) { }
+    void destroy();
+
+    NodeType* node_;
+    // the block holding node_ if it was compacted, else NULL for a heap node
+    NodeArena<NodeType>* arena_;
+
+    NodeHandle(const NodeHandle&);
+    NodeHandle& operator=(const NodeHandle&);
+};
+
+template<typename Key, typename Value, typename NodeType>
+NodeHandle<Key, Value, NodeType>& NodeHandle<Key, Value, NodeType>::operator=(NodeHandle&& other) noexcept
+{
+    if(this != &other) {
+        destroy();
+        node_ = other.node_;
+        arena_ = other.arena_;
+        other.node_ = NULL;
+        other.arena_ = NULL;
+    }
+    return *this;
+}
+
+// Frees the node: to the heap, or back to its block.
+template<typename Key, typename Value, typename NodeType>
+void NodeHandle<Key, Value, NodeType>::destroy()
+{
+    if(node_ == NULL) {
+        return;
+    }
+    if(arena_ == NULL) {
+        delete node_;
+    }
+    else {
+        node_->~NodeType();
+        if(arena_->release()) delete arena_;
+    }
+    node_ = NULL;
+    arena_ = NULL;
+}
+
+/**
+* The key is stored const, as a tree must never see it change; no tree
+* sees a detached node, so it is safe to hand out for writing here.
+*/
+template<typename Key, typename Value, typename NodeType>
+Key& NodeHandle<Key, Value, NodeType>::key() const
+{
+    return const_cast<Key&>(node_->getKey());
+}
+
 /**
 * A templated unbalanced binary search tree.
 */
@@ -196,12 +406,40 @@ class BinarySearchTree
 public:
     BinarySearchTree();
     virtual ~BinarySearchTree();
+    // Copies clone other's shape node by node in O(n), with no comparisons
+    // or rotations, keeping each node's balancing state.  The second form
+    // clones large subtrees on pool's threads (see parallel.h).  Copies
+    // take other's scapegoat mode and sampled counts but not its trace
+    // recorder.  Moves are O(1) and leave other empty.
+    BinarySearchTree(const BinarySearchTree& other);
+    BinarySearchTree(const BinarySearchTree& other, WorkStealingPool& pool);
+    BinarySearchTree(BinarySearchTree&& other);
+    BinarySearchTree& operator=(const BinarySearchTree& other);
+    BinarySearchTree& operator=(BinarySearchTree&& other);
     virtual void insert(const std::pair<const Key, Value>& keyValuePair);
     virtual void remove(const Key& key);
     void clear();
     bool isBalanced() const;
     void print() const;
     bool empty() const;
+    void setTraceRecorder(TraceRecorder<Key>* recorder);
+
+    // Access sampling, for rebuilding into a read-optimized shape (see
+    // ReadOptimizedTree in weightedbst.h)
+    void enableAccessSampling(unsigned period = 16);
+    void disableAccessSampling();
+    const std::map<Key, uint64_t>* accessCounts() const;
+    double averageProbeDepth() const;
+
+    // Scapegoat mode: plain inserts that land deeper than log base 1/alpha
+    // of the size rebuild the unbalanced subtree above them, and removes
+    // rebuild the whole tree once it shrinks below alpha of its peak.
+    void enableScapegoat(double alpha = 0.7);
+    void disableScapegoat();
+    // rebuilds the whole tree into perfect balance in place (DSW)
+    void rebalance();
+    // (Both restructure plain nodes, so a self-balancing tree, which keeps
+    // its own balance, throws std::logic_error from them.)
 
     template<typename PPKey, typename PPValue>
     friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue> & tree);
@@ -232,9 +470,36 @@ public:
     iterator begin() const;
     iterator end() const;
     iterator find(const Key& key) const;
+    // n lookups at once: out[i] = find(keys[i]), with the descents
+    // interleaved so their cache misses overlap
+    void find_batch(const Key* keys, size_t n, iterator* out) const;
+    // lookups of an ascending key range [first, last) in one walk; each
+    // hit's item goes to callback, in key order
+    template<typename RandomIt, typename Callback>
+    void find_sorted(RandomIt first, RandomIt last, Callback callback) const;
+    // Whole-tree passes split into subtree tasks on pool (see parallel.h).
+    // fn may run on several threads at once, each item once, in no
+    // particular order.  parallel_reduce folds map(item) with combine,
+    // which must be associative but need not commute: the results are
+    // combined in key order, as a serial left-to-right fold would.
+    template<typename Fn>
+    void parallel_for_each(Fn fn, WorkStealingPool& pool = WorkStealingPool::shared()) const;
+    template<typename T, typename Map, typename Combine>
+    T parallel_reduce(T identity, Map map, Combine combine, WorkStealingPool& pool = WorkStealingPool::shared()) const;
     Value& operator[](const Key& key);
     Value const & operator[](const Key& key) const;
 
+    // Node handles: extract() unlinks key's node and hands it over (empty
+    // if key is absent); insert() links a handle's node back in and
+    // empties the handle, or, if its key is already present, leaves the
+    // handle alone and returns the present item.  Neither allocates.
+    // These move plain nodes, so a self-balancing tree reached through a
+    // BinarySearchTree reference throws std::logic_error instead; use the
+    // tree's own node handles (AVLTree::extract()).
+    typedef NodeHandle<Key, Value> node_type;
+    node_type extract(const Key& key);
+    iterator insert(node_type&& node);
+
 protected:
     // Mandatory helper functions
     Node<Key, Value>* internalFind(const Key& k) const;
@@ -249,17 +514,72 @@ protected:
 
     // Add helper functions here
     int numChildren(Node<Key, Value>* current) const;
+    void unlink(Node<Key, Value>* node);
     void remove_0(Node<Key, Value>* node);
     void remove_1(Node<Key, Value>* node);
     bool isBalanced(Node<Key, Value>* root) const;
     int left_height(Node<Key, Value>* current) const;
     int right_height(Node<Key, Value>* current) const;
     static Node<Key, Value>* successor(Node<Key, Value>* current);
+    void sampleAccess(const Key& key) const;
+    size_t probeDepth(const Key& key) const;
+    template<typename RandomIt, typename Callback>
+    void findSortedBelow(Node<Key, Value>* node, RandomIt first, RandomIt last, Callback& callback) const;
+    size_t subtreeSize(Node<Key, Value>* root) const;
+    void copySettings(const BinarySearchTree& other);
+    void swapContents(BinarySearchTree& other);
+    static Node<Key, Value>* cloneSubtree(const Node<Key, Value>* source, Node<Key, Value>* parent);
+    static void destroySubtree(Node<Key, Value>* root);
+    // Whether the tree keeps balance data in its nodes or rules on its
+    // shape, which the operations on plain nodes here (node handles,
+    // rebalance(), scapegoat mode) would break; self-balancing trees
+    // override it to say so.
+    virtual bool balancesItself() const { return false; }
+    // frees the nodes of root's subtree for clear(); trees that place
+    // nodes somewhere other than the heap override it
+    virtual void releaseNodes(Node<Key, Value>* root) { destroySubtree(root); }
+    // a subtree for a parallel copy to clone under parent
+    struct CloneSlot
+    {
+        const Node<Key, Value>* source;
+        Node<Key, Value>* parent;
+        bool left;
+    };
+    Node<Key, Value>* cloneTop(const Node<Key, Value>* source, Node<Key, Value>* parent, unsigned depth,
+                               std::vector<CloneSlot>& slots) const;
+    virtual size_t sizeHint(const Node<Key, Value>* root) const;
+    void splitForParallel(Node<Key, Value>* node, unsigned depth,
+                          std::vector<std::pair<Node<Key, Value>*, bool> >& pieces) const;
+    template<typename Fn>
+    static void visitSubtree(Node<Key, Value>* root, Fn& fn);
+    void scapegoatInsert(Node<Key, Value>* node, size_t depth);
+    void rebuildSubtree(Node<Key, Value>* root, size_t size);
+    static Node<Key, Value>* linkPerfect(std::vector<Node<Key, Value>*>& nodes, size_t lo, size_t hi,
+                                         Node<Key, Value>* parent);
+    void compressVine(size_t count);
+    void threadAll();
+    void unthreadAll();
+    // lets derived trees return iterators to nodes they found themselves
+    static iterator makeIterator(Node<Key, Value>* node) { return iterator(node); }
+    static Node<Key, Value>* iteratorNode(const iterator& it) { return it.current_; }
 
 
 protected:
     Node<Key, Value>* root_;
     // You should not need other data members
+
+    // operation trace sink, NULL unless tracing (see trace.h)
+    TraceRecorder<Key>* recorder_;
+    // sampled lookup counts, NULL unless sampling
+    mutable AccessSampler<Key>* sampler_;
+    // scapegoat balance factor, 0 unless scapegoat mode is on; the node
+    // counts are only kept while it is
+    double scapegoatAlpha_;
+    size_t nodeCount_;
+    size_t maxNodeCount_;
+    // in-order threads in missing child links; only AVLTree keeps them up
+    // to date, so only it turns them on
+    bool threaded_;
 };
 
 /*
@@ -379,6 +699,12 @@ template<class Key, class Value>
 BinarySearchTree<Key, Value>::BinarySearchTree() 
 {
     root_ = NULL;
+    recorder_ = NULL;
+    sampler_ = NULL;
+    scapegoatAlpha_ = 0;
+    nodeCount_ = 0;
+    maxNodeCount_ = 0;
+    threaded_ = false;
 }
 
 template<typename Key, typename Value>
@@ -387,6 +713,7 @@ BinarySearchTree<Key, Value>::~BinarySearchTree()
     if(!empty()) {
         clear();
     }
+    delete sampler_;
 }
 
 /**
@@ -398,6 +725,553 @@ bool BinarySearchTree<Key, Value>::empty() const
     return root_ == NULL;
 }
 
+/**
+* Starts logging every insert/remove/find/operator[]/begin() on this tree
+* to recorder, or stops if recorder is NULL.  The recorder must outlive
+* its attachment to the tree.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::setTraceRecorder(TraceRecorder<Key>* recorder)
+{
+    recorder_ = recorder;
+}
+
+/**
+* Starts counting one in every period lookups (find, operator[] and the
+* lookups inside insert/remove) against its key.  Restarting clears the
+* counts.  Concurrent const lookups may sample; enabling, disabling and
+* reading the counts (accessCounts(), averageProbeDepth(), building a
+* ReadOptimizedTree) must not overlap them.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::enableAccessSampling(unsigned period)
+{
+    delete sampler_;
+    sampler_ = new AccessSampler<Key>();
+    sampler_->period = period > 0 ? period : 1;
+    sampler_->tick = 0;
+}
+
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::disableAccessSampling()
+{
+    delete sampler_;
+    sampler_ = NULL;
+}
+
+/**
+* The sampled counts, or NULL if sampling is off.
+*/
+template<typename Key, typename Value>
+const std::map<Key, uint64_t>* BinarySearchTree<Key, Value>::accessCounts() const
+{
+    return sampler_ != NULL ? &sampler_->counts : NULL;
+}
+
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::sampleAccess(const Key& key) const
+{
+    if((sampler_->tick.fetch_add(1, std::memory_order_relaxed) + 1) % sampler_->period == 0) {
+        std::lock_guard<std::mutex> lock(sampler_->mutex);
+        sampler_->counts[key]++;
+    }
+}
+
+/**
+* Number of nodes a lookup of key visits, hit or miss.
+*/
+template<typename Key, typename Value>
+size_t BinarySearchTree<Key, Value>::probeDepth(const Key& key) const
+{
+    size_t depth = 0;
+    Node<Key, Value>* current = root_;
+    while(current != NULL) {
+        depth++;
+        if(key < current->getKey()) current = current->getLeft();
+        else if(current->getKey() < key) current = current->getRight();
+        else break;
+    }
+    return depth;
+}
+
+/**
+* Expected nodes visited per lookup under the sampled access distribution,
+* or 0 with no samples.
+*/
+template<typename Key, typename Value>
+double BinarySearchTree<Key, Value>::averageProbeDepth() const
+{
+    if(sampler_ == NULL) {
+        return 0;
+    }
+    uint64_t total = 0;
+    double sum = 0;
+    for(typename std::map<Key, uint64_t>::const_iterator it = sampler_->counts.begin();
+        it != sampler_->counts.end(); ++it) {
+        sum += (double)it->second * probeDepth(it->first);
+        total += it->second;
+    }
+    return total > 0 ? sum / total : 0;
+}
+
+/**
+* Turns on scapegoat mode for plain inserts and removes.  alpha, in
+* (0.5, 1), trades lookup depth (lower) against rebuild work (higher).
+* The tree is counted and rebuilt into perfect balance, both O(n), so the
+* depth bound holds from the start.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::enableScapegoat(double alpha)
+{
+    if(balancesItself()) {
+        throw std::logic_error("scapegoat: the tree already balances itself");
+    }
+    if(alpha <= 0.5 || alpha >= 1) {
+        throw std::invalid_argument("scapegoat: alpha must be in (0.5, 1)");
+    }
+    scapegoatAlpha_ = alpha;
+    nodeCount_ = subtreeSize(root_);
+    maxNodeCount_ = nodeCount_;
+    rebalance();
+}
+
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::disableScapegoat()
+{
+    scapegoatAlpha_ = 0;
+}
+
+/**
+* Clones other's nodes with cloneSubtree().
+*/
+template<typename Key, typename Value>
+BinarySearchTree<Key, Value>::BinarySearchTree(const BinarySearchTree& other)
+{
+    root_ = NULL;
+    recorder_ = NULL;
+    sampler_ = NULL;
+    root_ = other.root_ == NULL ? NULL : cloneSubtree(other.root_, NULL);
+    try {
+        copySettings(other);
+    }
+    catch(...) {
+        clear();
+        throw;
+    }
+}
+
+/**
+* Clones the top of other's tree on this thread, splitting it as
+* splitForParallel() would; each subtree below the split is then cloned
+* by a pool task and linked under its copied parent.  The tasks write
+* distinct child pointers, so they share nothing.
+*/
+template<typename Key, typename Value>
+BinarySearchTree<Key, Value>::BinarySearchTree(const BinarySearchTree& other, WorkStealingPool& pool)
+{
+    root_ = NULL;
+    recorder_ = NULL;
+    sampler_ = NULL;
+    std::vector<CloneSlot> slots;
+    try {
+        root_ = cloneTop(other.root_, NULL, parallelSplitDepth(pool.threads()), slots);
+        std::vector<std::function<void()> > tasks;
+        for(size_t i = 0; i < slots.size(); ++i) {
+            CloneSlot slot = slots[i];
+            tasks.push_back([slot] {
+                Node<Key, Value>* copy = cloneSubtree(slot.source, slot.parent);
+                if(slot.left) slot.parent->setLeft(copy);
+                else slot.parent->setRight(copy);
+            });
+        }
+        pool.run(tasks);
+        copySettings(other);
+    }
+    catch(...) {
+        clear();
+        throw;
+    }
+}
+
+template<typename Key, typename Value>
+BinarySearchTree<Key, Value>::BinarySearchTree(BinarySearchTree&& other)
+{
+    root_ = NULL;
+    recorder_ = NULL;
+    sampler_ = NULL;
+    scapegoatAlpha_ = 0;
+    nodeCount_ = 0;
+    maxNodeCount_ = 0;
+    threaded_ = false;
+    swapContents(other);
+}
+
+template<typename Key, typename Value>
+BinarySearchTree<Key, Value>& BinarySearchTree<Key, Value>::operator=(const BinarySearchTree& other)
+{
+    if(this != &other) {
+        BinarySearchTree<Key, Value> copy(other);
+        swapContents(copy);
+    }
+    return *this;
+}
+
+template<typename Key, typename Value>
+BinarySearchTree<Key, Value>& BinarySearchTree<Key, Value>::operator=(BinarySearchTree&& other)
+{
+    if(this != &other) {
+        BinarySearchTree<Key, Value> moved(std::move(other));
+        swapContents(moved);
+    }
+    return *this;
+}
+
+/**
+* Takes other's scapegoat mode, node counts and sampled access counts, and
+* threads the copy if other is threaded (clones start unthreaded).
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::copySettings(const BinarySearchTree& other)
+{
+    scapegoatAlpha_ = other.scapegoatAlpha_;
+    nodeCount_ = other.nodeCount_;
+    maxNodeCount_ = other.maxNodeCount_;
+    threaded_ = other.threaded_;
+    if(threaded_) {
+        threadAll();
+    }
+    if(other.sampler_ != NULL) {
+        sampler_ = new AccessSampler<Key>(*other.sampler_);
+    }
+}
+
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::swapContents(BinarySearchTree& other)
+{
+    std::swap(root_, other.root_);
+    std::swap(recorder_, other.recorder_);
+    std::swap(sampler_, other.sampler_);
+    std::swap(scapegoatAlpha_, other.scapegoatAlpha_);
+    std::swap(nodeCount_, other.nodeCount_);
+    std::swap(maxNodeCount_, other.maxNodeCount_);
+    std::swap(threaded_, other.threaded_);
+}
+
+/**
+* Clones source's subtree under parent and returns its root.  The walk
+* follows source's parent links, with the copy's own links marking which
+* children are done, so it needs no stack and no comparisons.  A failed
+* allocation frees the partial copy.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::cloneSubtree(const Node<Key, Value>* source, Node<Key, Value>* parent)
+{
+    Node<Key, Value>* root = source->clone(parent);
+    const Node<Key, Value>* from = source;
+    Node<Key, Value>* to = root;
+    try {
+        while(true) {
+            if(from->getLeft() != NULL && to->getLeft() == NULL) {
+                to->setLeft(from->getLeft()->clone(to));
+                from = from->getLeft();
+                to = to->getLeft();
+            }
+            else if(from->getRight() != NULL && to->getRight() == NULL) {
+                to->setRight(from->getRight()->clone(to));
+                from = from->getRight();
+                to = to->getRight();
+            }
+            else if(from == source) {
+                break;
+            }
+            else {
+                from = from->getParent();
+                to = to->getParent();
+            }
+        }
+    }
+    catch(...) {
+        destroySubtree(root);
+        throw;
+    }
+    return root;
+}
+
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::destroySubtree(Node<Key, Value>* root)
+{
+    if(root == NULL) {
+        return;
+    }
+    std::queue<Node<Key, Value>*> nodes;
+    nodes.push(root);
+    Node<Key, Value>* current;
+
+    while(!nodes.empty()) {
+        current = nodes.front();
+        if(current->getLeft() != NULL) {
+            nodes.push(current->getLeft());
+        }
+        if(current->getRight() != NULL) {
+            nodes.push(current->getRight());
+        }
+        nodes.pop();
+        delete current;
+    }
+}
+
+/**
+* Clones the nodes splitForParallel() would split on and returns the
+* copy's root; each child subtree it stops at is left unlinked and added
+* to slots for the caller to clone.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::cloneTop(const Node<Key, Value>* source, Node<Key, Value>* parent,
+                                                         unsigned depth, std::vector<CloneSlot>& slots) const
+{
+    if(source == NULL) {
+        return NULL;
+    }
+    if(depth == 0 || sizeHint(source) < ParallelSerialCutoff) {
+        return cloneSubtree(source, parent);
+    }
+    Node<Key, Value>* copy = source->clone(parent);
+    const Node<Key, Value>* children[] = { source->getLeft(), source->getRight() };
+    for(int c = 0; c < 2; ++c) {
+        if(children[c] == NULL) continue;
+        if(depth == 1 || sizeHint(children[c]) < ParallelSerialCutoff) {
+            CloneSlot slot = { children[c], copy, c == 0 };
+            slots.push_back(slot);
+            continue;
+        }
+        Node<Key, Value>* cloned;
+        try {
+            cloned = cloneTop(children[c], copy, depth - 1, slots);
+        }
+        catch(...) {
+            destroySubtree(copy);
+            throw;
+        }
+        if(c == 0) copy->setLeft(cloned);
+        else copy->setRight(cloned);
+    }
+    return copy;
+}
+
+template<typename Key, typename Value>
+size_t BinarySearchTree<Key, Value>::subtreeSize(Node<Key, Value>* root) const
+{
+    size_t size = 0;
+    std::vector<Node<Key, Value>*> stack;
+    if(root != NULL) stack.push_back(root);
+    while(!stack.empty()) {
+        Node<Key, Value>* current = stack.back();
+        stack.pop_back();
+        size++;
+        if(current->getLeft() != NULL) stack.push_back(current->getLeft());
+        if(current->getRight() != NULL) stack.push_back(current->getRight());
+    }
+    return size;
+}
+
+/**
+* A cheap guess at the size of root's subtree, for splitting parallel
+* passes: 2 to the length of its left spine, exact for a perfect tree and
+* close for balanced ones.  A tree that keeps subtree counts can return
+* them instead and get evenly sized tasks.
+*/
+template<typename Key, typename Value>
+size_t BinarySearchTree<Key, Value>::sizeHint(const Node<Key, Value>* root) const
+{
+    size_t size = 1;
+    for(const Node<Key, Value>* n = root; n != NULL && size < ((size_t)1 << 62); n = n->getLeft()) {
+        size *= 2;
+    }
+    return size - 1;
+}
+
+/**
+* Appends node's subtree to pieces in key order as (node, whole) pairs: a
+* whole subtree when it is below ParallelSerialCutoff by sizeHint() or
+* depth splits are used up, else the left subtree's pieces, the node on
+* its own, and the right subtree's pieces.  Each level doubles the tasks,
+* so depth is about log2 of the tasks wanted.  A degenerate tree (a plain
+* BST fed sorted keys) has short left spines and stays one serial task.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::splitForParallel(Node<Key, Value>* node, unsigned depth,
+                                                    std::vector<std::pair<Node<Key, Value>*, bool> >& pieces) const
+{
+    if(node == NULL) {
+        return;
+    }
+    if(depth == 0 || sizeHint(node) < ParallelSerialCutoff) {
+        pieces.push_back(std::make_pair(node, true));
+        return;
+    }
+    splitForParallel(node->getLeft(), depth - 1, pieces);
+    pieces.push_back(std::make_pair(node, false));
+    splitForParallel(node->getRight(), depth - 1, pieces);
+}
+
+// Calls fn on each item of root's subtree in key order; successor() walks
+// it without a stack.
+template<typename Key, typename Value>
+template<typename Fn>
+void BinarySearchTree<Key, Value>::visitSubtree(Node<Key, Value>* root, Fn& fn)
+{
+    Node<Key, Value>* last = root;
+    while(last->getRight() != NULL) last = last->getRight();
+    Node<Key, Value>* n = root;
+    while(n->getLeft() != NULL) n = n->getLeft();
+    while(true) {
+        fn(n->getItem());
+        if(n == last) break;
+        n = successor(n);
+    }
+}
+
+/**
+* Called after a new node lands depth edges below the root.  If that is
+* deeper than log base 1/alpha of the size, some ancestor has a child
+* holding more than alpha of its weight; the lowest such scapegoat is
+* rebuilt.  Sizes are counted walking up, so the cost is linear in the
+* scapegoat's subtree and amortizes to O(log n) per insert.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::scapegoatInsert(Node<Key, Value>* node, size_t depth)
+{
+    nodeCount_++;
+    if(nodeCount_ > maxNodeCount_) maxNodeCount_ = nodeCount_;
+    if(depth <= std::log((double)nodeCount_) / -std::log(scapegoatAlpha_)) {
+        return;
+    }
+
+    BST_PROFILE_PHASE(BST_PHASE_REBALANCE);
+    size_t size = 1;
+    while(node->getParent() != NULL) {
+        Node<Key, Value>* parent = node->getParent();
+        Node<Key, Value>* sibling = parent->getLeft() == node ? parent->getRight() : parent->getLeft();
+        size_t parentSize = size + 1 + subtreeSize(sibling);
+        if(size > scapegoatAlpha_ * parentSize) {
+            rebuildSubtree(parent, parentSize);
+            return;
+        }
+        node = parent;
+        size = parentSize;
+    }
+}
+
+/**
+* Relinks the size nodes under root into a perfectly balanced subtree in
+* the same place.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::rebuildSubtree(Node<Key, Value>* root, size_t size)
+{
+    Node<Key, Value>* parent = root->getParent();
+    Node<Key, Value>* first = root;
+    while(first->getLeft() != NULL) first = first->getLeft();
+
+    std::vector<Node<Key, Value>*> nodes;
+    nodes.reserve(size);
+    for(Node<Key, Value>* n = first; nodes.size() < size; n = successor(n)) {
+        nodes.push_back(n);
+    }
+
+    Node<Key, Value>* rebuilt = linkPerfect(nodes, 0, size, parent);
+    if(parent == NULL) root_ = rebuilt;
+    else if(parent->getLeft() == root) parent->setLeft(rebuilt);
+    else parent->setRight(rebuilt);
+}
+
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::linkPerfect(std::vector<Node<Key, Value>*>& nodes,
+                                                            size_t lo, size_t hi, Node<Key, Value>* parent)
+{
+    if(lo >= hi) {
+        return NULL;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    Node<Key, Value>* root = nodes[mid];
+    root->setParent(parent);
+    root->setLeft(linkPerfect(nodes, lo, mid, root));
+    root->setRight(linkPerfect(nodes, mid + 1, hi, root));
+    return root;
+}
+
+/**
+* Day-Stout-Warren: right rotations straighten the tree into a sorted vine
+* hanging off root_'s right links, then rounds of left rotations along the
+* vine fold it into a tree whose levels are all full except the last.
+* O(n) time and O(1) extra space, so it suits trees too big to flatten
+* into a side array.  Self-balancing trees keep balance data in their
+* nodes that this does not update, so they are refused.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::rebalance()
+{
+    BST_PROFILE_PHASE(BST_PHASE_REBALANCE);
+    if(balancesItself()) {
+        throw std::logic_error("rebalance: the tree already balances itself");
+    }
+
+    // tree to vine
+    size_t n = 0;
+    Node<Key, Value>* tail = NULL;
+    Node<Key, Value>* rest = root_;
+    while(rest != NULL) {
+        Node<Key, Value>* left = rest->getLeft();
+        if(left == NULL) {
+            tail = rest;
+            rest = rest->getRight();
+            n++;
+            continue;
+        }
+        // rotate right: left takes rest's place on the vine
+        rest->setLeft(left->getRight());
+        if(left->getRight() != NULL) left->getRight()->setParent(rest);
+        left->setRight(rest);
+        rest->setParent(left);
+        left->setParent(tail);
+        if(tail == NULL) root_ = left;
+        else tail->setRight(left);
+        rest = left;
+    }
+
+    // vine to tree: first fold off the partial bottom level, then halve
+    size_t full = 0;
+    while(full * 2 + 1 <= n) full = full * 2 + 1;
+    compressVine(n - full);
+    for(size_t m = full / 2; m > 0; m /= 2) {
+        compressVine(m);
+    }
+
+    if(scapegoatAlpha_ > 0) maxNodeCount_ = nodeCount_;
+}
+
+/**
+* Left-rotates every other node down the right spine, count times.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::compressVine(size_t count)
+{
+    Node<Key, Value>* above = NULL;
+    Node<Key, Value>* scanner = root_;
+    for(size_t i = 0; i < count; ++i) {
+        Node<Key, Value>* child = scanner->getRight();
+        scanner->setRight(child->getLeft());
+        if(child->getLeft() != NULL) child->getLeft()->setParent(scanner);
+        child->setLeft(scanner);
+        scanner->setParent(child);
+        child->setParent(above);
+        if(above == NULL) root_ = child;
+        else above->setRight(child);
+        above = child;
+        scanner = child->getRight();
+    }
+}
+
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::print() const
 {
@@ -412,6 +1286,7 @@ template<class Key, class Value>
 typename BinarySearchTree<Key, Value>::iterator
 BinarySearchTree<Key, Value>::begin() const
 {
+    if(recorder_ != NULL) recorder_->recordScan();
     BinarySearchTree<Key, Value>::iterator begin(getSmallestNode());
     return begin;
 }
@@ -435,11 +1310,170 @@ template<class Key, class Value>
 typename BinarySearchTree<Key, Value>::iterator
 BinarySearchTree<Key, Value>::find(const Key & k) const
 {
+    if(recorder_ != NULL) recorder_->record(TRACE_FIND, k);
     Node<Key, Value> *curr = internalFind(k);
     BinarySearchTree<Key, Value>::iterator it(curr);
     return it;
 }
 
+/**
+* Looks up keys[0, n) and stores each result in out, exactly as n calls to
+* find() would.  A lookup in a tree much larger than the cache misses on
+* nearly every level, and each miss waits on the one before.  So instead
+* of finishing one descent before starting the next, up to BatchLanes
+* descents advance in round robin (asynchronous memory access chaining):
+* each takes one step, prefetches the child it moves to and yields to the
+* next lane, so by the time a lane comes round again its node is in
+* flight or in cache.  A lane that finishes starts the next key.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::find_batch(const Key* keys, size_t n, iterator* out) const
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    const size_t BatchLanes = 16;
+    size_t index[BatchLanes];
+    Node<Key, Value>* current[BatchLanes];
+
+    size_t next = 0, active = 0;
+    while(active < BatchLanes && next < n) {
+        if(recorder_ != NULL) recorder_->record(TRACE_FIND, keys[next]);
+        if(sampler_ != NULL) sampleAccess(keys[next]);
+        index[active] = next++;
+        current[active++] = root_;
+    }
+
+    while(active > 0) {
+        for(size_t lane = 0; lane < active; ) {
+            Node<Key, Value>* node = current[lane];
+            const Key& key = keys[index[lane]];
+            if(node != NULL && !(key == node->getKey())) {
+                node = key < node->getKey() ? node->getLeft() : node->getRight();
+                BST_PREFETCH(node);
+                current[lane++] = node;
+                continue;
+            }
+
+            // found or fell off the tree: retire the lane and refill it
+            out[index[lane]] = iterator(node);
+            if(next < n) {
+                if(recorder_ != NULL) recorder_->record(TRACE_FIND, keys[next]);
+                if(sampler_ != NULL) sampleAccess(keys[next]);
+                index[lane] = next++;
+                current[lane] = root_;
+            }
+            else {
+                active--;
+                index[lane] = index[active];
+                current[lane] = current[active];
+            }
+        }
+    }
+}
+
+/**
+* Looks up every key of the sorted range [first, last) in a single walk.
+* Each node splits the range that reaches it by binary search: the keys
+* below it go left, the keys above it go right, and keys equal to it are
+* hits.  A path prefix shared by many keys is walked once, so m probes
+* cost O(m log(n/m)) rather than m log n.  Duplicate keys hit once each.
+* Nothing is allocated; the recursion is as deep as the tree's left
+* spines along the walk.
+*/
+template<class Key, class Value>
+template<typename RandomIt, typename Callback>
+void BinarySearchTree<Key, Value>::find_sorted(RandomIt first, RandomIt last, Callback callback) const
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    if(recorder_ != NULL || sampler_ != NULL) {
+        for(RandomIt it = first; it != last; ++it) {
+            if(recorder_ != NULL) recorder_->record(TRACE_FIND, *it);
+            if(sampler_ != NULL) sampleAccess(*it);
+        }
+    }
+    findSortedBelow(root_, first, last, callback);
+}
+
+template<class Key, class Value>
+template<typename RandomIt, typename Callback>
+void BinarySearchTree<Key, Value>::findSortedBelow(Node<Key, Value>* node, RandomIt first, RandomIt last,
+                                                   Callback& callback) const
+{
+    // the right subtree is a loop, not a call, so right-leaning paths take no stack
+    while(node != NULL && first != last) {
+        const Key& key = node->getKey();
+        RandomIt split = std::lower_bound(first, last, key);
+        findSortedBelow(node->getLeft(), first, split, callback);
+        while(split != last && !(key < *split)) {
+            callback(node->getItem());
+            ++split;
+        }
+        node = node->getRight();
+        first = split;
+    }
+}
+
+/**
+* Splits the tree into in-order pieces, visits the whole subtrees among
+* them as pool tasks and the single nodes between them on this thread.
+*/
+template<class Key, class Value>
+template<typename Fn>
+void BinarySearchTree<Key, Value>::parallel_for_each(Fn fn, WorkStealingPool& pool) const
+{
+    std::vector<std::pair<Node<Key, Value>*, bool> > pieces;
+    splitForParallel(root_, parallelSplitDepth(pool.threads()), pieces);
+    std::vector<std::function<void()> > tasks;
+    for(size_t i = 0; i < pieces.size(); ++i) {
+        if(pieces[i].second) {
+            Node<Key, Value>* subtree = pieces[i].first;
+            tasks.push_back([subtree, &fn] { visitSubtree(subtree, fn); });
+        }
+        else {
+            fn(pieces[i].first->getItem());
+        }
+    }
+    pool.run(tasks);
+}
+
+/**
+* As parallel_for_each(), but each whole-subtree piece folds its items
+* into its own result, starting from identity, and the pieces' results
+* are then combined left to right with the single nodes between them.
+* Running results are moved into combine, so one taking its left side by
+* value can append to it, e.g. to collect items into a vector.
+*/
+template<class Key, class Value>
+template<typename T, typename Map, typename Combine>
+T BinarySearchTree<Key, Value>::parallel_reduce(T identity, Map map, Combine combine, WorkStealingPool& pool) const
+{
+    std::vector<std::pair<Node<Key, Value>*, bool> > pieces;
+    splitForParallel(root_, parallelSplitDepth(pool.threads()), pieces);
+
+    // a deque, not a vector: vector<bool> packs its elements, so writing
+    // two of them from different threads would race
+    std::deque<T> results(pieces.size(), identity);
+    std::vector<std::function<void()> > tasks;
+    for(size_t i = 0; i < pieces.size(); ++i) {
+        if(!pieces[i].second) continue;
+        T* result = &results[i];
+        Node<Key, Value>* subtree = pieces[i].first;
+        tasks.push_back([result, subtree, &map, &combine] {
+            auto fold = [result, &map, &combine](const std::pair<const Key, Value>& item) {
+                *result = combine(std::move(*result), map(item));
+            };
+            visitSubtree(subtree, fold);
+        });
+    }
+    pool.run(tasks);
+
+    T total = identity;
+    for(size_t i = 0; i < pieces.size(); ++i) {
+        if(pieces[i].second) total = combine(std::move(total), std::move(results[i]));
+        else total = combine(std::move(total), map(pieces[i].first->getItem()));
+    }
+    return total;
+}
+
 /**
  * @precondition The key exists in the map
  * Returns the value associated with the key
@@ -447,6 +1481,7 @@ BinarySearchTree<Key, Value>::find(const Key & k) const
 template<class Key, class Value>
 Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
 {
+    if(recorder_ != NULL) recorder_->record(TRACE_INDEX, key);
     Node<Key, Value> *curr = internalFind(key);
     if(curr == NULL) throw std::out_of_range("Invalid key");
     return curr->getValue();
@@ -454,6 +1489,7 @@ Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
 template<class Key, class Value>
 Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
 {
+    if(recorder_ != NULL) recorder_->record(TRACE_INDEX, key);
     Node<Key, Value> *curr = internalFind(key);
     if(curr == NULL) throw std::out_of_range("Invalid key");
     return curr->getValue();
@@ -468,6 +1504,8 @@ Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
 template<class Key, class Value>
 void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &keyValuePair)
 {
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    if(recorder_ != NULL) recorder_->record(TRACE_INSERT, keyValuePair.first);
     Key key = keyValuePair.first;
     Value value = keyValuePair.second;
 
@@ -478,15 +1516,20 @@ void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &key
 
     // if key is not already in tree, insert new node
     else {
+        Node<Key, Value>* node = NULL;
+        size_t depth = 0;
+
         // called on empty tree
         if(empty()) {
-            root_ = new Node<Key, Value>(key, value, nullptr);
+            BST_PROFILE_PHASE(BST_PHASE_ALLOCATION);
+            root_ = node = new Node<Key, Value>(key, value, nullptr);
         }
 
         // if not empty, traverse through tree
         else {
             Node<Key, Value>* current = root_;
             while(current != NULL) {
+                depth++;
                 // check if current node's key equals desired key
                 Key current_key = current->getKey();
 
@@ -495,7 +1538,8 @@ void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &key
                         current = current->getLeft();
                     }
                     else { // insert new node on left
-                        Node<Key, Value>* node = new Node<Key, Value>(key, value, current);
+                        BST_PROFILE_PHASE(BST_PHASE_ALLOCATION);
+                        node = new Node<Key, Value>(key, value, current);
                         current->setLeft(node);
                         break;
                     }
@@ -506,13 +1550,18 @@ void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &key
                         current = current->getRight();
                     }
                     else { // insert new node on right
-                        Node<Key, Value>* node = new Node<Key, Value>(key, value, current);
+                        BST_PROFILE_PHASE(BST_PHASE_ALLOCATION);
+                        node = new Node<Key, Value>(key, value, current);
                         current->setRight(node);
                         break;
                     }
                 }
             }
         }
+
+        if(scapegoatAlpha_ > 0) {
+            scapegoatInsert(node, depth);
+        }
     }
 }
 
@@ -525,49 +1574,117 @@ void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &key
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::remove(const Key& key)
 {
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    if(recorder_ != NULL) recorder_->record(TRACE_REMOVE, key);
     Node<Key, Value>* removal_node = internalFind(key);
 
     // function will only remove if node exists in tree
     if(removal_node != NULL) {
-        int n_children = numChildren(removal_node);
-
-        // if removal_node has 0 children, simply remove
-        if(n_children == 0) {
-            // special case: removal_node is root_
-            if(removal_node == root_) {
-              delete removal_node;
-              root_ = NULL;
-            }
-            else remove_0(removal_node);
-        }
+        unlink(removal_node);
+        BST_PROFILE_PHASE(BST_PHASE_ALLOCATION);
+        delete removal_node;
+    }
+}
 
-        // if removal_node has 1 child, promote child
-        else if(n_children == 1) {
-            remove_1(removal_node);
+template<typename Key, typename Value>
+typename BinarySearchTree<Key, Value>::node_type BinarySearchTree<Key, Value>::extract(const Key& key)
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    if(balancesItself()) {
+        throw std::logic_error("extract: a self-balancing tree hands out its own node handles");
+    }
+    if(recorder_ != NULL) recorder_->record(TRACE_REMOVE, key);
+    Node<Key, Value>* node = internalFind(key);
+    if(node != NULL) {
+        unlink(node);
+    }
+    return node_type(node);
+}
+
+template<typename Key, typename Value>
+typename BinarySearchTree<Key, Value>::iterator BinarySearchTree<Key, Value>::insert(node_type&& handle)
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    Node<Key, Value>* node = handle.node_;
+    if(node == NULL) {
+        return end();
+    }
+    if(balancesItself()) {
+        throw std::logic_error("insert: a self-balancing tree only takes its own node handles");
+    }
+    if(recorder_ != NULL) recorder_->record(TRACE_INSERT, node->getKey());
+
+    Node<Key, Value>* parent = NULL;
+    size_t depth = 0;
+    for(Node<Key, Value>* current = root_; current != NULL; depth++) {
+        parent = current;
+        if(node->getKey() < current->getKey()) current = current->getLeft();
+        else if(current->getKey() < node->getKey()) current = current->getRight();
+        else return iterator(current);
+    }
+
+    handle.node_ = NULL;
+    node->setParent(parent);
+    if(parent == NULL) root_ = node;
+    else if(node->getKey() < parent->getKey()) parent->setLeft(node);
+    else parent->setRight(node);
+    if(scapegoatAlpha_ > 0) {
+        scapegoatInsert(node, depth);
+    }
+    return iterator(node);
+}
+
+/**
+* Takes removal_node out of the tree without freeing it, leaving it with
+* no links.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::unlink(Node<Key, Value>* removal_node)
+{
+    int n_children = numChildren(removal_node);
+
+    // if removal_node has 0 children, simply remove
+    if(n_children == 0) {
+        // special case: removal_node is root_
+        if(removal_node == root_) {
+            root_ = NULL;
         }
+        else remove_0(removal_node);
+    }
 
-        // if removal_node has 2 children, swap with predecessor
-        else {
-            Node<Key, Value>* pred = BinarySearchTree<Key, Value>::predecessor(removal_node);
-            nodeSwap(removal_node, pred);
-            
-            if(pred->getParent() == NULL) {
-              root_ = pred;
-            }
+    // if removal_node has 1 child, promote child
+    else if(n_children == 1) {
+        remove_1(removal_node);
+    }
 
-            // remove node at new location based on numChildren
-            if(numChildren(removal_node) == 0) {
-                remove_0(removal_node);
-            }
-            else { // numChildren(removal_node) == 1
-                remove_1(removal_node);
-            }
+    // if removal_node has 2 children, swap with predecessor
+    else {
+        Node<Key, Value>* pred = BinarySearchTree<Key, Value>::predecessor(removal_node);
+        nodeSwap(removal_node, pred);
+
+        if(pred->getParent() == NULL) {
+          root_ = pred;
+        }
+
+        // remove node at new location based on numChildren
+        if(numChildren(removal_node) == 0) {
+            remove_0(removal_node);
         }
-        
+        else { // numChildren(removal_node) == 1
+            remove_1(removal_node);
+        }
+    }
+    removal_node->setParent(NULL);
+    removal_node->setLeft(NULL);
+    removal_node->setRight(NULL);
+
+    // a tree down to alpha of its peak size is rebuilt whole
+    if(scapegoatAlpha_ > 0 && --nodeCount_ < scapegoatAlpha_ * maxNodeCount_) {
+        rebalance();
     }
 }
 
-// helper function for remove() for 0-child case
+// helper function for unlink() for 0-child case
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::remove_0(Node<Key, Value>* node) {
     // determine if node was left or right child and update parent
@@ -575,10 +1692,9 @@ void BinarySearchTree<Key, Value>::remove_0(Node<Key, Value>* node) {
         node->getParent()->setLeft(NULL);
     }
     else node->getParent()->setRight(NULL);
-    delete node;
 }
 
-// helper function for remove() for 1-child case
+// helper function for unlink() for 1-child case
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::remove_1(Node<Key, Value>* node) {
     // get child to swap with current node
@@ -607,8 +1723,6 @@ void BinarySearchTree<Key, Value>::remove_1(Node<Key, Value>* node) {
             child->getParent()->setRight(child);
         }
     }
-
-    delete node;
 }
 
 
@@ -618,6 +1732,11 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
 {
     Node<Key, Value>* temp = current;
 
+    // a thread names it outright
+    if(temp->hasLeftThread()) {
+        return temp->getLeftThread();
+    }
+
     // if left child exists, predecessor is rightmost node
     if(temp->getLeft() != NULL) {
         temp = temp->getLeft();
@@ -629,6 +1748,11 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
     // else, predecessor is parent of first ancestor right child
     else {
         while(temp != NULL) {
+            // no predecessor if got to root without finding right child
+            if(temp->getParent() == NULL) {
+                temp = NULL;
+                break;
+            }
             if(temp == temp->getParent()->getRight()) {
                 temp = temp->getParent();
                 break;
@@ -645,7 +1769,12 @@ template<class Key, class Value>
 Node<Key, Value>* BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current)
 {
     Node<Key, Value>* temp = current;
-    
+
+    // a thread names it outright
+    if(temp->hasRightThread()) {
+        return temp->getRightThread();
+    }
+
     // if right child exists, successor is leftmost node
     if(temp->getRight() != NULL) {
         temp = temp->getRight();
@@ -673,31 +1802,57 @@ Node<Key, Value>* BinarySearchTree<Key, Value>::successor(Node<Key, Value>* curr
 }
 
 /**
-* A method to remove all contents of the tree and
-* reset the values in the tree for use again.
+* Sets a thread in every missing child link, in one in-order walk.  The
+* walk climbs parents rather than trust links it is rewriting.
 */
 template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clear()
+void BinarySearchTree<Key, Value>::threadAll()
 {
-    if(!empty()) {
-        std::queue<Node<Key, Value>*> nodes;
-        nodes.push(root_);
-        Node<Key, Value>* current;
-
-        while(!nodes.empty()) {
-            current = nodes.front();
-            if(current->getLeft() != NULL) {
-                nodes.push(current->getLeft());
-            }
-            if(current->getRight() != NULL) {
-                nodes.push(current->getRight());
+    Node<Key, Value>* prev = NULL;
+    Node<Key, Value>* current = getSmallestNode();
+    while(current != NULL) {
+        if(current->getLeft() == NULL) current->setLeftThread(prev);
+        prev = current;
+        if(current->getRight() != NULL) {
+            current = current->getRight();
+            while(current->getLeft() != NULL) current = current->getLeft();
+        }
+        else {
+            while(current->getParent() != NULL && current == current->getParent()->getRight()) {
+                current = current->getParent();
             }
-            nodes.pop();
-            delete current;
+            current = current->getParent();
+            prev->setRightThread(current);
         }
     }
+}
 
+/**
+* Clears every thread back to a NULL link.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::unthreadAll()
+{
+    Node<Key, Value>* current = getSmallestNode();
+    while(current != NULL) {
+        Node<Key, Value>* next = successor(current);
+        if(current->hasLeftThread()) current->setLeft(NULL);
+        if(current->hasRightThread()) current->setRight(NULL);
+        current = next;
+    }
+}
+
+/**
+* A method to remove all contents of the tree and
+* reset the values in the tree for use again.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::clear()
+{
+    releaseNodes(root_);
     root_ = NULL;
+    nodeCount_ = 0;
+    maxNodeCount_ = 0;
 }
 
 
@@ -710,6 +1865,9 @@ BinarySearchTree<Key, Value>::getSmallestNode() const
 {
     // smallest node = leftmost node in tree
     Node<Key, Value>* current = root_;
+    if(current == NULL) {
+        return NULL;
+    }
 
     while(current->getLeft() != NULL) {
         current = current->getLeft();
@@ -726,6 +1884,9 @@ BinarySearchTree<Key, Value>::getSmallestNode() const
 template<typename Key, typename Value>
 Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) const
 {
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    if(sampler_ != NULL) sampleAccess(key);
+
     // if empty tree, return NULL
     if(empty()) {
         return NULL;
@@ -844,6 +2005,7 @@ int BinarySearchTree<Key, Value>::right_height(Node<Key, Value>* current) const
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
 {
+    BST_PROFILE_PHASE(BST_PHASE_REBALANCE);
     if((n1 == n2) || (n1 == NULL) || (n2 == NULL) ) {
         return;
     }
@@ -0,0 +1,267 @@
+#ifndef BST_PROFILE_H
+#define BST_PROFILE_H
+
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Hardware-counter profiling for the search trees.  Only compiled in when
+// BST_PROFILE is defined (see the bench-profile make target); the trees mark
+// their phases with BST_PROFILE_PHASE() and the profiler charges counter
+// deltas to whichever phase is active.
+
+/**
+* The hardware events recorded per phase.
+*/
+enum BstCounter
+{
+    BST_COUNTER_INSTRUCTIONS,
+    BST_COUNTER_L1D_MISSES,
+    BST_COUNTER_LLC_MISSES,
+    BST_COUNTER_DTLB_MISSES,
+    BST_COUNTER_BRANCH_MISSES,
+    BST_NUM_COUNTERS
+};
+
+/**
+* Phases of a tree operation.  OTHER is everything outside the trees
+* (including all of std::map, which has no hooks).
+*/
+enum BstPhase
+{
+    BST_PHASE_OTHER,
+    BST_PHASE_DESCENT,
+    BST_PHASE_REBALANCE,
+    BST_PHASE_ALLOCATION,
+    BST_NUM_PHASES
+};
+
+inline const char* bstCounterName(int counter)
+{
+    static const char* names[BST_NUM_COUNTERS] = {
+        "instructions", "l1d_misses", "llc_misses", "dtlb_misses", "branch_misses"
+    };
+    return names[counter];
+}
+
+inline const char* bstPhaseName(int phase)
+{
+    static const char* names[BST_NUM_PHASES] = {
+        "other", "descent", "rebalance", "allocation"
+    };
+    return names[phase];
+}
+
+/**
+* A group of user-space perf counters for this thread.  Counters the
+* kernel or the hardware refuses (common in containers and VMs) are simply
+* marked unavailable; if none open, read() reports zeros.
+*/
+class PerfCounters
+{
+public:
+    PerfCounters();
+    ~PerfCounters();
+
+    // true iff the given counter is being recorded
+    bool available(int counter) const { return slot_[counter] >= 0; }
+    bool anyAvailable() const { return leader_ >= 0; }
+
+    // reads the current raw values of all counters into values
+    void read(uint64_t values[BST_NUM_COUNTERS]) const;
+
+private:
+    PerfCounters(const PerfCounters&);
+    PerfCounters& operator=(const PerfCounters&);
+
+    int open(uint32_t type, uint64_t config, int groupFd);
+
+    int fds_[BST_NUM_COUNTERS];
+    int slot_[BST_NUM_COUNTERS];   // position in the group read, or -1
+    int numOpen_;
+    int leader_;
+};
+
+inline PerfCounters::PerfCounters() : numOpen_(0), leader_(-1)
+{
+    const uint64_t readMiss = ((uint64_t)PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              ((uint64_t)PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    uint32_t types[BST_NUM_COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+    };
+    uint64_t configs[BST_NUM_COUNTERS] = {
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_L1D | readMiss,
+        PERF_COUNT_HW_CACHE_LL | readMiss,
+        PERF_COUNT_HW_CACHE_DTLB | readMiss,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+
+    for(int i = 0; i < BST_NUM_COUNTERS; ++i) {
+        fds_[i] = open(types[i], configs[i], leader_);
+        slot_[i] = -1;
+        if(fds_[i] >= 0) {
+            if(leader_ < 0) leader_ = fds_[i];
+            slot_[i] = numOpen_++;
+        }
+    }
+
+    if(leader_ >= 0) {
+        ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+inline PerfCounters::~PerfCounters()
+{
+    for(int i = BST_NUM_COUNTERS - 1; i >= 0; --i) {
+        if(fds_[i] >= 0) close(fds_[i]);
+    }
+}
+
+inline int PerfCounters::open(uint32_t type, uint64_t config, int groupFd)
+{
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = groupFd < 0 ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+inline void PerfCounters::read(uint64_t values[BST_NUM_COUNTERS]) const
+{
+    // group read layout: { nr, value[nr] }
+    uint64_t buf[1 + BST_NUM_COUNTERS];
+    std::memset(values, 0, sizeof(uint64_t) * BST_NUM_COUNTERS);
+    if(leader_ < 0) {
+        return;
+    }
+    ssize_t n = ::read(leader_, buf, sizeof(uint64_t) * (1 + numOpen_));
+    if(n < (ssize_t)sizeof(uint64_t)) {
+        return;
+    }
+    for(int i = 0; i < BST_NUM_COUNTERS; ++i) {
+        if(slot_[i] >= 0 && (uint64_t)slot_[i] < buf[0]) {
+            values[i] = buf[1 + slot_[i]];
+        }
+    }
+}
+
+/**
+* Accumulates counter deltas per (operation, phase).  Operations are small
+* integers chosen by the caller (the benchmark uses find/insert/remove).
+* Reading the counters costs a system call, so wall-clock timings taken in
+* profiling mode are not comparable with normal runs.
+*/
+class BstProfiler
+{
+public:
+    static const int MAX_OPERATIONS = 4;
+
+    static BstProfiler& instance()
+    {
+        static BstProfiler profiler;
+        return profiler;
+    }
+
+    const PerfCounters& counters() const { return counters_; }
+
+    // clears all totals and starts charging to (operation 0, OTHER)
+    void reset();
+
+    // charges everything up to now to the current operation and switches to op
+    void setOperation(int op);
+
+    // charges everything up to now to the current phase
+    void flush() { charge(); }
+
+    void enter(BstPhase phase);
+    void leave();
+
+    uint64_t total(int op, int phase, int counter) const { return totals_[op][phase][counter]; }
+    uint64_t operationCount(int op) const { return opCounts_[op]; }
+
+private:
+    BstProfiler() : op_(0) { reset(); }
+
+    void charge();
+
+    PerfCounters counters_;
+    uint64_t last_[BST_NUM_COUNTERS];
+    uint64_t totals_[MAX_OPERATIONS][BST_NUM_PHASES][BST_NUM_COUNTERS];
+    uint64_t opCounts_[MAX_OPERATIONS];
+    std::vector<BstPhase> phases_;
+    int op_;
+};
+
+inline void BstProfiler::reset()
+{
+    std::memset(totals_, 0, sizeof(totals_));
+    std::memset(opCounts_, 0, sizeof(opCounts_));
+    phases_.clear();
+    phases_.push_back(BST_PHASE_OTHER);
+    op_ = 0;
+    counters_.read(last_);
+}
+
+inline void BstProfiler::charge()
+{
+    uint64_t now[BST_NUM_COUNTERS];
+    counters_.read(now);
+    for(int i = 0; i < BST_NUM_COUNTERS; ++i) {
+        totals_[op_][phases_.back()][i] += now[i] - last_[i];
+        last_[i] = now[i];
+    }
+}
+
+inline void BstProfiler::setOperation(int op)
+{
+    charge();
+    op_ = op;
+    opCounts_[op]++;
+}
+
+inline void BstProfiler::enter(BstPhase phase)
+{
+    // nested scopes of the same phase (e.g. recursive fix-ups) need no read
+    if(phase != phases_.back()) {
+        charge();
+    }
+    phases_.push_back(phase);
+}
+
+inline void BstProfiler::leave()
+{
+    BstPhase phase = phases_.back();
+    if(phases_.size() > 1 && phases_[phases_.size() - 2] != phase) {
+        charge();
+    }
+    phases_.pop_back();
+}
+
+/**
+* RAII guard that makes a phase active for the enclosing scope.
+*/
+class BstPhaseScope
+{
+public:
+    explicit BstPhaseScope(BstPhase phase) { BstProfiler::instance().enter(phase); }
+    ~BstPhaseScope() { BstProfiler::instance().leave(); }
+};
+
+#define BST_PROFILE_CONCAT_(a, b) a##b
+#define BST_PROFILE_CONCAT(a, b) BST_PROFILE_CONCAT_(a, b)
+#define BST_PROFILE_PHASE(phase) BstPhaseScope BST_PROFILE_CONCAT(bstPhaseScope_, __LINE__)(phase)
+
+#endif
@@ -0,0 +1,527 @@
+#ifndef BUFFERED_AVL_H
+#define BUFFERED_AVL_H
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include "avlbst.h"
+
+// A map that puts a write buffer in front of an AVLTree, in the manner of
+// a log-structured merge tree, so bursts of writes do not pay for a
+// rebalance each.  Writes append to an unsorted run; every runEntries
+// writes the run is sorted and sealed, and sealed runs of similar size are
+// merged pairwise (like a binary counter), so about log2(bufferEntries /
+// runEntries) runs are live at once.  A remove is a write of a tombstone.
+//
+// Reads look in the newest data first: the unsealed run, scanned from its
+// end, then the sealed runs by binary search, then the tree.  The first
+// entry for the key decides, and a tombstone means absent.  probes()
+// counts the places looked at, the read amplification buffering costs.
+//
+// Once the sealed runs hold bufferEntries entries (rewrites of a key
+// within a run count once), they are merged into the tree as a single
+// AVLTree::apply_batch().  With backgroundMerge that happens on a merge
+// thread while writes fill a fresh buffer, and a writer only waits if the
+// buffer fills again before the merge is done.  Reads that reach the tree
+// wait while the merge holds it.  flush() merges everything on demand.
+//
+// Iteration merges the runs and the tree in key order, newest entry
+// first; it waits for a background merge to finish and seals the open
+// run first.  Items are copied out, as in PagedTree, and any write
+// invalidates iterators.
+//
+// Like AVLTree, the map is not thread-safe: calls must be serialized by
+// the caller.  Only the merging runs in the background.
+
+struct BufferedOptions
+{
+    BufferedOptions() : bufferEntries(1 << 16), runEntries(256), backgroundMerge(true) { }
+
+    size_t bufferEntries;     // merge into the tree once the runs hold this many entries
+    size_t runEntries;        // writes per sorted run
+    bool backgroundMerge;     // merge on a background thread, or inline when full
+};
+
+template <class Key, class Value>
+class BufferedAVLTree
+{
+public:
+    explicit BufferedAVLTree(const BufferedOptions& options = BufferedOptions());
+    ~BufferedAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+
+    // on a hit, copies the value out and returns true
+    bool find(const Key& key, Value& value) const;
+    Value operator[](const Key& key) const;
+
+    // merges every buffered write into the tree
+    void flush();
+
+    // entries buffered and not yet merged into the tree
+    size_t buffered() const { return active_.size() + runsSize_; }
+    // lookups so far and the runs and trees they looked in
+    uint64_t reads() const { return reads_; }
+    uint64_t probes() const { return probes_; }
+
+protected:
+    struct Entry
+    {
+        Key key;
+        Value value;
+        bool tombstone;
+    };
+    typedef std::vector<Entry> Run;
+
+    static bool entryLess(const Entry& a, const Entry& b) { return a.key < b.key; }
+    static void mergeRuns(const Run& older, const Run& newer, Run& out);
+    static const Entry* findInRun(const Run& run, const Key& key);
+
+    void append(const Key& key, const Value& value, bool tombstone);
+    void sealActive();
+    void startMerge();
+    void mergeFrozen();
+    void waitForMerge();
+    void mergerLoop();
+
+public:
+    /**
+    * Walks the tree and the sealed runs in step; at each key the newest
+    * source wins and tombstones are skipped.
+    */
+    class iterator
+    {
+    public:
+        iterator();
+
+        const std::pair<Key, Value>& operator*() const;
+        const std::pair<Key, Value>* operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+
+    protected:
+        friend class BufferedAVLTree<Key, Value>;
+        explicit iterator(const BufferedAVLTree<Key, Value>* map);
+        void settle();
+
+        const BufferedAVLTree<Key, Value>* map_;    // NULL at the end
+        typename AVLTree<Key, Value>::iterator tree_;
+        std::vector<size_t> positions_;             // one per sealed run
+        std::pair<Key, Value> item_;
+    };
+
+    iterator begin();
+    iterator end() const;
+
+protected:
+    AVLTree<Key, Value> tree_;
+    BufferedOptions options_;
+
+    Run active_;                // unsorted, newest last
+    std::vector<Run> runs_;     // sorted, one entry per key, oldest first
+    size_t runsSize_;
+
+    mutable std::mutex mutex_;  // guards tree_, frozen_ and merging_
+    std::condition_variable mergeCv_;
+    std::vector<Run> frozen_;   // full buffer being merged into the tree
+    bool merging_;
+    bool stop_;
+    std::thread merger_;
+
+    mutable uint64_t reads_;
+    mutable uint64_t probes_;
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the BufferedAVLTree class.
+  -----------------------------------------------
+*/
+
+template<class Key, class Value>
+BufferedAVLTree<Key, Value>::BufferedAVLTree(const BufferedOptions& options) :
+    options_(options), runsSize_(0), merging_(false), stop_(false), reads_(0), probes_(0)
+{
+    if(options_.runEntries == 0 || options_.bufferEntries < options_.runEntries) {
+        throw std::invalid_argument("buffered tree: need 0 < runEntries <= bufferEntries");
+    }
+    active_.reserve(options_.runEntries);
+    if(options_.backgroundMerge) {
+        merger_ = std::thread(&BufferedAVLTree<Key, Value>::mergerLoop, this);
+    }
+}
+
+/**
+* Lets a running merge finish and stops the merge thread.  Writes still
+* buffered are dropped with the rest of the map.
+*/
+template<class Key, class Value>
+BufferedAVLTree<Key, Value>::~BufferedAVLTree()
+{
+    if(merger_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        mergeCv_.notify_all();
+        merger_.join();
+    }
+}
+
+template<class Key, class Value>
+void BufferedAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    append(keyValuePair.first, keyValuePair.second, false);
+}
+
+template<class Key, class Value>
+void BufferedAVLTree<Key, Value>::remove(const Key& key)
+{
+    append(key, Value(), true);
+}
+
+template<class Key, class Value>
+void BufferedAVLTree<Key, Value>::append(const Key& key, const Value& value, bool tombstone)
+{
+    Entry entry = { key, value, tombstone };
+    active_.push_back(entry);
+    if(active_.size() >= options_.runEntries) {
+        sealActive();
+    }
+    if(runsSize_ >= options_.bufferEntries) {
+        startMerge();
+    }
+}
+
+/**
+* Sorts the open run, keeping the newest entry per key, and merges it
+* into the sealed runs while the run before it is no larger.
+*/
+template<class Key, class Value>
+void BufferedAVLTree<Key, Value>::sealActive()
+{
+    if(active_.empty()) {
+        return;
+    }
+    std::stable_sort(active_.begin(), active_.end(), entryLess);
+    Run run;
+    run.reserve(active_.size());
+    for(size_t i = 0; i < active_.size(); ++i) {
+        if(i + 1 < active_.size() && !(active_[i].key < active_[i + 1].key)) continue;
+        run.push_back(active_[i]);
+    }
+    active_.clear();
+    runsSize_ += run.size();
+    runs_.push_back(Run());
+    runs_.back().swap(run);
+
+    while(runs_.size() >= 2 && runs_[runs_.size() - 2].size() <= runs_.back().size()) {
+        Run merged;
+        mergeRuns(runs_[runs_.size() - 2], runs_.back(), merged);
+        runsSize_ -= runs_[runs_.size() - 2].size() + runs_.back().size() - merged.size();
+        runs_.pop_back();
+        runs_.back().swap(merged);
+    }
+}
+
+/**
+* Merges two sorted runs; on equal keys the newer entry wins.  Tombstones
+* are kept, since they still have to hide the key in the tree.
+*/
+template<class Key, class Value>
+void BufferedAVLTree<Key, Value>::mergeRuns(const Run& older, const Run& newer, Run& out)
+{
+    out.clear();
+    out.reserve(older.size() + newer.size());
+    size_t i = 0, j = 0;
+    while(i < older.size() && j < newer.size()) {
+        if(older[i].key < newer[j].key) {
+            out.push_back(older[i++]);
+        }
+        else {
+            if(!(newer[j].key < older[i].key)) i++;
+            out.push_back(newer[j++]);
+        }
+    }
+    out.insert(out.end(), older.begin() + i, older.end());
+    out.insert(out.end(), newer.begin() + j, newer.end());
+}
+
+template<class Key, class Value>
+const typename BufferedAVLTree<Key, Value>::Entry* BufferedAVLTree<Key, Value>::findInRun(const Run& run,
+                                                                                          const Key& key)
+{
+    Entry probe = { key, Value(), false };
+    typename Run::const_iterator it = std::lower_bound(run.begin(), run.end(), probe, entryLess);
+    if(it == run.end() || key < it->key) {
+        return NULL;
+    }
+    return &*it;
+}
+
+/**
+* Hands the sealed runs to the merge, inline or on the merge thread.  A
+* writer blocks here only while the previous background merge is still
+* running.
+*/
+template<class Key, class Value>
+void BufferedAVLTree<Key, Value>::startMerge()
+{
+    waitForMerge();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        frozen_.swap(runs_);
+        runsSize_ = 0;
+        merging_ = true;
+    }
+    if(options_.backgroundMerge) {
+        mergeCv_.notify_all();
+    }
+    else {
+        mergeFrozen();
+    }
+}
+
+/**
+* Folds the frozen runs into one batch and applies it to the tree.
+*/
+template<class Key, class Value>
+void BufferedAVLTree<Key, Value>::mergeFrozen()
+{
+    // frozen_ only changes under the lock when no merge is running, so it
+    // can be read here without it
+    Run all, merged;
+    for(size_t r = 0; r < frozen_.size(); ++r) {
+        mergeRuns(all, frozen_[r], merged);
+        all.swap(merged);
+    }
+    std::vector<BatchOp<Key, Value> > ops(all.size());
+    for(size_t i = 0; i < all.size(); ++i) {
+        ops[i].kind = all[i].tombstone ? BATCH_DELETE : BATCH_UPSERT;
+        ops[i].key = all[i].key;
+        ops[i].value = all[i].value;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tree_.apply_batch(ops);
+        frozen_.clear();
+        merging_ = false;
+    }
+    mergeCv_.notify_all();
+}
+
+template<class Key, class Value>
+void BufferedAVLTree<Key, Value>::waitForMerge()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    mergeCv_.wait(lock, [this] { return !merging_; });
+}
+
+template<class Key, class Value>
+void BufferedAVLTree<Key, Value>::mergerLoop()
+{
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            mergeCv_.wait(lock, [this] { return stop_ || merging_; });
+            if(!merging_) break;
+        }
+        mergeFrozen();
+    }
+}
+
+template<class Key, class Value>
+void BufferedAVLTree<Key, Value>::flush()
+{
+    sealActive();
+    if(runsSize_ > 0) {
+        startMerge();
+    }
+    waitForMerge();
+}
+
+template<class Key, class Value>
+bool BufferedAVLTree<Key, Value>::find(const Key& key, Value& value) const
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    reads_++;
+    const Entry* found = NULL;
+
+    probes_++;
+    for(size_t i = active_.size(); i-- > 0; ) {
+        if(!(active_[i].key < key) && !(key < active_[i].key)) {
+            found = &active_[i];
+            break;
+        }
+    }
+    for(size_t r = runs_.size(); found == NULL && r-- > 0; ) {
+        probes_++;
+        found = findInRun(runs_[r], key);
+    }
+    if(found != NULL) {
+        if(found->tombstone) return false;
+        value = found->value;
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for(size_t r = frozen_.size(); found == NULL && r-- > 0; ) {
+        probes_++;
+        found = findInRun(frozen_[r], key);
+    }
+    if(found != NULL) {
+        if(found->tombstone) return false;
+        value = found->value;
+        return true;
+    }
+    probes_++;
+    typename AVLTree<Key, Value>::iterator it = tree_.find(key);
+    if(it == tree_.end()) {
+        return false;
+    }
+    value = it->second;
+    return true;
+}
+
+template<class Key, class Value>
+Value BufferedAVLTree<Key, Value>::operator[](const Key& key) const
+{
+    Value value;
+    if(!find(key, value)) throw std::out_of_range("Invalid key");
+    return value;
+}
+
+template<class Key, class Value>
+typename BufferedAVLTree<Key, Value>::iterator BufferedAVLTree<Key, Value>::begin()
+{
+    waitForMerge();
+    sealActive();
+    return iterator(this);
+}
+
+template<class Key, class Value>
+typename BufferedAVLTree<Key, Value>::iterator BufferedAVLTree<Key, Value>::end() const
+{
+    return iterator();
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the BufferedAVLTree class.
+  -----------------------------------------------
+*/
+
+/*
+  -----------------------------------------------
+  Begin implementations for the BufferedAVLTree::iterator class.
+  -----------------------------------------------
+*/
+
+template<class Key, class Value>
+BufferedAVLTree<Key, Value>::iterator::iterator() : map_(NULL)
+{
+
+}
+
+template<class Key, class Value>
+BufferedAVLTree<Key, Value>::iterator::iterator(const BufferedAVLTree<Key, Value>* map) :
+    map_(map), tree_(map->tree_.begin()), positions_(map->runs_.size(), 0)
+{
+    settle();
+}
+
+/**
+* Moves to the smallest key at or after the current positions that is not
+* hidden by a tombstone, consuming every source's entry for that key.
+*/
+template<class Key, class Value>
+void BufferedAVLTree<Key, Value>::iterator::settle()
+{
+    while(true) {
+        const Key* smallest = NULL;
+        if(tree_ != map_->tree_.end()) smallest = &tree_->first;
+        for(size_t r = 0; r < positions_.size(); ++r) {
+            const Run& run = map_->runs_[r];
+            if(positions_[r] < run.size() && (smallest == NULL || run[positions_[r]].key < *smallest)) {
+                smallest = &run[positions_[r]].key;
+            }
+        }
+        if(smallest == NULL) {
+            map_ = NULL;
+            return;
+        }
+
+        // runs are oldest first, so the last one holding the key wins over
+        // the others and the tree
+        Key key = *smallest;
+        const Entry* newest = NULL;
+        for(size_t r = 0; r < positions_.size(); ++r) {
+            const Run& run = map_->runs_[r];
+            if(positions_[r] < run.size() && !(key < run[positions_[r]].key)) {
+                newest = &run[positions_[r]++];
+            }
+        }
+        bool inTree = tree_ != map_->tree_.end() && !(key < tree_->first);
+        if(newest == NULL) {
+            item_ = std::pair<Key, Value>(tree_->first, tree_->second);
+        }
+        else if(!newest->tombstone) {
+            item_ = std::pair<Key, Value>(newest->key, newest->value);
+        }
+        if(inTree) ++tree_;
+        if(newest == NULL || !newest->tombstone) {
+            return;
+        }
+    }
+}
+
+template<class Key, class Value>
+const std::pair<Key, Value>& BufferedAVLTree<Key, Value>::iterator::operator*() const
+{
+    return item_;
+}
+
+template<class Key, class Value>
+const std::pair<Key, Value>* BufferedAVLTree<Key, Value>::iterator::operator->() const
+{
+    return &item_;
+}
+
+template<class Key, class Value>
+bool BufferedAVLTree<Key, Value>::iterator::operator==(const iterator& rhs) const
+{
+    if(map_ == NULL || rhs.map_ == NULL) {
+        return map_ == rhs.map_;
+    }
+    return map_ == rhs.map_ && tree_ == rhs.tree_ && positions_ == rhs.positions_;
+}
+
+template<class Key, class Value>
+bool BufferedAVLTree<Key, Value>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<class Key, class Value>
+typename BufferedAVLTree<Key, Value>::iterator& BufferedAVLTree<Key, Value>::iterator::operator++()
+{
+    settle();
+    return *this;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the BufferedAVLTree::iterator class.
+  -----------------------------------------------
+*/
+
+#endif
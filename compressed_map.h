@@ -0,0 +1,281 @@
+#ifndef COMPRESSED_MAP_H
+#define COMPRESSED_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include "avlbst.h"
+
+// Read-only compressed copies of AVLTree<uint64_t, Value> maps, for cold
+// maps that must stay resident but are rarely queried.
+//
+// Keys are cut into blocks of BlockKeys in key order.  A block's first key
+// goes in a sparse index (one key per block, binary searched); the rest
+// are stored as the gaps between neighbours, minus one, bit-packed at the
+// width of the block's largest gap.  Values are kept unpacked in key order,
+// so the i-th key's value is values_[i].
+
+/**
+* An immutable sorted map with uint64_t keys.  find() and lowerBound()
+* binary search the index and then decode one block up to the key; scans
+* decode whole blocks.  Dense key sets pack to a few bits per key, and
+* even keys spread over the full 64-bit range save the node overhead.
+*/
+template<typename Value>
+class CompressedMap
+{
+public:
+    static const size_t BlockKeys = 128;
+
+    CompressedMap() : count_(0) { }
+    // copies tree's items in key order
+    explicit CompressedMap(const AVLTree<uint64_t, Value>& tree);
+
+    size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+
+    uint64_t keyAt(size_t i) const;
+    const Value& valueAt(size_t i) const { return values_[i]; }
+
+    // index of the first key not less than key, or size()
+    size_t lowerBound(uint64_t key) const;
+
+    // copies the value of key into value; returns false if absent
+    bool find(uint64_t key, Value& value) const;
+
+    // Calls fn(key, value) for each item with first <= key < last (or
+    // every item), in key order, decoding a block at a time.
+    template<typename Fn>
+    void for_each(Fn fn) const;
+    template<typename Fn>
+    void for_each_range(uint64_t first, uint64_t last, Fn fn) const;
+
+    size_t blocks() const { return firstKeys_.size(); }
+    // writes block b's keys to keys (room for BlockKeys); returns how many
+    size_t decodeBlock(size_t b, uint64_t* keys) const;
+
+    // heap bytes held, values included
+    size_t memoryBytes() const;
+
+private:
+    void append(uint64_t key);
+    void sealBlock();
+    size_t blockSize(size_t b) const;
+    unsigned blockWidth(size_t b) const { return (unsigned)(blockInfo_[b] & 127); }
+    const uint64_t* blockWords(size_t b) const { return words_.data() + (blockInfo_[b] >> 7); }
+    // the block holding key if present, or blocks() if key is below them all
+    size_t findBlock(uint64_t key) const;
+    // lowerBound(key), with the key found there in at (unset at size())
+    size_t seek(uint64_t key, uint64_t& at) const;
+    static uint64_t field(const uint64_t* words, unsigned width, size_t i);
+
+    size_t count_;
+    std::vector<uint64_t> firstKeys_;
+    // per block: word offset of its gaps << 7 | bit width (0..64)
+    std::vector<uint64_t> blockInfo_;
+    std::vector<uint64_t> words_;
+    std::vector<Value> values_;
+    // keys of the block being built
+    std::vector<uint64_t> pending_;
+};
+
+template<typename Value>
+const size_t CompressedMap<Value>::BlockKeys;
+
+template<typename Value>
+CompressedMap<Value>::CompressedMap(const AVLTree<uint64_t, Value>& tree) : count_(0)
+{
+    pending_.reserve(BlockKeys);
+    for(typename AVLTree<uint64_t, Value>::iterator it = tree.begin(); it != tree.end(); ++it) {
+        append(it->first);
+        values_.push_back(it->second);
+    }
+    sealBlock();
+    std::vector<uint64_t>().swap(pending_);
+    firstKeys_.shrink_to_fit();
+    blockInfo_.shrink_to_fit();
+    words_.shrink_to_fit();
+    values_.shrink_to_fit();
+}
+
+template<typename Value>
+void CompressedMap<Value>::append(uint64_t key)
+{
+    pending_.push_back(key);
+    count_++;
+    if(pending_.size() == BlockKeys) {
+        sealBlock();
+    }
+}
+
+// Packs the pending keys as a new block.
+template<typename Value>
+void CompressedMap<Value>::sealBlock()
+{
+    if(pending_.empty()) {
+        return;
+    }
+    uint64_t widest = 0;
+    for(size_t i = 1; i < pending_.size(); ++i) {
+        widest |= pending_[i] - pending_[i - 1] - 1;
+    }
+    unsigned width = 0;
+    while(width < 64 && (widest >> width) != 0) width++;
+
+    size_t offset = words_.size();
+    words_.resize(offset + ((pending_.size() - 1) * width + 63) / 64, 0);
+    for(size_t i = 1; width > 0 && i < pending_.size(); ++i) {
+        uint64_t gap = pending_[i] - pending_[i - 1] - 1;
+        size_t bit = (i - 1) * width;
+        size_t word = offset + bit / 64;
+        unsigned shift = bit % 64;
+        words_[word] |= gap << shift;
+        if(shift + width > 64) words_[word + 1] |= gap >> (64 - shift);
+    }
+    firstKeys_.push_back(pending_[0]);
+    blockInfo_.push_back((uint64_t)offset << 7 | width);
+    pending_.clear();
+}
+
+// The i-th width-bit field starting at words.
+template<typename Value>
+uint64_t CompressedMap<Value>::field(const uint64_t* words, unsigned width, size_t i)
+{
+    if(width == 0) {
+        return 0;
+    }
+    size_t bit = i * width;
+    unsigned shift = bit % 64;
+    uint64_t v = words[bit / 64] >> shift;
+    if(shift + width > 64) v |= words[bit / 64 + 1] << (64 - shift);
+    return width == 64 ? v : v & ((uint64_t(1) << width) - 1);
+}
+
+template<typename Value>
+size_t CompressedMap<Value>::blockSize(size_t b) const
+{
+    return std::min(BlockKeys, count_ - b * BlockKeys);
+}
+
+template<typename Value>
+size_t CompressedMap<Value>::findBlock(uint64_t key) const
+{
+    std::vector<uint64_t>::const_iterator after = std::upper_bound(firstKeys_.begin(), firstKeys_.end(), key);
+    if(after == firstKeys_.begin()) {
+        return firstKeys_.size();
+    }
+    return (size_t)(after - firstKeys_.begin()) - 1;
+}
+
+template<typename Value>
+uint64_t CompressedMap<Value>::keyAt(size_t i) const
+{
+    size_t b = i / BlockKeys;
+    const uint64_t* words = blockWords(b);
+    unsigned width = blockWidth(b);
+    uint64_t key = firstKeys_[b];
+    for(size_t j = 0; j < i % BlockKeys; ++j) {
+        key += field(words, width, j) + 1;
+    }
+    return key;
+}
+
+template<typename Value>
+size_t CompressedMap<Value>::seek(uint64_t key, uint64_t& at) const
+{
+    size_t b = findBlock(key);
+    if(b == firstKeys_.size()) {
+        if(count_ > 0) at = firstKeys_[0];
+        return 0;
+    }
+    // firstKeys_[b] <= key < firstKeys_[b + 1], so the answer is in block b
+    // or is the next block's first key
+    const uint64_t* words = blockWords(b);
+    unsigned width = blockWidth(b);
+    size_t n = blockSize(b);
+    uint64_t k = firstKeys_[b];
+    for(size_t j = 0; j < n; ++j) {
+        if(j > 0) k += field(words, width, j - 1) + 1;
+        if(k >= key) {
+            at = k;
+            return b * BlockKeys + j;
+        }
+    }
+    if(b + 1 < firstKeys_.size()) at = firstKeys_[b + 1];
+    return b * BlockKeys + n;
+}
+
+template<typename Value>
+size_t CompressedMap<Value>::lowerBound(uint64_t key) const
+{
+    uint64_t at;
+    return seek(key, at);
+}
+
+template<typename Value>
+bool CompressedMap<Value>::find(uint64_t key, Value& value) const
+{
+    uint64_t at = 0;
+    size_t i = seek(key, at);
+    if(i >= count_ || at != key) {
+        return false;
+    }
+    value = values_[i];
+    return true;
+}
+
+template<typename Value>
+size_t CompressedMap<Value>::decodeBlock(size_t b, uint64_t* keys) const
+{
+    const uint64_t* words = blockWords(b);
+    unsigned width = blockWidth(b);
+    size_t n = blockSize(b);
+    uint64_t k = firstKeys_[b];
+    keys[0] = k;
+    for(size_t j = 1; j < n; ++j) {
+        k += field(words, width, j - 1) + 1;
+        keys[j] = k;
+    }
+    return n;
+}
+
+template<typename Value>
+template<typename Fn>
+void CompressedMap<Value>::for_each(Fn fn) const
+{
+    uint64_t keys[BlockKeys];
+    for(size_t b = 0; b < firstKeys_.size(); ++b) {
+        size_t n = decodeBlock(b, keys);
+        for(size_t j = 0; j < n; ++j) {
+            fn(keys[j], values_[b * BlockKeys + j]);
+        }
+    }
+}
+
+template<typename Value>
+template<typename Fn>
+void CompressedMap<Value>::for_each_range(uint64_t first, uint64_t last, Fn fn) const
+{
+    size_t b = findBlock(first);
+    if(b == firstKeys_.size()) {
+        b = 0;
+    }
+    uint64_t keys[BlockKeys];
+    for(; b < firstKeys_.size() && firstKeys_[b] < last; ++b) {
+        size_t n = decodeBlock(b, keys);
+        for(size_t j = 0; j < n && keys[j] < last; ++j) {
+            if(keys[j] >= first) fn(keys[j], values_[b * BlockKeys + j]);
+        }
+    }
+}
+
+template<typename Value>
+size_t CompressedMap<Value>::memoryBytes() const
+{
+    return sizeof(*this) + firstKeys_.capacity() * sizeof(uint64_t) + blockInfo_.capacity() * sizeof(uint64_t)
+        + words_.capacity() * sizeof(uint64_t) + values_.capacity() * sizeof(Value)
+        + pending_.capacity() * sizeof(uint64_t);
+}
+
+#endif
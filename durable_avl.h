@@ -0,0 +1,448 @@
+#ifndef DURABLE_AVL_H
+#define DURABLE_AVL_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include "avlbst.h"
+#include "snapshot.h"
+
+// An AVLTree whose inserts and removes survive a crash.  Every operation is
+// appended to a write-ahead log, path + ".wal"; checkpoint() saves the whole
+// tree as a snapshot, path + ".snap", and empties the log.  On construction
+// the tree recovers by loading the snapshot and replaying the log over it.
+//
+// With group commit (groupCommitMicros > 0) operations return as soon as
+// they are buffered and a background thread writes and fsyncs the buffer at
+// least that often, so many operations share one fsync; an operation is
+// durable within the latency bound, or as soon as sync() returns.  With
+// groupCommitMicros == 0 each operation is fsynced before it returns.
+//
+// Log records: u32 payload length, u64 checksum of the payload, then an op
+// byte, u32 key length, key bytes and, for inserts, u32 value length and
+// value bytes (encoded with SnapshotSerializer).  Recovery stops at the
+// first torn or corrupt record and truncates the log there.  Replaying a
+// log over a snapshot that already contains its effects is harmless, so a
+// crash between writing a checkpoint and emptying the log loses nothing.
+//
+// Every AVLTree call that changes the contents is logged or unavailable:
+// apply_batch() logs each op and hinted inserts log like insert(); clear()
+// and load() checkpoint the new contents; merge() and node handles are
+// deleted.  compact() and the thread layout move nodes without changing
+// any item, so they need no log.  Values changed in place, through an
+// iterator or operator[], are not logged: write them with insert().
+//
+// Like AVLTree, the tree is not thread-safe: calls must be serialized by
+// the caller.  Only the log flushing runs in the background.
+
+struct DurableOptions
+{
+    DurableOptions() : groupCommitMicros(1000), flushBytes(1 << 20), checkpointEvery(0) { }
+
+    unsigned groupCommitMicros;   // latency bound for group commit, 0 = fsync per operation
+    size_t flushBytes;            // flush early once this much log is buffered
+    uint64_t checkpointEvery;     // checkpoint after this many operations, 0 = only when asked
+};
+
+enum DurableLogOp
+{
+    DURABLE_INSERT = 1,
+    DURABLE_REMOVE = 2
+};
+
+template <class Key, class Value>
+class DurableAVLTree : public AVLTree<Key, Value>
+{
+public:
+    explicit DurableAVLTree(const std::string& path, const DurableOptions& options = DurableOptions());
+    virtual ~DurableAVLTree();
+
+    typedef typename AVLTree<Key, Value>::iterator iterator;
+    typedef typename AVLTree<Key, Value>::node_type node_type;
+
+    virtual void insert(const std::pair<const Key, Value>& new_item);
+    iterator insert(iterator hint, const std::pair<const Key, Value>& new_item);
+    virtual void remove(const Key& key);
+    // logs every op, then applies the batch with either strategy
+    void apply_batch(const std::vector<BatchOp<Key, Value> >& ops, BatchStrategy strategy = BATCH_AUTO);
+    // both replace the contents wholesale, so they checkpoint
+    void clear();
+    void load(const std::string& path, bool verify = true);
+
+    // node handles and merges would move items past the log
+    node_type extract(const Key& key) = delete;
+    iterator insert(node_type&& node) = delete;
+    template<typename Conflict>
+    void merge(AVLTree<Key, Value>& other, Conflict conflict, BatchStrategy strategy = BATCH_AUTO) = delete;
+    void merge(AVLTree<Key, Value>& other) = delete;
+
+    // blocks until every operation so far is on disk
+    void sync();
+    // saves a snapshot of the tree and empties the log
+    void checkpoint();
+
+    uint64_t syncCount() const { return syncs_; }
+    uint64_t recoveredRecords() const { return recovered_; }
+
+protected:
+    void append(DurableLogOp op, const Key& key, const Value* value);
+    void maybeCheckpoint(uint64_t ops = 1);
+    void writeOut(const std::vector<uint8_t>& batch);
+    void flusherLoop();
+    void recover();
+
+    std::string snapPath_;
+    std::string logPath_;
+    DurableOptions options_;
+    int fd_;
+
+    std::mutex mutex_;
+    std::condition_variable flushCv_;     // wakes the flusher
+    std::condition_variable durableCv_;   // signalled when durableLsn_ advances
+    std::vector<uint8_t> pending_;
+    std::vector<uint8_t> record_;
+    uint64_t appendedLsn_;
+    uint64_t durableLsn_;
+    bool syncRequested_;
+    bool stop_;
+    bool failed_;
+    std::thread flusher_;
+
+    std::atomic<uint64_t> syncs_;
+    uint64_t sinceCheckpoint_;
+    uint64_t recovered_;
+    // set while apply_batch() runs, whose ops are already logged
+    bool batching_;
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the DurableAVLTree class.
+  -----------------------------------------------
+*/
+
+/**
+* Recovers the tree from path.snap and path.wal, if they exist, then
+* starts the flusher.
+*/
+template<class Key, class Value>
+DurableAVLTree<Key, Value>::DurableAVLTree(const std::string& path, const DurableOptions& options) :
+    snapPath_(path + ".snap"), logPath_(path + ".wal"), options_(options), fd_(-1),
+    appendedLsn_(0), durableLsn_(0), syncRequested_(false), stop_(false), failed_(false),
+    syncs_(0), sinceCheckpoint_(0), recovered_(0), batching_(false)
+{
+    recover();
+    fd_ = open(logPath_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd_ < 0) {
+        throw std::runtime_error("durable tree: cannot open " + logPath_);
+    }
+    if(options_.groupCommitMicros > 0) {
+        flusher_ = std::thread(&DurableAVLTree<Key, Value>::flusherLoop, this);
+    }
+}
+
+/**
+* Flushes the log and stops the flusher.  Does not checkpoint.
+*/
+template<class Key, class Value>
+DurableAVLTree<Key, Value>::~DurableAVLTree()
+{
+    if(flusher_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        flushCv_.notify_one();
+        flusher_.join();
+    }
+    close(fd_);
+}
+
+/**
+* Loads the checkpoint and replays the valid prefix of the log.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::recover()
+{
+    if(access(snapPath_.c_str(), F_OK) == 0) {
+        AVLTree<Key, Value>::load(snapPath_);
+    }
+
+    FILE* file = std::fopen(logPath_.c_str(), "rb");
+    if(file == NULL) {
+        return;
+    }
+    std::vector<uint8_t> log;
+    uint8_t chunk[1 << 16];
+    size_t n;
+    while((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        log.insert(log.end(), chunk, chunk + n);
+    }
+    std::fclose(file);
+
+    size_t pos = 0;
+    while(pos + 12 <= log.size()) {
+        uint32_t len;
+        uint64_t sum;
+        std::memcpy(&len, &log[pos], 4);
+        std::memcpy(&sum, &log[pos + 4], 8);
+        if(len < 5 || len > log.size() - pos - 12) break;
+        const uint8_t* p = &log[pos + 12];
+        if(snapshotChecksum(0, p, len) != sum) break;
+
+        uint32_t keyLen;
+        std::memcpy(&keyLen, p + 1, 4);
+        if((size_t)keyLen + 5 > len) break;
+        Key key = SnapshotSerializer<Key>::read(p + 5, keyLen);
+        if(p[0] == DURABLE_INSERT) {
+            uint32_t valueLen;
+            std::memcpy(&valueLen, p + 5 + keyLen, 4);
+            Value value = SnapshotSerializer<Value>::read(p + 9 + keyLen, valueLen);
+            AVLTree<Key, Value>::insert(std::make_pair(key, value));
+        }
+        else {
+            AVLTree<Key, Value>::remove(key);
+        }
+        recovered_++;
+        pos += 12 + len;
+    }
+
+    // drop a torn tail so new records follow the last good one
+    if(pos < log.size() && truncate(logPath_.c_str(), (off_t)pos) != 0) {
+        throw std::runtime_error("durable tree: cannot truncate " + logPath_);
+    }
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& new_item)
+{
+    append(DURABLE_INSERT, new_item.first, &new_item.second);
+    AVLTree<Key, Value>::insert(new_item);
+    maybeCheckpoint();
+}
+
+template<class Key, class Value>
+typename DurableAVLTree<Key, Value>::iterator
+DurableAVLTree<Key, Value>::insert(iterator hint, const std::pair<const Key, Value>& new_item)
+{
+    append(DURABLE_INSERT, new_item.first, &new_item.second);
+    iterator it = AVLTree<Key, Value>::insert(hint, new_item);
+    maybeCheckpoint();
+    return it;
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::remove(const Key& key)
+{
+    if(batching_) {
+        AVLTree<Key, Value>::remove(key);
+        return;
+    }
+    append(DURABLE_REMOVE, key, NULL);
+    AVLTree<Key, Value>::remove(key);
+    maybeCheckpoint();
+}
+
+/**
+* The ops are logged one record each before any is applied; replaying
+* them in order gives what the batch gives, as the last op on a key wins
+* either way.  Unsorted ops are rejected before anything is logged.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::apply_batch(const std::vector<BatchOp<Key, Value> >& ops, BatchStrategy strategy)
+{
+    for(size_t i = 1; i < ops.size(); ++i) {
+        if(ops[i].key < ops[i - 1].key) {
+            throw std::invalid_argument("apply_batch: ops are not sorted by key");
+        }
+    }
+    for(size_t i = 0; i < ops.size(); ++i) {
+        if(ops[i].kind == BATCH_UPSERT) append(DURABLE_INSERT, ops[i].key, &ops[i].value);
+        else append(DURABLE_REMOVE, ops[i].key, NULL);
+    }
+    batching_ = true;
+    try {
+        AVLTree<Key, Value>::apply_batch(ops, strategy);
+    }
+    catch(...) {
+        batching_ = false;
+        throw;
+    }
+    batching_ = false;
+    maybeCheckpoint(ops.size());
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::clear()
+{
+    AVLTree<Key, Value>::clear();
+    checkpoint();
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::load(const std::string& path, bool verify)
+{
+    AVLTree<Key, Value>::load(path, verify);
+    checkpoint();
+}
+
+/**
+* Encodes one log record and either hands it to the flusher or, without
+* group commit, writes and fsyncs it.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::append(DurableLogOp op, const Key& key, const Value* value)
+{
+    uint32_t keyLen = (uint32_t)SnapshotSerializer<Key>::size(key);
+    uint32_t valueLen = value != NULL ? (uint32_t)SnapshotSerializer<Value>::size(*value) : 0;
+    uint32_t len = 5 + keyLen + (value != NULL ? 4 + valueLen : 0);
+
+    record_.resize(12 + len);
+    uint8_t* p = &record_[12];
+    p[0] = (uint8_t)op;
+    std::memcpy(p + 1, &keyLen, 4);
+    SnapshotSerializer<Key>::write(key, p + 5);
+    if(value != NULL) {
+        std::memcpy(p + 5 + keyLen, &valueLen, 4);
+        SnapshotSerializer<Value>::write(*value, p + 9 + keyLen);
+    }
+    uint64_t sum = snapshotChecksum(0, p, len);
+    std::memcpy(&record_[0], &len, 4);
+    std::memcpy(&record_[4], &sum, 8);
+
+    if(options_.groupCommitMicros == 0) {
+        writeOut(record_);
+    }
+    else {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if(failed_) {
+            throw std::runtime_error("durable tree: log write failed");
+        }
+        pending_.insert(pending_.end(), record_.begin(), record_.end());
+        appendedLsn_++;
+        if(pending_.size() >= options_.flushBytes) {
+            flushCv_.notify_one();
+        }
+    }
+}
+
+/**
+* Checkpoints once checkpointEvery operations have been applied since the
+* last checkpoint; ops is how many the caller just applied.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::maybeCheckpoint(uint64_t ops)
+{
+    sinceCheckpoint_ += ops;
+    if(options_.checkpointEvery > 0 && sinceCheckpoint_ >= options_.checkpointEvery) {
+        checkpoint();
+    }
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::writeOut(const std::vector<uint8_t>& batch)
+{
+    size_t done = 0;
+    while(done < batch.size()) {
+        ssize_t n = write(fd_, batch.data() + done, batch.size() - done);
+        if(n <= 0) {
+            throw std::runtime_error("durable tree: cannot write " + logPath_);
+        }
+        done += (size_t)n;
+    }
+    if(fdatasync(fd_) != 0) {
+        throw std::runtime_error("durable tree: cannot sync " + logPath_);
+    }
+    syncs_++;
+}
+
+/**
+* Writes and fsyncs the buffered records every groupCommitMicros, or
+* sooner when the buffer fills or sync() is waiting.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::flusherLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(true) {
+        flushCv_.wait_for(lock, std::chrono::microseconds(options_.groupCommitMicros), [this] {
+            return stop_ || syncRequested_ || pending_.size() >= options_.flushBytes;
+        });
+        if(pending_.empty()) {
+            syncRequested_ = false;
+            durableCv_.notify_all();
+            if(stop_) break;
+            continue;
+        }
+
+        std::vector<uint8_t> batch;
+        batch.swap(pending_);
+        uint64_t lsn = appendedLsn_;
+        syncRequested_ = false;
+
+        lock.unlock();
+        bool ok = true;
+        try {
+            writeOut(batch);
+        }
+        catch(const std::exception&) {
+            ok = false;
+        }
+        lock.lock();
+
+        if(ok) durableLsn_ = lsn;
+        else failed_ = true;
+        durableCv_.notify_all();
+        if(failed_) break;
+    }
+}
+
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::sync()
+{
+    if(options_.groupCommitMicros == 0) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    uint64_t target = appendedLsn_;
+    syncRequested_ = true;
+    flushCv_.notify_one();
+    durableCv_.wait(lock, [this, target] { return durableLsn_ >= target || failed_; });
+    if(failed_) {
+        throw std::runtime_error("durable tree: log write failed");
+    }
+}
+
+/**
+* The snapshot is renamed into place before the log is emptied, so a crash
+* at any point leaves a snapshot plus a log that together hold every
+* committed operation.
+*/
+template<class Key, class Value>
+void DurableAVLTree<Key, Value>::checkpoint()
+{
+    sync();
+    this->save(snapPath_);
+    if(ftruncate(fd_, 0) != 0 || fdatasync(fd_) != 0) {
+        throw std::runtime_error("durable tree: cannot reset " + logPath_);
+    }
+    sinceCheckpoint_ = 0;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the DurableAVLTree class.
+  -----------------------------------------------
+*/
+
+#endif
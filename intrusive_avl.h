@@ -0,0 +1,554 @@
+#ifndef INTRUSIVE_AVL_H
+#define INTRUSIVE_AVL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Phase markers for the hardware-counter profiling mode (see bst_profile.h).
+#ifdef BST_PROFILE
+#include "bst_profile.h"
+#else
+#define BST_PROFILE_PHASE(phase)
+#endif
+
+// An AVL tree over objects the caller already owns.  Each object embeds an
+// AVLHook, the links and balance an AVLNode would carry, and the tree links
+// the hooks directly: it never allocates, never copies an object and never
+// frees one.  An object with several hooks can be in several trees at once,
+// one tree per hook, e.g. a cache entry indexed by id and by expiry:
+//
+//     struct Entry { uint64_t id; uint64_t expiry; AVLHook byId; AVLHook byExpiry; };
+//     IntrusiveAVLTree<Entry, uint64_t, &Entry::id, &Entry::byId> ids;
+//     IntrusiveAVLTree<Entry, uint64_t, &Entry::expiry, &Entry::byExpiry> expiries;
+//
+// Keys are unique per tree and compared with < and ==, as in AVLTree.  The
+// key field must not change while the object is in a tree that orders by
+// it, and an object must be erased (or the tree cleared) before it is
+// destroyed.  A descent reads both the hook and the key of each object it
+// passes, so keeping them in the same cache line pays.  Inserts and erases
+// rebalance with the usual AVL rotation and balance cases, and a two-child
+// erase swaps the object's position with its predecessor's.
+//
+// Like AVLTree, the tree is not thread-safe.
+
+/**
+* The links one tree needs in an object.  A hook belongs to at most one
+* tree at a time; it is all zero while the object is in none.
+*/
+struct AVLHook
+{
+    AVLHook() : parent(NULL), left(NULL), right(NULL), balance(0) { }
+
+    AVLHook* parent;
+    AVLHook* left;
+    AVLHook* right;
+    int8_t balance;
+};
+
+/**
+* An intrusive AVL tree of T, keyed by the member KeyField and linked
+* through the member HookField.
+*/
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+class IntrusiveAVLTree
+{
+public:
+    IntrusiveAVLTree() : root_(NULL), size_(0) { }
+    // Unlinks any objects still in the tree; they are not destroyed.
+    ~IntrusiveAVLTree() { clear(); }
+
+    // Links object in; false (and nothing changes) if its key is present.
+    bool insert(T& object);
+    // Unlinks object; false (and nothing changes) if it is not in this
+    // tree.  Checking climbs from object to the root, O(log n) like the
+    // unlinking itself.
+    bool erase(T& object);
+    // Unlinks and returns the object with key, or NULL if there is none.
+    T* erase(const Key& key);
+    T* find(const Key& key) const;
+
+    // In-order traversal: first() is the smallest key, next() NULL after
+    // the largest.
+    T* first() const;
+    T* next(const T& object) const;
+
+    size_t size() const { return size_; }
+    bool empty() const { return root_ == NULL; }
+    // Unlinks every object, resetting its hook, in O(n).
+    void clear();
+
+private:
+    static AVLHook* hook(T& object) { return &(object.*HookField); }
+    static T* owner(AVLHook* hook);
+    static const Key& key(AVLHook* hook) { return owner(hook)->*KeyField; }
+    static AVLHook* predecessor(AVLHook* hook);
+
+    void insertFix(AVLHook* parent, AVLHook* current);
+    void removeFix(AVLHook* node, int diff);
+    void rotateRight(AVLHook* node);
+    void rotateLeft(AVLHook* node);
+    void replaceChild(AVLHook* parent, AVLHook* from, AVLHook* to);
+    void swapWithPredecessor(AVLHook* node, AVLHook* pred);
+    void unlink(AVLHook* node);
+
+    AVLHook* root_;
+    size_t size_;
+
+    IntrusiveAVLTree(const IntrusiveAVLTree&);
+    IntrusiveAVLTree& operator=(const IntrusiveAVLTree&);
+};
+
+/*
+  ----------------------------------------------------------
+  Begin implementations for the IntrusiveAVLTree class.
+  ----------------------------------------------------------
+*/
+
+/**
+* The object a hook is embedded in.  The hook's offset is taken from the
+* member pointer applied to uninitialized storage for a T, which the
+* compiler folds to a constant.
+*/
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+T* IntrusiveAVLTree<T, Key, KeyField, HookField>::owner(AVLHook* hook)
+{
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type probe;
+    T* object = reinterpret_cast<T*>(&probe);
+    ptrdiff_t offset = reinterpret_cast<char*>(&(object->*HookField)) - reinterpret_cast<char*>(object);
+    return reinterpret_cast<T*>(reinterpret_cast<char*>(hook) - offset);
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+bool IntrusiveAVLTree<T, Key, KeyField, HookField>::insert(T& object)
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    AVLHook* item = hook(object);
+    const Key& item_key = object.*KeyField;
+
+    if(root_ == NULL) {
+        *item = AVLHook();
+        root_ = item;
+        size_++;
+        return true;
+    }
+
+    AVLHook* parent = root_;
+    while(true) {
+        const Key& current_key = key(parent);
+        if(item_key == current_key) {
+            return false;
+        }
+        AVLHook*& slot = item_key < current_key ? parent->left : parent->right;
+        if(slot == NULL) {
+            *item = AVLHook();
+            item->parent = parent;
+            slot = item;
+            parent->balance += (&slot == &parent->left) ? -1 : 1;
+            break;
+        }
+        parent = slot;
+    }
+    size_++;
+
+    // if b(p) != 0, call insertFix
+    if(parent->balance != 0) {
+        insertFix(parent, item);
+    }
+    return true;
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+void IntrusiveAVLTree<T, Key, KeyField, HookField>::insertFix(AVLHook* parent, AVLHook* current)
+{
+    BST_PROFILE_PHASE(BST_PHASE_REBALANCE);
+
+    // iterative form of AVLTree::insertFix, one level per pass
+    while(parent != NULL && parent->parent != NULL) {
+        AVLHook* grandparent = parent->parent;
+
+        // parent is a left child of grandparent
+        if(parent == grandparent->left) {
+            grandparent->balance -= 1;
+            if(grandparent->balance == -1) {
+                current = parent;
+                parent = grandparent;
+                continue;
+            }
+            if(grandparent->balance == -2) {
+                // zig-zig -> rotateRight(g)
+                if(current == parent->left) {
+                    rotateRight(grandparent);
+                    parent->balance = 0;
+                    grandparent->balance = 0;
+                }
+                // zig-zag -> rotateLeft(p); rotateRight(g)
+                else {
+                    rotateLeft(parent);
+                    rotateRight(grandparent);
+                    if(current->balance == -1) {
+                        parent->balance = 0;
+                        grandparent->balance = 1;
+                    }
+                    else if(current->balance == 0) {
+                        parent->balance = 0;
+                        grandparent->balance = 0;
+                    }
+                    else { // curr_bal == +1
+                        parent->balance = -1;
+                        grandparent->balance = 0;
+                    }
+                    current->balance = 0;
+                }
+            }
+        }
+
+        // parent is a right child of grandparent
+        else {
+            grandparent->balance += 1;
+            if(grandparent->balance == 1) {
+                current = parent;
+                parent = grandparent;
+                continue;
+            }
+            if(grandparent->balance == 2) {
+                // zig-zig -> rotateLeft(g)
+                if(current == parent->right) {
+                    rotateLeft(grandparent);
+                    parent->balance = 0;
+                    grandparent->balance = 0;
+                }
+                // zig-zag -> rotateRight(p); rotateLeft(g)
+                else {
+                    rotateRight(parent);
+                    rotateLeft(grandparent);
+                    if(current->balance == 1) {
+                        parent->balance = 0;
+                        grandparent->balance = -1;
+                    }
+                    else if(current->balance == 0) {
+                        parent->balance = 0;
+                        grandparent->balance = 0;
+                    }
+                    else { // curr_bal == -1
+                        parent->balance = 1;
+                        grandparent->balance = 0;
+                    }
+                    current->balance = 0;
+                }
+            }
+        }
+        break;
+    }
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+T* IntrusiveAVLTree<T, Key, KeyField, HookField>::find(const Key& key) const
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    AVLHook* current = root_;
+    while(current != NULL) {
+        const Key& current_key = IntrusiveAVLTree::key(current);
+        if(key == current_key) {
+            return owner(current);
+        }
+        current = key < current_key ? current->left : current->right;
+    }
+    return NULL;
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+bool IntrusiveAVLTree<T, Key, KeyField, HookField>::erase(T& object)
+{
+    // an unlinked hook, or one in another tree, must not reach unlink()
+    AVLHook* top = hook(object);
+    while(top->parent != NULL) top = top->parent;
+    if(top != root_ || root_ == NULL) {
+        return false;
+    }
+    unlink(hook(object));
+    return true;
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+T* IntrusiveAVLTree<T, Key, KeyField, HookField>::erase(const Key& key)
+{
+    T* object = find(key);
+    if(object != NULL) {
+        unlink(hook(*object));
+    }
+    return object;
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+T* IntrusiveAVLTree<T, Key, KeyField, HookField>::first() const
+{
+    AVLHook* current = root_;
+    if(current == NULL) {
+        return NULL;
+    }
+    while(current->left != NULL) current = current->left;
+    return owner(current);
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+T* IntrusiveAVLTree<T, Key, KeyField, HookField>::next(const T& object) const
+{
+    AVLHook* current = hook(const_cast<T&>(object));
+    if(current->right != NULL) {
+        current = current->right;
+        while(current->left != NULL) current = current->left;
+        return owner(current);
+    }
+    // else, the first ancestor this subtree is a left child of
+    while(current->parent != NULL && current == current->parent->right) {
+        current = current->parent;
+    }
+    return current->parent != NULL ? owner(current->parent) : NULL;
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+void IntrusiveAVLTree<T, Key, KeyField, HookField>::clear()
+{
+    // post-order walk over the parent links, resetting each hook once its
+    // children are done
+    AVLHook* current = root_;
+    while(current != NULL) {
+        if(current->left != NULL) {
+            current = current->left;
+        }
+        else if(current->right != NULL) {
+            current = current->right;
+        }
+        else {
+            AVLHook* parent = current->parent;
+            if(parent != NULL) {
+                if(parent->left == current) parent->left = NULL;
+                else parent->right = NULL;
+            }
+            *current = AVLHook();
+            current = parent;
+        }
+    }
+    root_ = NULL;
+    size_ = 0;
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+AVLHook* IntrusiveAVLTree<T, Key, KeyField, HookField>::predecessor(AVLHook* hook)
+{
+    // only called with two children, so the predecessor is the rightmost
+    // hook of the left subtree
+    AVLHook* current = hook->left;
+    while(current->right != NULL) current = current->right;
+    return current;
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+void IntrusiveAVLTree<T, Key, KeyField, HookField>::replaceChild(AVLHook* parent, AVLHook* from, AVLHook* to)
+{
+    if(parent == NULL) {
+        root_ = to;
+    }
+    else if(parent->left == from) {
+        parent->left = to;
+    }
+    else {
+        parent->right = to;
+    }
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+void IntrusiveAVLTree<T, Key, KeyField, HookField>::rotateRight(AVLHook* node)
+{
+    AVLHook* child = node->left;
+    AVLHook* parent = node->parent;
+
+    replaceChild(parent, node, child);
+    if(child->right != NULL) {
+        child->right->parent = node;
+    }
+    node->left = child->right;
+    child->right = node;
+    node->parent = child;
+    child->parent = parent;
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+void IntrusiveAVLTree<T, Key, KeyField, HookField>::rotateLeft(AVLHook* node)
+{
+    AVLHook* child = node->right;
+    AVLHook* parent = node->parent;
+
+    replaceChild(parent, node, child);
+    if(child->left != NULL) {
+        child->left->parent = node;
+    }
+    node->right = child->left;
+    child->left = node;
+    node->parent = child;
+    child->parent = parent;
+}
+
+/**
+* Swaps the positions (links and balances) of node, which has two
+* children, and its predecessor pred, as BinarySearchTree::nodeSwap does
+* for nodes; afterwards node has no right child.  pred is either node's
+* left child or the right child of a hook below it.
+*/
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+void IntrusiveAVLTree<T, Key, KeyField, HookField>::swapWithPredecessor(AVLHook* node, AVLHook* pred)
+{
+    AVLHook* parent = node->parent;
+    AVLHook* left = node->left;
+    AVLHook* right = node->right;
+    AVLHook* predParent = pred->parent;
+    AVLHook* predLeft = pred->left;
+
+    replaceChild(parent, node, pred);
+    pred->parent = parent;
+    pred->right = right;
+    right->parent = pred;
+    if(pred == left) {
+        pred->left = node;
+        node->parent = pred;
+    }
+    else {
+        pred->left = left;
+        left->parent = pred;
+        predParent->right = node;
+        node->parent = predParent;
+    }
+    node->left = predLeft;
+    if(predLeft != NULL) {
+        predLeft->parent = node;
+    }
+    node->right = NULL;
+
+    int8_t balance = node->balance;
+    node->balance = pred->balance;
+    pred->balance = balance;
+}
+
+/**
+* Takes node out of the tree and rebalances, as AVLTree::unlink; node is
+* left zeroed.
+*/
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+void IntrusiveAVLTree<T, Key, KeyField, HookField>::unlink(AVLHook* node)
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+
+    // if 2 children, swap with predecessor
+    if(node->left != NULL && node->right != NULL) {
+        swapWithPredecessor(node, predecessor(node));
+    }
+
+    // at most one child now: promote it
+    AVLHook* parent = node->parent;
+    AVLHook* child = node->left != NULL ? node->left : node->right;
+    int diff = (parent != NULL && node == parent->left) ? 1 : -1;
+    replaceChild(parent, node, child);
+    if(child != NULL) {
+        child->parent = parent;
+    }
+    *node = AVLHook();
+    size_--;
+
+    // patch tree
+    if(parent != NULL) {
+        removeFix(parent, diff);
+    }
+}
+
+template<typename T, typename Key, Key T::*KeyField, AVLHook T::*HookField>
+void IntrusiveAVLTree<T, Key, KeyField, HookField>::removeFix(AVLHook* node, int diff)
+{
+    BST_PROFILE_PHASE(BST_PHASE_REBALANCE);
+
+    // iterative form of AVLTree::removeFix, one level per pass
+    while(node != NULL) {
+        AVLHook* parent = node->parent;
+
+        // compute diff for the next level
+        int ndiff = 0;
+        if(parent != NULL) {
+            ndiff = (node == parent->left) ? 1 : -1;
+        }
+
+        node->balance += diff;
+        if(node->balance == 0) {
+            node = parent;
+            diff = ndiff;
+            continue;
+        }
+        else if(node->balance == -2) {
+            AVLHook* child = node->left;
+            if(child->balance == -1) {
+                // zig-zig case
+                rotateRight(node);
+                node->balance = 0;
+                child->balance = 0;
+            }
+            else if(child->balance == 0) {
+                // zig-zig case; the height is unchanged, so stop
+                rotateRight(node);
+                node->balance = -1;
+                child->balance = 1;
+                return;
+            }
+            else { // child_bal == +1
+                // zig-zag case
+                AVLHook* grandchild = child->right;
+                int8_t grandchild_bal = grandchild->balance;
+                rotateLeft(child);
+                rotateRight(node);
+                node->balance = grandchild_bal == -1 ? 1 : 0;
+                child->balance = grandchild_bal == 1 ? -1 : 0;
+                grandchild->balance = 0;
+            }
+            node = parent;
+            diff = ndiff;
+            continue;
+        }
+        else if(node->balance == 2) {
+            AVLHook* child = node->right;
+            if(child->balance == 1) {
+                // zig-zig case
+                rotateLeft(node);
+                node->balance = 0;
+                child->balance = 0;
+            }
+            else if(child->balance == 0) {
+                // zig-zig case; the height is unchanged, so stop
+                rotateLeft(node);
+                node->balance = 1;
+                child->balance = -1;
+                return;
+            }
+            else { // child_bal == -1
+                // zig-zag case
+                AVLHook* grandchild = child->left;
+                int8_t grandchild_bal = grandchild->balance;
+                rotateRight(child);
+                rotateLeft(node);
+                node->balance = grandchild_bal == 1 ? -1 : 0;
+                child->balance = grandchild_bal == -1 ? 1 : 0;
+                grandchild->balance = 0;
+            }
+            node = parent;
+            diff = ndiff;
+            continue;
+        }
+        // balance of -1 or +1: the height is unchanged
+        return;
+    }
+}
+
+/*
+  --------------------------------------------------------
+  End implementations for the IntrusiveAVLTree class.
+  --------------------------------------------------------
+*/
+
+#endif
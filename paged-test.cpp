@@ -0,0 +1,92 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <map>
+#include "pagedbst.h"
+
+using namespace std;
+
+// Checks PagedTree against std::map with the buffer pool capped at 1% of
+// the data size, then reopens the file and checks it again.
+//   ./paged-test [n]
+
+typedef PagedTree<uint64_t, uint64_t> Tree;
+
+static bool sameContents(const Tree& tree, const map<uint64_t, uint64_t>& expected)
+{
+    if(tree.size() != expected.size()) {
+        cout << "size " << tree.size() << " != " << expected.size() << endl;
+        return false;
+    }
+    map<uint64_t, uint64_t>::const_iterator e = expected.begin();
+    for(Tree::iterator it = tree.begin(); it != tree.end(); ++it, ++e) {
+        if(e == expected.end() || it->first != e->first || it->second != e->second) {
+            cout << "iteration differs at key " << it->first << endl;
+            return false;
+        }
+    }
+    return e == expected.end();
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    const char* path = "paged-test.db";
+    size_t dataPages = n * 2 * sizeof(uint64_t) / Tree::PageSize;
+    size_t poolPages = dataPages / 100;
+    remove(path);
+
+    map<uint64_t, uint64_t> expected;
+    bool ok = true;
+    srand(104);
+    {
+        Tree tree(path, poolPages);
+        poolPages = tree.pool().capacity();
+
+        // random inserts, overwrites, removes and finds
+        for(size_t i = 0; i < 2 * n && ok; ++i) {
+            uint64_t key = ((uint64_t)rand() << 16 ^ rand()) % (2 * n);
+            int op = rand() % 10;
+            if(op < 6) {
+                tree.insert(make_pair(key, (uint64_t)i));
+                expected[key] = i;
+            }
+            else if(op < 8) {
+                tree.remove(key);
+                expected.erase(key);
+            }
+            else {
+                Tree::iterator it = tree.find(key);
+                map<uint64_t, uint64_t>::iterator e = expected.find(key);
+                if((it == tree.end()) != (e == expected.end()) || (it != tree.end() && it->second != e->second)) {
+                    cout << "find(" << key << ") differs" << endl;
+                    ok = false;
+                }
+            }
+        }
+        ok = ok && sameContents(tree, expected);
+
+        cout << "n=" << n << " keys=" << tree.size() << " file_pages=" << tree.pageCount()
+             << " pool_pages=" << poolPages << " (" << 100.0 * poolPages / tree.pageCount() << "% of file)"
+             << " hits=" << tree.pool().hits() << " misses=" << tree.pool().misses()
+             << " writes=" << tree.pool().writes() << endl;
+        tree.checkpoint();
+    }
+
+    {
+        Tree reopened(path, poolPages);
+        ok = ok && sameContents(reopened, expected);
+        if(ok && !expected.empty()) {
+            uint64_t key = expected.begin()->first;
+            if(reopened[key] != expected.begin()->second) {
+                cout << "operator[] differs after reopen" << endl;
+                ok = false;
+            }
+        }
+    }
+    remove(path);
+
+    cout << (ok ? "PASS" : "FAIL") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,830 @@
+#ifndef PAGEDBST_H
+#define PAGEDBST_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// A disk-backed ordered map for data that does not fit in memory.  The map
+// is a B+tree stored in fixed-size pages of a single local file; only the
+// pages held by a bounded buffer pool are in memory, so memory use stays
+// constant as the data grows.
+//
+// Page 0 holds the file header.  Every other page is a leaf (sorted keys and
+// their values, chained left to right for iteration) or an internal node
+// (separator keys and child page numbers).  Removal does not merge pages;
+// emptied leaves stay in the chain and are skipped by iterators.
+//
+// Dirty pages are written back when evicted and by checkpoint(), which
+// also writes the header and fsyncs the file.  The file is only guaranteed
+// to be consistent after a completed checkpoint: a crash in between can
+// leave it torn.
+
+/**
+* A fixed number of page frames over a file, with clock (second chance)
+* replacement.  Pages are pinned while in use and never evicted while
+* pinned.
+*/
+class BufferPool
+{
+public:
+    BufferPool(int fd, size_t pageSize, size_t capacity);
+
+    // pins page, reading it from the file unless it is resident
+    uint8_t* pin(uint64_t page);
+    // pins a page that is not in the file yet, as zeros
+    uint8_t* pinNew(uint64_t page);
+    void unpin(uint64_t page, bool dirty);
+
+    // writes back every dirty page
+    void flush();
+
+    size_t capacity() const { return frames_.size(); }
+    size_t resident() const { return lookup_.size(); }
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    uint64_t writes() const { return writes_; }
+
+private:
+    struct Frame
+    {
+        uint64_t page;
+        bool used;
+        bool dirty;
+        bool referenced;
+        int pins;
+        std::vector<uint8_t> data;
+    };
+
+    size_t victim();
+    void writeBack(Frame& frame);
+    uint8_t* pinFrame(uint64_t page, bool read);
+
+    int fd_;
+    size_t pageSize_;
+    std::vector<Frame> frames_;
+    std::unordered_map<uint64_t, size_t> lookup_;
+    size_t hand_;
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t writes_;
+};
+
+inline BufferPool::BufferPool(int fd, size_t pageSize, size_t capacity) :
+    fd_(fd), pageSize_(pageSize), frames_(capacity), hand_(0), hits_(0), misses_(0), writes_(0)
+{
+    for(size_t i = 0; i < frames_.size(); ++i) {
+        frames_[i].used = false;
+        frames_[i].dirty = false;
+        frames_[i].referenced = false;
+        frames_[i].pins = 0;
+        frames_[i].data.resize(pageSize);
+    }
+}
+
+inline void BufferPool::writeBack(Frame& frame)
+{
+    if(pwrite(fd_, frame.data.data(), pageSize_, (off_t)(frame.page * pageSize_)) != (ssize_t)pageSize_) {
+        throw std::runtime_error("paged tree: page write failed");
+    }
+    frame.dirty = false;
+    writes_++;
+}
+
+/**
+* Picks a frame to reuse: sweeps the clock hand, clearing reference bits,
+* until it finds an unpinned frame that was not referenced since the last
+* sweep.
+*/
+inline size_t BufferPool::victim()
+{
+    for(size_t scanned = 0; scanned < 2 * frames_.size() + 1; ++scanned) {
+        Frame& frame = frames_[hand_];
+        size_t index = hand_;
+        hand_ = (hand_ + 1) % frames_.size();
+        if(!frame.used) return index;
+        if(frame.pins > 0) continue;
+        if(frame.referenced) {
+            frame.referenced = false;
+            continue;
+        }
+        if(frame.dirty) writeBack(frame);
+        lookup_.erase(frame.page);
+        frame.used = false;
+        return index;
+    }
+    throw std::runtime_error("paged tree: every buffer pool frame is pinned");
+}
+
+inline uint8_t* BufferPool::pinFrame(uint64_t page, bool read)
+{
+    std::unordered_map<uint64_t, size_t>::iterator it = lookup_.find(page);
+    if(it != lookup_.end()) {
+        Frame& frame = frames_[it->second];
+        frame.pins++;
+        frame.referenced = true;
+        hits_++;
+        return frame.data.data();
+    }
+
+    misses_++;
+    size_t index = victim();
+    Frame& frame = frames_[index];
+    if(read) {
+        ssize_t got = pread(fd_, frame.data.data(), pageSize_, (off_t)(page * pageSize_));
+        if(got != (ssize_t)pageSize_) {
+            throw std::runtime_error("paged tree: page read failed");
+        }
+    }
+    else {
+        std::memset(frame.data.data(), 0, pageSize_);
+    }
+    frame.page = page;
+    frame.used = true;
+    frame.dirty = !read;
+    frame.referenced = true;
+    frame.pins = 1;
+    lookup_[page] = index;
+    return frame.data.data();
+}
+
+inline uint8_t* BufferPool::pin(uint64_t page)
+{
+    return pinFrame(page, true);
+}
+
+inline uint8_t* BufferPool::pinNew(uint64_t page)
+{
+    return pinFrame(page, false);
+}
+
+inline void BufferPool::unpin(uint64_t page, bool dirty)
+{
+    Frame& frame = frames_[lookup_.at(page)];
+    frame.pins--;
+    if(dirty) frame.dirty = true;
+}
+
+inline void BufferPool::flush()
+{
+    for(size_t i = 0; i < frames_.size(); ++i) {
+        if(frames_[i].used && frames_[i].dirty) writeBack(frames_[i]);
+    }
+}
+
+/**
+* Pins a page for the lifetime of the object.
+*/
+class PageRef
+{
+public:
+    PageRef(BufferPool& pool, uint64_t page, bool fresh = false) :
+        pool_(pool), page_(page), dirty_(false)
+    {
+        data_ = fresh ? pool.pinNew(page) : pool.pin(page);
+    }
+    ~PageRef() { pool_.unpin(page_, dirty_); }
+
+    uint8_t* data() const { return data_; }
+    uint64_t page() const { return page_; }
+    void markDirty() { dirty_ = true; }
+
+private:
+    PageRef(const PageRef&);
+    PageRef& operator=(const PageRef&);
+
+    BufferPool& pool_;
+    uint64_t page_;
+    uint8_t* data_;
+    bool dirty_;
+};
+
+/**
+* The disk-backed map.  Keys and values must be trivially copyable; they
+* are stored as raw bytes.  Keys need operator< and operator==.
+*/
+template <typename Key, typename Value>
+class PagedTree
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                  "PagedTree stores keys and values as raw bytes");
+public:
+    static const size_t PageSize = 4096;
+
+    // opens path, creating it if it does not exist; poolPages bounds memory use
+    PagedTree(const std::string& path, size_t poolPages);
+    ~PagedTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    bool empty() const;
+    size_t size() const;
+
+    // writes back every dirty page and the header, then fsyncs
+    void checkpoint();
+
+    const BufferPool& pool() const { return pool_; }
+    uint64_t pageCount() const { return pageCount_; }
+
+    /**
+    * Iterates over the leaf chain.  Items are copied out of the pages, so
+    * they stay valid while pages are evicted, but any insert or remove
+    * invalidates the iterator.
+    */
+    class iterator
+    {
+    public:
+        iterator();
+
+        const std::pair<Key, Value>& operator*() const;
+        const std::pair<Key, Value>* operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+
+    protected:
+        friend class PagedTree<Key, Value>;
+        iterator(const PagedTree<Key, Value>* tree, uint64_t page, size_t slot);
+        void settle();
+
+        const PagedTree<Key, Value>* tree_;
+        uint64_t page_;     // 0 at the end
+        size_t slot_;
+        std::pair<Key, Value> item_;
+    };
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    Value operator[](const Key& key) const;
+
+protected:
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t pageSize;
+        uint32_t keySize;
+        uint32_t valueSize;
+        uint32_t reserved;
+        uint64_t root;
+        uint64_t pageCount;
+        uint64_t count;
+    };
+
+    struct PageHeader
+    {
+        uint16_t leaf;
+        uint16_t count;
+        uint32_t reserved;
+        uint64_t next;      // right sibling of a leaf, 0 if none
+    };
+
+    static const size_t leafCapacity = (PageSize - sizeof(PageHeader)) / (sizeof(Key) + sizeof(Value));
+    static const size_t innerCapacity = (PageSize - sizeof(PageHeader) - sizeof(uint64_t)) / (sizeof(Key) + sizeof(uint64_t));
+    static_assert(leafCapacity >= 3 && innerCapacity >= 3, "PagedTree keys and values must fit several to a page");
+
+    // Page accessors.  Fields are copied with memcpy since keys and values
+    // are packed without regard to alignment.
+    static PageHeader header(const uint8_t* p);
+    static void setHeader(uint8_t* p, const PageHeader& h);
+    static Key keyAt(const uint8_t* p, size_t i);
+    static void setKey(uint8_t* p, size_t i, const Key& key);
+    static Value valueAt(const uint8_t* p, size_t i);
+    static void setValue(uint8_t* p, size_t i, const Value& value);
+    static uint64_t childAt(const uint8_t* p, size_t i);
+    static void setChild(uint8_t* p, size_t i, uint64_t child);
+
+    static size_t lowerBound(const uint8_t* p, size_t count, const Key& key);
+    static size_t upperBound(const uint8_t* p, size_t count, const Key& key);
+
+    uint64_t allocatePage();
+    uint64_t findLeaf(const Key& key) const;
+    bool insertInto(uint64_t page, const Key& key, const Value& value, Key& upKey, uint64_t& upPage);
+
+    int fd_;
+    mutable BufferPool pool_;
+    uint64_t root_;
+    uint64_t pageCount_;
+    uint64_t count_;
+};
+
+static const char pagedTreeMagic[8] = { 'B', 'S', 'T', 'P', 'A', 'G', 'E', '1' };
+
+template<typename Key, typename Value>
+const size_t PagedTree<Key, Value>::PageSize;
+
+/*
+  -----------------------------------------------
+  Begin implementations for the PagedTree class.
+  -----------------------------------------------
+*/
+
+template<typename Key, typename Value>
+typename PagedTree<Key, Value>::PageHeader PagedTree<Key, Value>::header(const uint8_t* p)
+{
+    PageHeader h;
+    std::memcpy(&h, p, sizeof(h));
+    return h;
+}
+
+template<typename Key, typename Value>
+void PagedTree<Key, Value>::setHeader(uint8_t* p, const PageHeader& h)
+{
+    std::memcpy(p, &h, sizeof(h));
+}
+
+template<typename Key, typename Value>
+Key PagedTree<Key, Value>::keyAt(const uint8_t* p, size_t i)
+{
+    Key key;
+    std::memcpy(&key, p + sizeof(PageHeader) + i * sizeof(Key), sizeof(Key));
+    return key;
+}
+
+template<typename Key, typename Value>
+void PagedTree<Key, Value>::setKey(uint8_t* p, size_t i, const Key& key)
+{
+    std::memcpy(p + sizeof(PageHeader) + i * sizeof(Key), &key, sizeof(Key));
+}
+
+template<typename Key, typename Value>
+Value PagedTree<Key, Value>::valueAt(const uint8_t* p, size_t i)
+{
+    Value value;
+    std::memcpy(&value, p + sizeof(PageHeader) + leafCapacity * sizeof(Key) + i * sizeof(Value), sizeof(Value));
+    return value;
+}
+
+template<typename Key, typename Value>
+void PagedTree<Key, Value>::setValue(uint8_t* p, size_t i, const Value& value)
+{
+    std::memcpy(p + sizeof(PageHeader) + leafCapacity * sizeof(Key) + i * sizeof(Value), &value, sizeof(Value));
+}
+
+template<typename Key, typename Value>
+uint64_t PagedTree<Key, Value>::childAt(const uint8_t* p, size_t i)
+{
+    uint64_t child;
+    std::memcpy(&child, p + sizeof(PageHeader) + innerCapacity * sizeof(Key) + i * sizeof(uint64_t), sizeof(child));
+    return child;
+}
+
+template<typename Key, typename Value>
+void PagedTree<Key, Value>::setChild(uint8_t* p, size_t i, uint64_t child)
+{
+    std::memcpy(p + sizeof(PageHeader) + innerCapacity * sizeof(Key) + i * sizeof(uint64_t), &child, sizeof(child));
+}
+
+/**
+* Index of the first key in the page not less than key.
+*/
+template<typename Key, typename Value>
+size_t PagedTree<Key, Value>::lowerBound(const uint8_t* p, size_t count, const Key& key)
+{
+    size_t lo = 0, hi = count;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(keyAt(p, mid) < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+* Index of the first key in the page greater than key, i.e. the child of
+* an internal page whose range holds key.
+*/
+template<typename Key, typename Value>
+size_t PagedTree<Key, Value>::upperBound(const uint8_t* p, size_t count, const Key& key)
+{
+    size_t lo = 0, hi = count;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(key < keyAt(p, mid)) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+/**
+* Opens or creates the file.  A new file gets a header page and an empty
+* root leaf.
+*/
+template<typename Key, typename Value>
+PagedTree<Key, Value>::PagedTree(const std::string& path, size_t poolPages) :
+    fd_(open(path.c_str(), O_RDWR | O_CREAT, 0644)),
+    pool_(fd_, PageSize, poolPages < 8 ? 8 : poolPages),
+    root_(1), pageCount_(2), count_(0)
+{
+    if(fd_ < 0) {
+        throw std::runtime_error("paged tree: cannot open " + path);
+    }
+    struct stat st;
+    if(fstat(fd_, &st) != 0) {
+        close(fd_);
+        throw std::runtime_error("paged tree: cannot stat " + path);
+    }
+
+    if(st.st_size == 0) {
+        PageRef leaf(pool_, root_, true);
+        PageHeader h = PageHeader();
+        h.leaf = 1;
+        setHeader(leaf.data(), h);
+        leaf.markDirty();
+        return;
+    }
+
+    FileHeader fh;
+    if(pread(fd_, &fh, sizeof(fh), 0) != (ssize_t)sizeof(fh) ||
+       std::memcmp(fh.magic, pagedTreeMagic, sizeof(pagedTreeMagic)) != 0 ||
+       fh.pageSize != PageSize || fh.keySize != sizeof(Key) || fh.valueSize != sizeof(Value)) {
+        close(fd_);
+        throw std::runtime_error("paged tree: " + path + " is not a paged tree of this type");
+    }
+    root_ = fh.root;
+    pageCount_ = fh.pageCount;
+    count_ = fh.count;
+}
+
+/**
+* Checkpoints and closes the file.
+*/
+template<typename Key, typename Value>
+PagedTree<Key, Value>::~PagedTree()
+{
+    try {
+        checkpoint();
+    }
+    catch(const std::exception& e) {
+        std::fprintf(stderr, "paged tree: checkpoint on close failed: %s\n", e.what());
+    }
+    close(fd_);
+}
+
+template<typename Key, typename Value>
+void PagedTree<Key, Value>::checkpoint()
+{
+    pool_.flush();
+
+    std::vector<uint8_t> page(PageSize, 0);
+    FileHeader fh = FileHeader();
+    std::memcpy(fh.magic, pagedTreeMagic, sizeof(pagedTreeMagic));
+    fh.pageSize = PageSize;
+    fh.keySize = sizeof(Key);
+    fh.valueSize = sizeof(Value);
+    fh.root = root_;
+    fh.pageCount = pageCount_;
+    fh.count = count_;
+    std::memcpy(page.data(), &fh, sizeof(fh));
+    if(pwrite(fd_, page.data(), PageSize, 0) != (ssize_t)PageSize || fsync(fd_) != 0) {
+        throw std::runtime_error("paged tree: checkpoint failed");
+    }
+}
+
+template<typename Key, typename Value>
+bool PagedTree<Key, Value>::empty() const
+{
+    return count_ == 0;
+}
+
+template<typename Key, typename Value>
+size_t PagedTree<Key, Value>::size() const
+{
+    return (size_t)count_;
+}
+
+template<typename Key, typename Value>
+uint64_t PagedTree<Key, Value>::allocatePage()
+{
+    return pageCount_++;
+}
+
+/**
+* Descends from the root to the leaf whose range holds key, pinning one
+* page at a time.
+*/
+template<typename Key, typename Value>
+uint64_t PagedTree<Key, Value>::findLeaf(const Key& key) const
+{
+    uint64_t page = root_;
+    while(true) {
+        PageRef node(pool_, page);
+        PageHeader h = header(node.data());
+        if(h.leaf) return page;
+        page = childAt(node.data(), upperBound(node.data(), h.count, key));
+    }
+}
+
+/**
+* If key is already in the tree, overwrites its value.  A full root is
+* split by adding a new root above it.
+*/
+template<typename Key, typename Value>
+void PagedTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    Key upKey;
+    uint64_t upPage;
+    if(insertInto(root_, keyValuePair.first, keyValuePair.second, upKey, upPage)) {
+        uint64_t newRoot = allocatePage();
+        PageRef node(pool_, newRoot, true);
+        PageHeader h = PageHeader();
+        h.count = 1;
+        setHeader(node.data(), h);
+        setKey(node.data(), 0, upKey);
+        setChild(node.data(), 0, root_);
+        setChild(node.data(), 1, upPage);
+        node.markDirty();
+        root_ = newRoot;
+    }
+}
+
+/**
+* Inserts into the subtree rooted at page.  If the page had to split,
+* returns true with the first key of the new right page in upKey and its
+* page number in upPage.  Keeps the pages on the current path pinned.
+*/
+template<typename Key, typename Value>
+bool PagedTree<Key, Value>::insertInto(uint64_t page, const Key& key, const Value& value, Key& upKey, uint64_t& upPage)
+{
+    PageRef node(pool_, page);
+    PageHeader h = header(node.data());
+
+    if(h.leaf) {
+        size_t idx = lowerBound(node.data(), h.count, key);
+        if(idx < h.count && keyAt(node.data(), idx) == key) {
+            setValue(node.data(), idx, value);
+            node.markDirty();
+            return false;
+        }
+        count_++;
+        node.markDirty();
+
+        if(h.count < leafCapacity) {
+            for(size_t i = h.count; i > idx; --i) {
+                setKey(node.data(), i, keyAt(node.data(), i - 1));
+                setValue(node.data(), i, valueAt(node.data(), i - 1));
+            }
+            setKey(node.data(), idx, key);
+            setValue(node.data(), idx, value);
+            h.count++;
+            setHeader(node.data(), h);
+            return false;
+        }
+
+        // split: gather the full leaf plus the new item, keep the lower half
+        std::vector<Key> keys;
+        std::vector<Value> values;
+        for(size_t i = 0; i < h.count; ++i) {
+            keys.push_back(keyAt(node.data(), i));
+            values.push_back(valueAt(node.data(), i));
+        }
+        keys.insert(keys.begin() + idx, key);
+        values.insert(values.begin() + idx, value);
+
+        size_t mid = keys.size() / 2;
+        upPage = allocatePage();
+        PageRef sibling(pool_, upPage, true);
+        PageHeader sh = PageHeader();
+        sh.leaf = 1;
+        sh.count = (uint16_t)(keys.size() - mid);
+        sh.next = h.next;
+        for(size_t i = mid; i < keys.size(); ++i) {
+            setKey(sibling.data(), i - mid, keys[i]);
+            setValue(sibling.data(), i - mid, values[i]);
+        }
+        setHeader(sibling.data(), sh);
+        sibling.markDirty();
+
+        for(size_t i = 0; i < mid; ++i) {
+            setKey(node.data(), i, keys[i]);
+            setValue(node.data(), i, values[i]);
+        }
+        h.count = (uint16_t)mid;
+        h.next = upPage;
+        setHeader(node.data(), h);
+        upKey = keys[mid];
+        return true;
+    }
+
+    size_t ci = upperBound(node.data(), h.count, key);
+    Key childKey;
+    uint64_t childPage;
+    if(!insertInto(childAt(node.data(), ci), key, value, childKey, childPage)) {
+        return false;
+    }
+    node.markDirty();
+
+    if(h.count < innerCapacity) {
+        for(size_t i = h.count; i > ci; --i) {
+            setKey(node.data(), i, keyAt(node.data(), i - 1));
+            setChild(node.data(), i + 1, childAt(node.data(), i));
+        }
+        setKey(node.data(), ci, childKey);
+        setChild(node.data(), ci + 1, childPage);
+        h.count++;
+        setHeader(node.data(), h);
+        return false;
+    }
+
+    // split: the middle separator moves up, the rest divide between the pages
+    std::vector<Key> keys;
+    std::vector<uint64_t> children;
+    for(size_t i = 0; i < h.count; ++i) {
+        keys.push_back(keyAt(node.data(), i));
+    }
+    for(size_t i = 0; i <= h.count; ++i) {
+        children.push_back(childAt(node.data(), i));
+    }
+    keys.insert(keys.begin() + ci, childKey);
+    children.insert(children.begin() + ci + 1, childPage);
+
+    size_t mid = keys.size() / 2;
+    upPage = allocatePage();
+    PageRef sibling(pool_, upPage, true);
+    PageHeader sh = PageHeader();
+    sh.count = (uint16_t)(keys.size() - mid - 1);
+    for(size_t i = mid + 1; i < keys.size(); ++i) {
+        setKey(sibling.data(), i - mid - 1, keys[i]);
+    }
+    for(size_t i = mid + 1; i < children.size(); ++i) {
+        setChild(sibling.data(), i - mid - 1, children[i]);
+    }
+    setHeader(sibling.data(), sh);
+    sibling.markDirty();
+
+    for(size_t i = 0; i < mid; ++i) {
+        setKey(node.data(), i, keys[i]);
+    }
+    for(size_t i = 0; i <= mid; ++i) {
+        setChild(node.data(), i, children[i]);
+    }
+    h.count = (uint16_t)mid;
+    setHeader(node.data(), h);
+    upKey = keys[mid];
+    return true;
+}
+
+/**
+* Removes key from its leaf.  Pages are never merged.
+*/
+template<typename Key, typename Value>
+void PagedTree<Key, Value>::remove(const Key& key)
+{
+    PageRef leaf(pool_, findLeaf(key));
+    PageHeader h = header(leaf.data());
+    size_t idx = lowerBound(leaf.data(), h.count, key);
+    if(idx == h.count || !(keyAt(leaf.data(), idx) == key)) {
+        return;
+    }
+
+    for(size_t i = idx; i + 1 < h.count; ++i) {
+        setKey(leaf.data(), i, keyAt(leaf.data(), i + 1));
+        setValue(leaf.data(), i, valueAt(leaf.data(), i + 1));
+    }
+    h.count--;
+    setHeader(leaf.data(), h);
+    leaf.markDirty();
+    count_--;
+}
+
+template<typename Key, typename Value>
+typename PagedTree<Key, Value>::iterator PagedTree<Key, Value>::begin() const
+{
+    uint64_t page = root_;
+    while(true) {
+        PageRef node(pool_, page);
+        PageHeader h = header(node.data());
+        if(h.leaf) break;
+        page = childAt(node.data(), 0);
+    }
+    return iterator(this, page, 0);
+}
+
+template<typename Key, typename Value>
+typename PagedTree<Key, Value>::iterator PagedTree<Key, Value>::end() const
+{
+    return iterator(this, 0, 0);
+}
+
+template<typename Key, typename Value>
+typename PagedTree<Key, Value>::iterator PagedTree<Key, Value>::find(const Key& key) const
+{
+    uint64_t page = findLeaf(key);
+    PageRef leaf(pool_, page);
+    PageHeader h = header(leaf.data());
+    size_t idx = lowerBound(leaf.data(), h.count, key);
+    if(idx < h.count && keyAt(leaf.data(), idx) == key) {
+        return iterator(this, page, idx);
+    }
+    return end();
+}
+
+/**
+* Returns a copy of the value of key.  Throws std::out_of_range if key is
+* not in the tree.
+*/
+template<typename Key, typename Value>
+Value PagedTree<Key, Value>::operator[](const Key& key) const
+{
+    iterator it = find(key);
+    if(it == end()) {
+        throw std::out_of_range("Invalid key");
+    }
+    return it->second;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the PagedTree class.
+  -----------------------------------------------
+*/
+
+/*
+  -----------------------------------------------
+  Begin implementations for the PagedTree::iterator class.
+  -----------------------------------------------
+*/
+
+template<typename Key, typename Value>
+PagedTree<Key, Value>::iterator::iterator() : tree_(NULL), page_(0), slot_(0), item_()
+{
+
+}
+
+template<typename Key, typename Value>
+PagedTree<Key, Value>::iterator::iterator(const PagedTree<Key, Value>* tree, uint64_t page, size_t slot) :
+    tree_(tree), page_(page), slot_(slot), item_()
+{
+    settle();
+}
+
+/**
+* Moves past the end of the current leaf and any empty leaves, then
+* copies the current item out of its page.
+*/
+template<typename Key, typename Value>
+void PagedTree<Key, Value>::iterator::settle()
+{
+    while(page_ != 0) {
+        PageRef leaf(tree_->pool_, page_);
+        PageHeader h = header(leaf.data());
+        if(slot_ < h.count) {
+            item_.first = keyAt(leaf.data(), slot_);
+            item_.second = valueAt(leaf.data(), slot_);
+            return;
+        }
+        page_ = h.next;
+        slot_ = 0;
+    }
+}
+
+template<typename Key, typename Value>
+const std::pair<Key, Value>& PagedTree<Key, Value>::iterator::operator*() const
+{
+    return item_;
+}
+
+template<typename Key, typename Value>
+const std::pair<Key, Value>* PagedTree<Key, Value>::iterator::operator->() const
+{
+    return &item_;
+}
+
+template<typename Key, typename Value>
+bool PagedTree<Key, Value>::iterator::operator==(const iterator& rhs) const
+{
+    return page_ == rhs.page_ && slot_ == rhs.slot_;
+}
+
+template<typename Key, typename Value>
+bool PagedTree<Key, Value>::iterator::operator!=(const iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<typename Key, typename Value>
+typename PagedTree<Key, Value>::iterator& PagedTree<Key, Value>::iterator::operator++()
+{
+    slot_++;
+    settle();
+    return *this;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the PagedTree::iterator class.
+  -----------------------------------------------
+*/
+
+#endif
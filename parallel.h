@@ -0,0 +1,305 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <exception>
+
+// Threading helpers shared by the trees' parallel operations.  Anything
+// that takes a thread count treats 0 as "one per hardware thread".
+
+inline unsigned parallelThreads(unsigned requested)
+{
+    if(requested > 0) {
+        return requested;
+    }
+    unsigned hardware = std::thread::hardware_concurrency();
+    return hardware > 0 ? hardware : 1;
+}
+
+// Tree passes split into about 8 tasks per thread (one fork level per
+// doubling) and never split a subtree of fewer items than the cutoff.
+const size_t ParallelSerialCutoff = 4096;
+
+inline unsigned parallelSplitDepth(unsigned threads)
+{
+    unsigned depth = 3;
+    while((1u << (depth - 3)) < threads) depth++;
+    return depth;
+}
+
+/**
+* A fixed set of worker threads that run batches of independent tasks.
+* run() deals the tasks round-robin onto one deque per worker, the calling
+* thread included; each worker takes from the back of its own deque and,
+* once that is empty, steals from the front of the others', so uneven
+* tasks even out without a central queue.  The deques are mutex-guarded:
+* tasks here are thousands of node visits each, so the locks never show.
+*
+* One batch runs at a time; concurrent run() calls queue up.  A task may
+* call run() on its own pool (a parallel_for_each whose callback builds an
+* AVLTree, say): the pool is busy with the outer batch, so the nested
+* batch runs inline on that thread.  shared() is a process-wide pool with
+* one thread per hardware thread.
+*/
+class WorkStealingPool
+{
+public:
+    // threads counts the caller of run(), so threads - 1 workers are started
+    explicit WorkStealingPool(unsigned threads = 0);
+    ~WorkStealingPool();
+
+    unsigned threads() const { return (unsigned)queues_.size(); }
+    // Runs every task once and returns when all have finished.  If any
+    // throw, the first exception is rethrown once the rest are done.
+    void run(std::vector<std::function<void()> >& tasks);
+
+    static WorkStealingPool& shared();
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<std::function<void()>*> tasks;
+    };
+
+    bool runOne(size_t self);
+    void runInline(std::vector<std::function<void()> >& tasks);
+    void workerLoop(size_t self);
+    // the pool whose task this thread is running, or NULL
+    static WorkStealingPool*& runningOn();
+    void shutdown();
+
+    std::vector<Queue*> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex runLock_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::atomic<size_t> queued_;
+    std::atomic<size_t> remaining_;
+    bool stopping_;
+    std::exception_ptr error_;
+
+    WorkStealingPool(const WorkStealingPool&);
+    WorkStealingPool& operator=(const WorkStealingPool&);
+};
+
+inline WorkStealingPool::WorkStealingPool(unsigned threads) : queued_(0), remaining_(0), stopping_(false)
+{
+    threads = parallelThreads(threads);
+    for(unsigned t = 0; t < threads; ++t) {
+        queues_.push_back(new Queue);
+    }
+    try {
+        for(unsigned t = 1; t < threads; ++t) {
+            workers_.push_back(std::thread(&WorkStealingPool::workerLoop, this, (size_t)t));
+        }
+    }
+    catch(...) {
+        shutdown();
+        throw;
+    }
+}
+
+inline WorkStealingPool::~WorkStealingPool()
+{
+    shutdown();
+}
+
+inline void WorkStealingPool::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for(size_t w = 0; w < workers_.size(); ++w) workers_[w].join();
+    workers_.clear();
+    for(size_t q = 0; q < queues_.size(); ++q) delete queues_[q];
+    queues_.clear();
+}
+
+inline WorkStealingPool& WorkStealingPool::shared()
+{
+    static WorkStealingPool pool;
+    return pool;
+}
+
+inline WorkStealingPool*& WorkStealingPool::runningOn()
+{
+    static thread_local WorkStealingPool* pool = NULL;
+    return pool;
+}
+
+inline void WorkStealingPool::run(std::vector<std::function<void()> >& tasks)
+{
+    if(tasks.empty()) {
+        return;
+    }
+    if(runningOn() == this) {
+        // queueing behind the batch this task belongs to would never return
+        runInline(tasks);
+        return;
+    }
+    std::lock_guard<std::mutex> batch(runLock_);
+    error_ = std::exception_ptr();
+    remaining_ = tasks.size();
+    {
+        // counted before they are queued, so a worker never takes one uncounted
+        std::lock_guard<std::mutex> guard(mutex_);
+        queued_ = tasks.size();
+    }
+    for(size_t i = 0; i < tasks.size(); ++i) {
+        Queue* queue = queues_[i % queues_.size()];
+        std::lock_guard<std::mutex> guard(queue->lock);
+        queue->tasks.push_back(&tasks[i]);
+    }
+    wake_.notify_all();
+
+    // the caller works too, then waits for tasks still running elsewhere
+    while(runOne(0)) { }
+    std::unique_lock<std::mutex> guard(mutex_);
+    done_.wait(guard, [this] { return remaining_ == 0; });
+    if(error_) {
+        std::exception_ptr error = error_;
+        error_ = std::exception_ptr();
+        std::rethrow_exception(error);
+    }
+}
+
+// Runs one task, self's newest or else the oldest of another worker's;
+// false if every deque was empty.
+inline bool WorkStealingPool::runOne(size_t self)
+{
+    std::function<void()>* task = NULL;
+    for(size_t i = 0; i < queues_.size() && task == NULL; ++i) {
+        Queue* queue = queues_[(self + i) % queues_.size()];
+        std::lock_guard<std::mutex> guard(queue->lock);
+        if(queue->tasks.empty()) continue;
+        if(i == 0) {
+            task = queue->tasks.back();
+            queue->tasks.pop_back();
+        }
+        else {
+            task = queue->tasks.front();
+            queue->tasks.pop_front();
+        }
+    }
+    if(task == NULL) {
+        return false;
+    }
+    queued_--;
+
+    WorkStealingPool* outer = runningOn();
+    runningOn() = this;
+    try {
+        (*task)();
+    }
+    catch(...) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if(!error_) error_ = std::current_exception();
+    }
+    runningOn() = outer;
+    if(--remaining_ == 0) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        done_.notify_all();
+    }
+    return true;
+}
+
+// Runs a nested batch's tasks in order on this thread, with run()'s
+// exception rule.
+inline void WorkStealingPool::runInline(std::vector<std::function<void()> >& tasks)
+{
+    std::exception_ptr error;
+    for(size_t i = 0; i < tasks.size(); ++i) {
+        try {
+            tasks[i]();
+        }
+        catch(...) {
+            if(!error) error = std::current_exception();
+        }
+    }
+    if(error) {
+        std::rethrow_exception(error);
+    }
+}
+
+inline void WorkStealingPool::workerLoop(size_t self)
+{
+    while(true) {
+        while(runOne(self)) { }
+        std::unique_lock<std::mutex> guard(mutex_);
+        wake_.wait(guard, [this] { return stopping_ || queued_ > 0; });
+        if(stopping_) {
+            return;
+        }
+    }
+}
+
+/**
+* Stable sort on pool's threads.  The items are cut into one chunk per
+* thread and the chunks sorted as one batch of tasks; then adjacent
+* sorted runs are merged pairwise, a round's merges to a batch, until one
+* run is left.  std::merge takes from the left run on ties, so equal
+* items keep their input order, as with std::stable_sort.  The merges
+* write into a copy of the input, so T need not be default constructible.
+*/
+template<typename T, typename Compare>
+void parallelStableSort(std::vector<T>& items, WorkStealingPool& pool, Compare less)
+{
+    size_t n = items.size();
+    size_t chunks = std::min((size_t)pool.threads(), std::max((size_t)1, n / 1024));
+    if(chunks <= 1) {
+        std::stable_sort(items.begin(), items.end(), less);
+        return;
+    }
+
+    // bounds[i] is where run i starts; bounds.back() == n
+    std::vector<size_t> bounds;
+    for(size_t c = 0; c <= chunks; ++c) {
+        bounds.push_back(n * c / chunks);
+    }
+    std::vector<std::function<void()> > tasks;
+    for(size_t c = 0; c < chunks; ++c) {
+        tasks.push_back([&items, &bounds, less, c] {
+            std::stable_sort(items.begin() + bounds[c], items.begin() + bounds[c + 1], less);
+        });
+    }
+    pool.run(tasks);
+
+    std::vector<T> buffer(items);
+    std::vector<T>* from = &items;
+    std::vector<T>* to = &buffer;
+    while(bounds.size() > 2) {
+        std::vector<size_t> merged;
+        tasks.clear();
+        for(size_t r = 0; r + 1 < bounds.size(); r += 2) {
+            merged.push_back(bounds[r]);
+            size_t lo = bounds[r];
+            size_t mid = bounds[r + 1];
+            size_t hi = r + 2 < bounds.size() ? bounds[r + 2] : mid;
+            tasks.push_back([from, to, lo, mid, hi, less] {
+                std::merge(from->begin() + lo, from->begin() + mid, from->begin() + mid, from->begin() + hi,
+                           to->begin() + lo, less);
+            });
+        }
+        pool.run(tasks);
+        merged.push_back(n);
+        bounds.swap(merged);
+        std::swap(from, to);
+    }
+    if(from != &items) {
+        items.swap(buffer);
+    }
+}
+
+#endif
@@ -0,0 +1,494 @@
+#ifndef RBBST_H
+#define RBBST_H
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include "bst.h"
+
+/**
+* A node of a red-black tree, which adds the node's color.
+*/
+template <typename Key, typename Value>
+class RBNode : public Node<Key, Value>
+{
+public:
+    // Constructor/destructor.
+    RBNode(const Key& key, const Value& value, RBNode<Key, Value>* parent);
+    virtual ~RBNode();
+
+    // Getter/setter for the node's color.  New nodes are red.
+    bool isRed() const;
+    void setRed(bool red);
+
+    // Getters for parent, left, and right, redefined to return RBNodes.
+    virtual RBNode<Key, Value>* getParent() const override;
+    virtual RBNode<Key, Value>* getLeft() const override;
+    virtual RBNode<Key, Value>* getRight() const override;
+
+    // copies the color too
+    virtual RBNode<Key, Value>* clone(Node<Key, Value>* parent) const override;
+
+protected:
+    bool red_;
+};
+
+/*
+  -------------------------------------------------
+  Begin implementations for the RBNode class.
+  -------------------------------------------------
+*/
+
+template<class Key, class Value>
+RBNode<Key, Value>::RBNode(const Key& key, const Value& value, RBNode<Key, Value> *parent) :
+    Node<Key, Value>(key, value, parent), red_(true)
+{
+
+}
+
+template<class Key, class Value>
+RBNode<Key, Value>::~RBNode()
+{
+
+}
+
+template<class Key, class Value>
+bool RBNode<Key, Value>::isRed() const
+{
+    return red_;
+}
+
+template<class Key, class Value>
+void RBNode<Key, Value>::setRed(bool red)
+{
+    red_ = red;
+}
+
+template<class Key, class Value>
+RBNode<Key, Value>* RBNode<Key, Value>::clone(Node<Key, Value>* parent) const
+{
+    RBNode<Key, Value>* copy = new RBNode<Key, Value>(this->item_.first, this->item_.second,
+                                                      static_cast<RBNode<Key, Value>*>(parent));
+    copy->red_ = red_;
+    return copy;
+}
+
+template<class Key, class Value>
+RBNode<Key, Value> *RBNode<Key, Value>::getParent() const
+{
+    return static_cast<RBNode<Key, Value>*>(this->parent_);
+}
+
+template<class Key, class Value>
+RBNode<Key, Value> *RBNode<Key, Value>::getLeft() const
+{
+    return static_cast<RBNode<Key, Value>*>(this->childOf(this->left_));
+}
+
+template<class Key, class Value>
+RBNode<Key, Value> *RBNode<Key, Value>::getRight() const
+{
+    return static_cast<RBNode<Key, Value>*>(this->childOf(this->right_));
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the RBNode class.
+  -----------------------------------------------
+*/
+
+/**
+* A red-black tree.  Every update does at most two rotations for an insert
+* and three for a remove; the rest of the fix-up is recoloring.  The height
+* bound (2 log n) is looser than AVLTree's (1.44 log n), so lookups may
+* descend a little further in exchange for cheaper writes.
+*/
+template <class Key, class Value>
+class RedBlackTree : public BinarySearchTree<Key, Value>
+{
+public:
+    virtual void insert(const std::pair<const Key, Value> &new_item);
+    virtual void remove(const Key& key);
+    // the plain unlink would break the coloring
+    typename BinarySearchTree<Key, Value>::node_type extract(const Key& key) = delete;
+
+    // checks ordering, parent links, a black root, no red node with a red
+    // child and equal black heights; prints the first violation to std::cerr
+    bool checkInvariants() const;
+
+protected:
+    virtual bool balancesItself() const { return true; }
+    virtual void nodeSwap(RBNode<Key,Value>* n1, RBNode<Key,Value>* n2);
+
+    RBNode<Key, Value>* internalFind(const Key& key) const;
+    void insertFix(RBNode<Key, Value>* node);
+    void removeFix(RBNode<Key, Value>* node, RBNode<Key, Value>* parent);
+    void rotateLeft(RBNode<Key, Value>* node);
+    void rotateRight(RBNode<Key, Value>* node);
+    static bool isRed(RBNode<Key, Value>* node);
+    int blackHeight(RBNode<Key, Value>* node, const Key* lo, const Key* hi) const;
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the RedBlackTree class.
+  -----------------------------------------------
+*/
+
+/**
+* NULL children count as black.
+*/
+template<class Key, class Value>
+bool RedBlackTree<Key, Value>::isRed(RBNode<Key, Value>* node)
+{
+    return node != NULL && node->isRed();
+}
+
+template<class Key, class Value>
+RBNode<Key, Value>* RedBlackTree<Key, Value>::internalFind(const Key& key) const
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    if(this->sampler_ != NULL) this->sampleAccess(key);
+
+    RBNode<Key, Value>* current = static_cast<RBNode<Key, Value>*>(this->root_);
+    while(current != NULL) {
+        if(key < current->getKey()) {
+            current = current->getLeft();
+        }
+        else if(current->getKey() < key) {
+            current = current->getRight();
+        }
+        else {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+/**
+* If key is already in the tree, overwrites the value.  Otherwise adds a
+* red leaf and repairs any red-red violation above it.
+*/
+template<class Key, class Value>
+void RedBlackTree<Key, Value>::insert(const std::pair<const Key, Value> &new_item)
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    if(this->recorder_ != NULL) this->recorder_->record(TRACE_INSERT, new_item.first);
+
+    RBNode<Key, Value>* parent = NULL;
+    RBNode<Key, Value>* current = static_cast<RBNode<Key, Value>*>(this->root_);
+    while(current != NULL) {
+        parent = current;
+        if(new_item.first < current->getKey()) {
+            current = current->getLeft();
+        }
+        else if(current->getKey() < new_item.first) {
+            current = current->getRight();
+        }
+        else {
+            current->setValue(new_item.second);
+            return;
+        }
+    }
+
+    RBNode<Key, Value>* node;
+    {
+        BST_PROFILE_PHASE(BST_PHASE_ALLOCATION);
+        node = new RBNode<Key, Value>(new_item.first, new_item.second, parent);
+    }
+    if(parent == NULL) {
+        this->root_ = node;
+    }
+    else if(new_item.first < parent->getKey()) {
+        parent->setLeft(node);
+    }
+    else {
+        parent->setRight(node);
+    }
+    insertFix(node);
+}
+
+/**
+* Walks up recoloring while both the parent and uncle are red; once the
+* uncle is black, one or two rotations finish the repair.
+*/
+template<class Key, class Value>
+void RedBlackTree<Key, Value>::insertFix(RBNode<Key, Value>* node)
+{
+    BST_PROFILE_PHASE(BST_PHASE_REBALANCE);
+
+    while(isRed(node->getParent())) {
+        RBNode<Key, Value>* parent = node->getParent();
+        RBNode<Key, Value>* grandparent = parent->getParent();   // exists: the root is black
+
+        if(parent == grandparent->getLeft()) {
+            RBNode<Key, Value>* uncle = grandparent->getRight();
+            if(isRed(uncle)) {
+                parent->setRed(false);
+                uncle->setRed(false);
+                grandparent->setRed(true);
+                node = grandparent;
+                continue;
+            }
+            // zig-zag -> rotateLeft(p) makes it zig-zig
+            if(node == parent->getRight()) {
+                rotateLeft(parent);
+                parent = node;
+            }
+            rotateRight(grandparent);
+            parent->setRed(false);
+            grandparent->setRed(true);
+            break;
+        }
+        else {
+            RBNode<Key, Value>* uncle = grandparent->getLeft();
+            if(isRed(uncle)) {
+                parent->setRed(false);
+                uncle->setRed(false);
+                grandparent->setRed(true);
+                node = grandparent;
+                continue;
+            }
+            if(node == parent->getLeft()) {
+                rotateRight(parent);
+                parent = node;
+            }
+            rotateLeft(grandparent);
+            parent->setRed(false);
+            grandparent->setRed(true);
+            break;
+        }
+    }
+    static_cast<RBNode<Key, Value>*>(this->root_)->setRed(false);
+}
+
+/**
+* A node with two children is first swapped with its predecessor, as in
+* AVLTree, so the node removed has at most one child.  Removing a black
+* node leaves its side one black short, which removeFix repairs.
+*/
+template<class Key, class Value>
+void RedBlackTree<Key, Value>::remove(const Key& key)
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    if(this->recorder_ != NULL) this->recorder_->record(TRACE_REMOVE, key);
+
+    RBNode<Key, Value>* node = internalFind(key);
+    if(node == NULL) {
+        return;
+    }
+    if(node->getLeft() != NULL && node->getRight() != NULL) {
+        RBNode<Key, Value>* pred = static_cast<RBNode<Key, Value>*>(this->predecessor(node));
+        nodeSwap(node, pred);
+    }
+
+    RBNode<Key, Value>* child = node->getLeft() != NULL ? node->getLeft() : node->getRight();
+    RBNode<Key, Value>* parent = node->getParent();
+    if(child != NULL) {
+        child->setParent(parent);
+    }
+    if(parent == NULL) {
+        this->root_ = child;
+    }
+    else if(node == parent->getLeft()) {
+        parent->setLeft(child);
+    }
+    else {
+        parent->setRight(child);
+    }
+
+    if(!node->isRed()) {
+        // a red child takes the removed node's black; otherwise fix up
+        if(isRed(child)) child->setRed(false);
+        else removeFix(child, parent);
+    }
+
+    BST_PROFILE_PHASE(BST_PHASE_ALLOCATION);
+    delete node;
+}
+
+/**
+* node (possibly NULL, below parent) is one black short.  Recolors upward
+* while the sibling and its children are black; any other case ends after
+* at most two rotations.
+*/
+template<class Key, class Value>
+void RedBlackTree<Key, Value>::removeFix(RBNode<Key, Value>* node, RBNode<Key, Value>* parent)
+{
+    BST_PROFILE_PHASE(BST_PHASE_REBALANCE);
+
+    while(node != this->root_ && !isRed(node)) {
+        if(node == parent->getLeft()) {
+            RBNode<Key, Value>* sibling = parent->getRight();
+            if(isRed(sibling)) {
+                sibling->setRed(false);
+                parent->setRed(true);
+                rotateLeft(parent);
+                sibling = parent->getRight();
+            }
+            if(!isRed(sibling->getLeft()) && !isRed(sibling->getRight())) {
+                sibling->setRed(true);
+                node = parent;
+                parent = node->getParent();
+                continue;
+            }
+            if(!isRed(sibling->getRight())) {
+                sibling->getLeft()->setRed(false);
+                sibling->setRed(true);
+                rotateRight(sibling);
+                sibling = parent->getRight();
+            }
+            sibling->setRed(parent->isRed());
+            parent->setRed(false);
+            sibling->getRight()->setRed(false);
+            rotateLeft(parent);
+            node = static_cast<RBNode<Key, Value>*>(this->root_);
+        }
+        else {
+            RBNode<Key, Value>* sibling = parent->getLeft();
+            if(isRed(sibling)) {
+                sibling->setRed(false);
+                parent->setRed(true);
+                rotateRight(parent);
+                sibling = parent->getLeft();
+            }
+            if(!isRed(sibling->getLeft()) && !isRed(sibling->getRight())) {
+                sibling->setRed(true);
+                node = parent;
+                parent = node->getParent();
+                continue;
+            }
+            if(!isRed(sibling->getLeft())) {
+                sibling->getRight()->setRed(false);
+                sibling->setRed(true);
+                rotateLeft(sibling);
+                sibling = parent->getLeft();
+            }
+            sibling->setRed(parent->isRed());
+            parent->setRed(false);
+            sibling->getLeft()->setRed(false);
+            rotateRight(parent);
+            node = static_cast<RBNode<Key, Value>*>(this->root_);
+        }
+    }
+    if(node != NULL) node->setRed(false);
+}
+
+template<class Key, class Value>
+void RedBlackTree<Key, Value>::rotateLeft(RBNode<Key, Value>* node)
+{
+    RBNode<Key, Value>* child = node->getRight();
+    RBNode<Key, Value>* parent = node->getParent();
+
+    if(node == this->root_) {
+        this->root_ = child;
+    }
+
+    if(child->getLeft() != NULL) {
+        child->getLeft()->setParent(node);
+    }
+    node->setRight(child->getLeft());
+    child->setLeft(node);
+    node->setParent(child);
+    child->setParent(parent);
+    if(parent != NULL) {
+        if(node == parent->getLeft()) parent->setLeft(child);
+        else parent->setRight(child);
+    }
+}
+
+template<class Key, class Value>
+void RedBlackTree<Key, Value>::rotateRight(RBNode<Key, Value>* node)
+{
+    RBNode<Key, Value>* child = node->getLeft();
+    RBNode<Key, Value>* parent = node->getParent();
+
+    if(node == this->root_) {
+        this->root_ = child;
+    }
+
+    if(child->getRight() != NULL) {
+        child->getRight()->setParent(node);
+    }
+    node->setLeft(child->getRight());
+    child->setRight(node);
+    node->setParent(child);
+    child->setParent(parent);
+    if(parent != NULL) {
+        if(node == parent->getLeft()) parent->setLeft(child);
+        else parent->setRight(child);
+    }
+}
+
+/**
+* Swaps the nodes' positions, and their colors so each position keeps its
+* color.
+*/
+template<class Key, class Value>
+void RedBlackTree<Key, Value>::nodeSwap(RBNode<Key,Value>* n1, RBNode<Key,Value>* n2)
+{
+    BST_PROFILE_PHASE(BST_PHASE_REBALANCE);
+    BinarySearchTree<Key, Value>::nodeSwap(n1, n2);
+    bool tempRed = n1->isRed();
+    n1->setRed(n2->isRed());
+    n2->setRed(tempRed);
+}
+
+template<class Key, class Value>
+bool RedBlackTree<Key, Value>::checkInvariants() const
+{
+    RBNode<Key, Value>* root = static_cast<RBNode<Key, Value>*>(this->root_);
+    if(root != NULL && root->getParent() != NULL) {
+        std::cerr << "red-black: root has a parent" << std::endl;
+        return false;
+    }
+    if(isRed(root)) {
+        std::cerr << "red-black: root is red" << std::endl;
+        return false;
+    }
+    return blackHeight(root, NULL, NULL) >= 0;
+}
+
+/**
+* Returns the black height of the subtree, or -1 if it breaks an invariant.
+* Keys must lie strictly between lo and hi when those are given.
+*/
+template<class Key, class Value>
+int RedBlackTree<Key, Value>::blackHeight(RBNode<Key, Value>* node, const Key* lo, const Key* hi) const
+{
+    if(node == NULL) {
+        return 0;
+    }
+    if((lo != NULL && !(*lo < node->getKey())) || (hi != NULL && !(node->getKey() < *hi))) {
+        std::cerr << "red-black: key " << node->getKey() << " out of order" << std::endl;
+        return -1;
+    }
+    if((node->getLeft() != NULL && node->getLeft()->getParent() != node) ||
+       (node->getRight() != NULL && node->getRight()->getParent() != node)) {
+        std::cerr << "red-black: bad parent link below " << node->getKey() << std::endl;
+        return -1;
+    }
+    if(node->isRed() && (isRed(node->getLeft()) || isRed(node->getRight()))) {
+        std::cerr << "red-black: red node " << node->getKey() << " has a red child" << std::endl;
+        return -1;
+    }
+
+    int left = blackHeight(node->getLeft(), lo, &node->getKey());
+    int right = blackHeight(node->getRight(), &node->getKey(), hi);
+    if(left < 0 || right < 0) {
+        return -1;
+    }
+    if(left != right) {
+        std::cerr << "red-black: black heights differ below " << node->getKey() << std::endl;
+        return -1;
+    }
+    return left + (node->isRed() ? 0 : 1);
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the RedBlackTree class.
+  -----------------------------------------------
+*/
+
+#endif
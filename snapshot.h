@@ -0,0 +1,403 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Binary snapshots of a sorted map (see AVLTree::save()/load() and
+// MappedSnapshot).
+//
+// Layout, in native byte order:
+//   header (SnapshotHeader, 64 bytes)
+//   count records in key order: u32 key length, key bytes, u32 value length,
+//     value bytes
+//   if the records are not fixed size: count u64 record offsets
+// The checksum covers everything after the header.  When both key and value
+// serialize to a fixed size the records have a fixed stride and no offset
+// table is written, so a mapped snapshot can binary search them directly.
+
+/**
+* Converts keys and values to and from bytes.  Trivially copyable types are
+* stored as their raw bytes and std::string as its characters; specialize
+* this template to snapshot other types.
+*/
+template<typename T, typename Enable = void>
+struct SnapshotSerializer;
+
+template<typename T>
+struct SnapshotSerializer<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type>
+{
+    static const bool fixedSize = true;
+    static size_t size(const T&) { return sizeof(T); }
+    static void write(const T& value, uint8_t* out) { std::memcpy(out, &value, sizeof(T)); }
+    static T read(const uint8_t* in, size_t len)
+    {
+        if(len != sizeof(T)) throw std::runtime_error("snapshot: field size mismatch");
+        T value;
+        std::memcpy(&value, in, sizeof(T));
+        return value;
+    }
+};
+
+template<>
+struct SnapshotSerializer<std::string>
+{
+    static const bool fixedSize = false;
+    static size_t size(const std::string& value) { return value.size(); }
+    static void write(const std::string& value, uint8_t* out) { std::memcpy(out, value.data(), value.size()); }
+    static std::string read(const uint8_t* in, size_t len) { return std::string((const char*)in, len); }
+};
+
+static const char snapshotMagic[8] = { 'B', 'S', 'T', 'S', 'N', 'A', 'P', '1' };
+
+enum SnapshotFlags
+{
+    SNAPSHOT_FIXED_STRIDE = 1
+};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t count;
+    uint64_t stride;          // record size when SNAPSHOT_FIXED_STRIDE is set
+    uint64_t indexOffset;     // offset table position, 0 with a fixed stride
+    uint64_t fileSize;
+    uint64_t checksum;
+    uint64_t reserved;
+};
+
+/**
+* Word-at-a-time checksum.  Data is fed in chunks whose lengths are
+* multiples of 8, except the last, which is zero padded.
+*/
+inline uint64_t snapshotChecksum(uint64_t h, const uint8_t* data, size_t len)
+{
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, data + i, 8);
+        h ^= w;
+        h *= 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    if(i < len) {
+        uint64_t w = 0;
+        std::memcpy(&w, data + i, len - i);
+        h ^= w;
+        h *= 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/**
+* Writes a snapshot to path + ".tmp" and renames it over path on commit(),
+* so a crash never leaves a half-written snapshot under the final name.
+*/
+class SnapshotWriter
+{
+public:
+    SnapshotWriter(const std::string& path, bool fixedStride);
+    ~SnapshotWriter();
+
+    template<typename Key, typename Value>
+    void append(const Key& key, const Value& value);
+
+    // writes the offset table and header, syncs and renames into place
+    void commit();
+
+private:
+    SnapshotWriter(const SnapshotWriter&);
+    SnapshotWriter& operator=(const SnapshotWriter&);
+
+    void put(const void* data, size_t len);
+    void flushBuffer();
+
+    std::string path_;
+    std::string tmpPath_;
+    FILE* file_;
+    bool fixedStride_;
+    bool committed_;
+    uint64_t count_;
+    uint64_t stride_;
+    uint64_t offset_;     // file offset of the next byte to write
+    uint64_t checksum_;
+    std::vector<uint64_t> offsets_;
+    std::vector<uint8_t> buf_;
+    std::vector<uint8_t> record_;
+};
+
+inline SnapshotWriter::SnapshotWriter(const std::string& path, bool fixedStride) :
+    path_(path), tmpPath_(path + ".tmp"), fixedStride_(fixedStride), committed_(false),
+    count_(0), stride_(0), offset_(sizeof(SnapshotHeader)), checksum_(0)
+{
+    file_ = std::fopen(tmpPath_.c_str(), "wb");
+    if(file_ == NULL) {
+        throw std::runtime_error("snapshot: cannot create " + tmpPath_);
+    }
+    SnapshotHeader blank;
+    std::memset(&blank, 0, sizeof(blank));
+    std::fwrite(&blank, sizeof(blank), 1, file_);
+    buf_.reserve(1 << 20);
+}
+
+inline SnapshotWriter::~SnapshotWriter()
+{
+    if(file_ != NULL) std::fclose(file_);
+    if(!committed_) std::remove(tmpPath_.c_str());
+}
+
+inline void SnapshotWriter::flushBuffer()
+{
+    checksum_ = snapshotChecksum(checksum_, buf_.data(), buf_.size());
+    if(!buf_.empty() && std::fwrite(buf_.data(), 1, buf_.size(), file_) != buf_.size()) {
+        throw std::runtime_error("snapshot: write to " + tmpPath_ + " failed");
+    }
+    buf_.clear();
+}
+
+inline void SnapshotWriter::put(const void* data, size_t len)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    buf_.insert(buf_.end(), bytes, bytes + len);
+    offset_ += len;
+    // flush whole words only so the checksum chunks stay aligned
+    if(buf_.size() >= (1 << 20)) {
+        size_t whole = buf_.size() & ~(size_t)7;
+        uint8_t tail[8];
+        size_t tailLen = buf_.size() - whole;
+        std::memcpy(tail, &buf_[whole], tailLen);
+        buf_.resize(whole);
+        flushBuffer();
+        buf_.insert(buf_.end(), tail, tail + tailLen);
+    }
+}
+
+template<typename Key, typename Value>
+void SnapshotWriter::append(const Key& key, const Value& value)
+{
+    uint32_t keyLen = (uint32_t)SnapshotSerializer<Key>::size(key);
+    uint32_t valueLen = (uint32_t)SnapshotSerializer<Value>::size(value);
+
+    if(!fixedStride_) offsets_.push_back(offset_);
+    stride_ = 8 + (uint64_t)keyLen + valueLen;
+
+    record_.resize(stride_);
+    std::memcpy(&record_[0], &keyLen, 4);
+    SnapshotSerializer<Key>::write(key, &record_[4]);
+    std::memcpy(&record_[4 + keyLen], &valueLen, 4);
+    SnapshotSerializer<Value>::write(value, &record_[8 + keyLen]);
+    put(record_.data(), record_.size());
+    count_++;
+}
+
+inline void SnapshotWriter::commit()
+{
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.version = 1;
+    header.count = count_;
+    if(fixedStride_) {
+        header.flags = SNAPSHOT_FIXED_STRIDE;
+        header.stride = count_ > 0 ? stride_ : 0;
+    }
+    else {
+        header.indexOffset = offset_;
+        for(size_t i = 0; i < offsets_.size(); ++i) {
+            put(&offsets_[i], sizeof(uint64_t));
+        }
+    }
+    flushBuffer();
+    header.fileSize = offset_;
+    header.checksum = checksum_;
+
+    if(std::fseek(file_, 0, SEEK_SET) != 0 ||
+       std::fwrite(&header, sizeof(header), 1, file_) != 1 ||
+       std::fflush(file_) != 0 || fsync(fileno(file_)) != 0) {
+        throw std::runtime_error("snapshot: cannot finish " + tmpPath_);
+    }
+    std::fclose(file_);
+    file_ = NULL;
+    if(std::rename(tmpPath_.c_str(), path_.c_str()) != 0) {
+        throw std::runtime_error("snapshot: cannot rename " + tmpPath_);
+    }
+    committed_ = true;
+}
+
+/**
+* A read-only memory mapping of a whole file.
+*/
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const uint8_t* data_;
+    size_t size_;
+};
+
+inline MappedFile::MappedFile(const std::string& path) : data_(NULL), size_(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw std::runtime_error("snapshot: cannot open " + path);
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("snapshot: cannot stat " + path);
+    }
+    size_ = (size_t)st.st_size;
+    if(size_ > 0) {
+        void* p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error("snapshot: cannot map " + path);
+        }
+        data_ = static_cast<const uint8_t*>(p);
+    }
+    close(fd);
+}
+
+inline MappedFile::~MappedFile()
+{
+    if(data_ != NULL) munmap(const_cast<uint8_t*>(data_), size_);
+}
+
+/**
+* A snapshot file queried in place: lookups binary search the mapped
+* records and decode only the keys they touch, so opening it costs nothing
+* beyond the optional checksum pass.  Keys need operator<.
+*/
+template<typename Key, typename Value>
+class MappedSnapshot
+{
+public:
+    // maps path; with verify, checks the checksum first (reads the whole file)
+    explicit MappedSnapshot(const std::string& path, bool verify = true);
+
+    size_t size() const { return (size_t)header_.count; }
+
+    Key keyAt(size_t i) const;
+    Value valueAt(size_t i) const;
+
+    // index of the first key not less than key, or size()
+    size_t lowerBound(const Key& key) const;
+
+    // copies the value of key into value; returns false if absent
+    bool find(const Key& key, Value& value) const;
+
+    const SnapshotHeader& header() const { return header_; }
+
+private:
+    const uint8_t* record(size_t i) const;
+
+    MappedFile file_;
+    SnapshotHeader header_;
+};
+
+/**
+* Checks the header of a mapped snapshot and, with verify, its checksum.
+*/
+inline SnapshotHeader readSnapshotHeader(const MappedFile& file, bool verify)
+{
+    SnapshotHeader header;
+    if(file.size() < sizeof(header)) {
+        throw std::runtime_error("snapshot: file too short");
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if(std::memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) != 0 || header.version != 1) {
+        throw std::runtime_error("snapshot: not a snapshot file");
+    }
+    if(header.fileSize != file.size()) {
+        throw std::runtime_error("snapshot: file size mismatch (truncated?)");
+    }
+    if(verify) {
+        uint64_t sum = snapshotChecksum(0, file.data() + sizeof(header), file.size() - sizeof(header));
+        if(sum != header.checksum) {
+            throw std::runtime_error("snapshot: checksum mismatch");
+        }
+    }
+    return header;
+}
+
+template<typename Key, typename Value>
+MappedSnapshot<Key, Value>::MappedSnapshot(const std::string& path, bool verify) : file_(path)
+{
+    header_ = readSnapshotHeader(file_, verify);
+}
+
+template<typename Key, typename Value>
+const uint8_t* MappedSnapshot<Key, Value>::record(size_t i) const
+{
+    if(header_.flags & SNAPSHOT_FIXED_STRIDE) {
+        return file_.data() + sizeof(SnapshotHeader) + i * header_.stride;
+    }
+    uint64_t offset;
+    std::memcpy(&offset, file_.data() + header_.indexOffset + i * sizeof(uint64_t), sizeof(offset));
+    return file_.data() + offset;
+}
+
+template<typename Key, typename Value>
+Key MappedSnapshot<Key, Value>::keyAt(size_t i) const
+{
+    const uint8_t* r = record(i);
+    uint32_t keyLen;
+    std::memcpy(&keyLen, r, 4);
+    return SnapshotSerializer<Key>::read(r + 4, keyLen);
+}
+
+template<typename Key, typename Value>
+Value MappedSnapshot<Key, Value>::valueAt(size_t i) const
+{
+    const uint8_t* r = record(i);
+    uint32_t keyLen, valueLen;
+    std::memcpy(&keyLen, r, 4);
+    std::memcpy(&valueLen, r + 4 + keyLen, 4);
+    return SnapshotSerializer<Value>::read(r + 8 + keyLen, valueLen);
+}
+
+template<typename Key, typename Value>
+size_t MappedSnapshot<Key, Value>::lowerBound(const Key& key) const
+{
+    size_t lo = 0, hi = size();
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(keyAt(mid) < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+template<typename Key, typename Value>
+bool MappedSnapshot<Key, Value>::find(const Key& key, Value& value) const
+{
+    size_t i = lowerBound(key);
+    if(i == size() || key < keyAt(i)) {
+        return false;
+    }
+    value = valueAt(i);
+    return true;
+}
+
+#endif
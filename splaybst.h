@@ -0,0 +1,296 @@
+#ifndef SPLAYBST_H
+#define SPLAYBST_H
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include <stdexcept>
+#include "bst.h"
+
+enum SplayMode
+{
+    SPLAY_FULL,     // move the accessed node all the way to the root
+    SPLAY_SEMI      // semi-splaying: zig-zig steps rotate only the parent
+};
+
+/**
+* A self-adjusting binary search tree.  find, insert, remove and operator[]
+* splay the node they reach to the root, so recently and frequently used
+* keys stay near the top; every operation is O(log n) amortized.
+*
+* Splaying restructures the tree on reads.  The const overloads of find
+* and operator[], and peek(), leave the tree untouched, so readers sharing
+* a tree with no writer can use them concurrently.
+*/
+template <class Key, class Value>
+class SplayTree : public BinarySearchTree<Key, Value>
+{
+public:
+    explicit SplayTree(SplayMode mode = SPLAY_FULL);
+
+    virtual void insert(const std::pair<const Key, Value> &new_item);
+    virtual void remove(const Key& key);
+
+    typedef typename BinarySearchTree<Key, Value>::iterator iterator;
+    iterator find(const Key& key);
+    iterator find(const Key& key) const;
+    iterator peek(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+    SplayMode mode() const { return mode_; }
+    // rotations performed so far, for measuring the amortized cost
+    uint64_t rotationCount() const { return rotations_; }
+
+protected:
+    Node<Key, Value>* descend(const Key& key, Node<Key, Value>*& last) const;
+    void rotateUp(Node<Key, Value>* node);
+    void splay(Node<Key, Value>* node);
+
+    SplayMode mode_;
+    uint64_t rotations_;
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the SplayTree class.
+  -----------------------------------------------
+*/
+
+template<class Key, class Value>
+SplayTree<Key, Value>::SplayTree(SplayMode mode) : mode_(mode), rotations_(0)
+{
+
+}
+
+/**
+* Returns the node with key, or NULL; last is set to the final node
+* visited either way, which is what a miss splays.  Every lookup, insert
+* and remove comes through here, so this is where access sampling counts.
+*/
+template<class Key, class Value>
+Node<Key, Value>* SplayTree<Key, Value>::descend(const Key& key, Node<Key, Value>*& last) const
+{
+    BST_PROFILE_PHASE(BST_PHASE_DESCENT);
+    if(this->sampler_ != NULL) this->sampleAccess(key);
+
+    last = NULL;
+    Node<Key, Value>* current = this->root_;
+    while(current != NULL) {
+        last = current;
+        if(key < current->getKey()) {
+            current = current->getLeft();
+        }
+        else if(current->getKey() < key) {
+            current = current->getRight();
+        }
+        else {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+/**
+* Rotates node above its parent.
+*/
+template<class Key, class Value>
+void SplayTree<Key, Value>::rotateUp(Node<Key, Value>* node)
+{
+    Node<Key, Value>* parent = node->getParent();
+    Node<Key, Value>* grandparent = parent->getParent();
+
+    if(node == parent->getLeft()) {
+        parent->setLeft(node->getRight());
+        if(node->getRight() != NULL) node->getRight()->setParent(parent);
+        node->setRight(parent);
+    }
+    else {
+        parent->setRight(node->getLeft());
+        if(node->getLeft() != NULL) node->getLeft()->setParent(parent);
+        node->setLeft(parent);
+    }
+    parent->setParent(node);
+    node->setParent(grandparent);
+
+    if(grandparent == NULL) {
+        this->root_ = node;
+    }
+    else if(grandparent->getLeft() == parent) {
+        grandparent->setLeft(node);
+    }
+    else {
+        grandparent->setRight(node);
+    }
+    rotations_++;
+}
+
+/**
+* Bottom-up splay.  In semi-splay mode a zig-zig step rotates only the
+* parent and continues from it, which roughly halves the depth of the
+* access path at half the rotations.
+*/
+template<class Key, class Value>
+void SplayTree<Key, Value>::splay(Node<Key, Value>* node)
+{
+    BST_PROFILE_PHASE(BST_PHASE_REBALANCE);
+
+    while(node != NULL && node->getParent() != NULL) {
+        Node<Key, Value>* parent = node->getParent();
+        Node<Key, Value>* grandparent = parent->getParent();
+
+        if(grandparent == NULL) {
+            // zig
+            rotateUp(node);
+        }
+        else if((node == parent->getLeft()) == (parent == grandparent->getLeft())) {
+            // zig-zig
+            rotateUp(parent);
+            if(mode_ == SPLAY_SEMI) node = parent;
+            else rotateUp(node);
+        }
+        else {
+            // zig-zag
+            rotateUp(node);
+            rotateUp(node);
+        }
+    }
+}
+
+/**
+* If key is already in the tree, overwrites its value.  Either way the
+* node ends up at the root.
+*/
+template<class Key, class Value>
+void SplayTree<Key, Value>::insert(const std::pair<const Key, Value> &new_item)
+{
+    if(this->recorder_ != NULL) this->recorder_->record(TRACE_INSERT, new_item.first);
+
+    Node<Key, Value>* parent;
+    Node<Key, Value>* node = descend(new_item.first, parent);
+    if(node != NULL) {
+        node->setValue(new_item.second);
+    }
+    else {
+        {
+            BST_PROFILE_PHASE(BST_PHASE_ALLOCATION);
+            node = new Node<Key, Value>(new_item.first, new_item.second, parent);
+        }
+        if(parent == NULL) {
+            this->root_ = node;
+        }
+        else if(new_item.first < parent->getKey()) {
+            parent->setLeft(node);
+        }
+        else {
+            parent->setRight(node);
+        }
+    }
+    splay(node);
+}
+
+/**
+* Splays the node up, then replaces it with the join of its subtrees: the
+* largest key of the left subtree takes its place.  A full splay leaves the
+* node at the root; a semi-splay may stop short, so the splice works at any
+* position.  A miss splays the last node visited.
+*/
+template<class Key, class Value>
+void SplayTree<Key, Value>::remove(const Key& key)
+{
+    if(this->recorder_ != NULL) this->recorder_->record(TRACE_REMOVE, key);
+
+    Node<Key, Value>* last;
+    Node<Key, Value>* node = descend(key, last);
+    if(node == NULL) {
+        splay(last);
+        return;
+    }
+    splay(node);
+
+    Node<Key, Value>* left = node->getLeft();
+    Node<Key, Value>* right = node->getRight();
+    Node<Key, Value>* parent = node->getParent();
+    Node<Key, Value>* joined = right;
+    if(left != NULL) {
+        joined = left;
+        while(joined->getRight() != NULL) {
+            joined = joined->getRight();
+        }
+        if(joined != left) {
+            // unhook the maximum, then give it both of node's subtrees
+            joined->getParent()->setRight(joined->getLeft());
+            if(joined->getLeft() != NULL) joined->getLeft()->setParent(joined->getParent());
+            joined->setLeft(left);
+            left->setParent(joined);
+        }
+        joined->setRight(right);
+        if(right != NULL) right->setParent(joined);
+    }
+
+    if(joined != NULL) joined->setParent(parent);
+    if(parent == NULL) {
+        this->root_ = joined;
+    }
+    else if(parent->getLeft() == node) {
+        parent->setLeft(joined);
+    }
+    else {
+        parent->setRight(joined);
+    }
+
+    BST_PROFILE_PHASE(BST_PHASE_ALLOCATION);
+    delete node;
+}
+
+template<class Key, class Value>
+typename SplayTree<Key, Value>::iterator SplayTree<Key, Value>::find(const Key& key)
+{
+    if(this->recorder_ != NULL) this->recorder_->record(TRACE_FIND, key);
+    Node<Key, Value>* last;
+    Node<Key, Value>* node = descend(key, last);
+    splay(node != NULL ? node : last);
+    return this->makeIterator(node);
+}
+
+/**
+* Read-only lookups do not splay.
+*/
+template<class Key, class Value>
+typename SplayTree<Key, Value>::iterator SplayTree<Key, Value>::find(const Key& key) const
+{
+    return peek(key);
+}
+
+template<class Key, class Value>
+typename SplayTree<Key, Value>::iterator SplayTree<Key, Value>::peek(const Key& key) const
+{
+    if(this->recorder_ != NULL) this->recorder_->record(TRACE_FIND, key);
+    Node<Key, Value>* last;
+    return this->makeIterator(descend(key, last));
+}
+
+template<class Key, class Value>
+Value& SplayTree<Key, Value>::operator[](const Key& key)
+{
+    if(this->recorder_ != NULL) this->recorder_->record(TRACE_INDEX, key);
+    Node<Key, Value>* last;
+    Node<Key, Value>* node = descend(key, last);
+    splay(node != NULL ? node : last);
+    if(node == NULL) throw std::out_of_range("Invalid key");
+    return node->getValue();
+}
+
+template<class Key, class Value>
+Value const & SplayTree<Key, Value>::operator[](const Key& key) const
+{
+    return BinarySearchTree<Key, Value>::operator[](key);
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the SplayTree class.
+  -----------------------------------------------
+*/
+
+#endif
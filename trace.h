@@ -0,0 +1,301 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+// Operation traces for the search trees.  Attach a TraceRecorder to a tree
+// with setTraceRecorder() and every insert/remove/find/operator[]/begin()
+// on it is appended to a compact binary file, which tree-replay can run
+// against any engine:
+//
+//     TraceRecorder<uint64_t> recorder("ops.trace");
+//     tree.setTraceRecorder(&recorder);
+//
+// File layout: the 8-byte magic "BSTTRC1\0", a key-kind byte and a key-size
+// byte, then one record per operation: an op byte followed by the key.
+// Integer keys are stored as zigzag varints of the difference from the
+// previous key, strings as a varint length plus bytes, other trivially
+// copyable keys as their raw bytes, which must be under 256 of them.
+
+enum TraceOp
+{
+    TRACE_INSERT = 1,
+    TRACE_REMOVE = 2,
+    TRACE_FIND = 3,
+    TRACE_INDEX = 4,    // operator[]
+    TRACE_SCAN = 5      // begin(), i.e. the start of an in-order scan; no key
+};
+
+enum TraceKeyKind
+{
+    TRACE_KEY_NONE = 0,     // key type cannot be traced
+    TRACE_KEY_UINT = 1,
+    TRACE_KEY_SINT = 2,
+    TRACE_KEY_BYTES = 3,
+    TRACE_KEY_RAW = 4
+};
+
+static const char traceMagic[8] = { 'B', 'S', 'T', 'T', 'R', 'C', '1', '\0' };
+
+/**
+* Buffered writer for trace files.
+*/
+class TraceWriter
+{
+public:
+    explicit TraceWriter(const std::string& path);
+    ~TraceWriter();
+
+    void putByte(uint8_t b)
+    {
+        if(used_ == sizeof(buf_)) flush();
+        buf_[used_++] = b;
+    }
+
+    void putVarint(uint64_t v)
+    {
+        if(used_ + 10 > sizeof(buf_)) flush();
+        while(v >= 0x80) {
+            buf_[used_++] = (uint8_t)(v | 0x80);
+            v >>= 7;
+        }
+        buf_[used_++] = (uint8_t)v;
+    }
+
+    void putBytes(const void* data, size_t len);
+    // throws std::runtime_error if the file cannot be written
+    void flush();
+
+private:
+    TraceWriter(const TraceWriter&);
+    TraceWriter& operator=(const TraceWriter&);
+
+    FILE* file_;
+    uint8_t buf_[1 << 16];
+    size_t used_;
+};
+
+inline TraceWriter::TraceWriter(const std::string& path) : used_(0)
+{
+    file_ = std::fopen(path.c_str(), "wb");
+    if(file_ == NULL) {
+        throw std::runtime_error("trace: cannot open " + path);
+    }
+}
+
+// A write error here has nowhere to go; call flush() first to see it.
+inline TraceWriter::~TraceWriter()
+{
+    try {
+        flush();
+    }
+    catch(const std::runtime_error&) {
+    }
+    std::fclose(file_);
+}
+
+inline void TraceWriter::putBytes(const void* data, size_t len)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    while(len > 0) {
+        if(used_ == sizeof(buf_)) flush();
+        size_t chunk = std::min(len, sizeof(buf_) - used_);
+        std::memcpy(buf_ + used_, bytes, chunk);
+        used_ += chunk;
+        bytes += chunk;
+        len -= chunk;
+    }
+}
+
+inline void TraceWriter::flush()
+{
+    size_t len = used_;
+    used_ = 0;
+    if(std::fwrite(buf_, 1, len, file_) != len || std::fflush(file_) != 0) {
+        throw std::runtime_error("trace: write failed");
+    }
+}
+
+/**
+* Reader over a whole trace file loaded into memory.
+*/
+class TraceReader
+{
+public:
+    explicit TraceReader(const std::string& path);
+
+    TraceKeyKind keyKind() const { return keyKind_; }
+    size_t keySize() const { return keySize_; }
+    bool atEnd() const { return pos_ >= data_.size(); }
+
+    uint8_t getByte()
+    {
+        if(pos_ >= data_.size()) throw std::runtime_error("trace: truncated record");
+        return data_[pos_++];
+    }
+
+    uint64_t getVarint()
+    {
+        uint64_t v = 0;
+        for(int shift = 0; shift < 64; shift += 7) {
+            uint8_t b = getByte();
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if((b & 0x80) == 0) return v;
+        }
+        throw std::runtime_error("trace: bad varint");
+    }
+
+    void getBytes(void* out, size_t len)
+    {
+        if(len > data_.size() - pos_) throw std::runtime_error("trace: truncated record");
+        std::memcpy(out, &data_[pos_], len);
+        pos_ += len;
+    }
+
+private:
+    std::vector<uint8_t> data_;
+    size_t pos_;
+    TraceKeyKind keyKind_;
+    size_t keySize_;
+};
+
+inline TraceReader::TraceReader(const std::string& path) : pos_(0)
+{
+    FILE* file = std::fopen(path.c_str(), "rb");
+    if(file == NULL) {
+        throw std::runtime_error("trace: cannot open " + path);
+    }
+    uint8_t chunk[1 << 16];
+    size_t n;
+    while((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data_.insert(data_.end(), chunk, chunk + n);
+    }
+    std::fclose(file);
+
+    if(data_.size() < sizeof(traceMagic) + 2 || std::memcmp(&data_[0], traceMagic, sizeof(traceMagic)) != 0) {
+        throw std::runtime_error("trace: " + path + " is not a trace file");
+    }
+    pos_ = sizeof(traceMagic);
+    keyKind_ = (TraceKeyKind)getByte();
+    keySize_ = getByte();
+    if(keyKind_ == TRACE_KEY_RAW && keySize_ == 0) {
+        throw std::runtime_error("trace: " + path + " has no raw key size");
+    }
+}
+
+/**
+* Encodes and decodes keys of a given type.  The primary template covers
+* keys that cannot be traced; recording a tree with such keys throws.
+*/
+template<typename Key, typename Enable = void>
+struct TraceKeyCodec
+{
+    static const TraceKeyKind kind = TRACE_KEY_NONE;
+    static void encode(TraceWriter&, const Key&, uint64_t&) { }
+};
+
+template<typename Key>
+struct TraceKeyCodec<Key, typename std::enable_if<std::is_integral<Key>::value>::type>
+{
+    static const TraceKeyKind kind = std::is_signed<Key>::value ? TRACE_KEY_SINT : TRACE_KEY_UINT;
+
+    // zigzag-encoded difference from the previous key, so nearby keys take a byte or two
+    static void encode(TraceWriter& out, const Key& key, uint64_t& prev)
+    {
+        uint64_t k = (uint64_t)(int64_t)key;
+        int64_t delta = (int64_t)(k - prev);
+        out.putVarint(((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        prev = k;
+    }
+
+    static Key decode(TraceReader& in, uint64_t& prev)
+    {
+        uint64_t z = in.getVarint();
+        int64_t delta = (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+        prev += (uint64_t)delta;
+        return (Key)(int64_t)prev;
+    }
+};
+
+template<typename Key>
+struct TraceKeyCodec<Key, typename std::enable_if<!std::is_integral<Key>::value &&
+                                                  std::is_trivially_copyable<Key>::value>::type>
+{
+    static const TraceKeyKind kind = TRACE_KEY_RAW;
+
+    static void encode(TraceWriter& out, const Key& key, uint64_t&)
+    {
+        out.putBytes(&key, sizeof(Key));
+    }
+};
+
+template<>
+struct TraceKeyCodec<std::string>
+{
+    static const TraceKeyKind kind = TRACE_KEY_BYTES;
+
+    static void encode(TraceWriter& out, const std::string& key, uint64_t&)
+    {
+        out.putVarint(key.size());
+        out.putBytes(key.data(), key.size());
+    }
+
+    static std::string decode(TraceReader& in, uint64_t&)
+    {
+        std::string key(in.getVarint(), '\0');
+        if(!key.empty()) in.getBytes(&key[0], key.size());
+        return key;
+    }
+};
+
+/**
+* Appends a tree's operations to a trace file.
+*/
+template<typename Key>
+class TraceRecorder
+{
+public:
+    explicit TraceRecorder(const std::string& path);
+
+    void record(TraceOp op, const Key& key)
+    {
+        out_.putByte((uint8_t)op);
+        TraceKeyCodec<Key>::encode(out_, key, prev_);
+    }
+
+    void recordScan()
+    {
+        out_.putByte((uint8_t)TRACE_SCAN);
+    }
+
+    // writes buffered records to the file; throws std::runtime_error on failure
+    void flush() { out_.flush(); }
+
+private:
+    TraceWriter out_;
+    uint64_t prev_;
+};
+
+template<typename Key>
+TraceRecorder<Key>::TraceRecorder(const std::string& path) : out_(path), prev_(0)
+{
+    if(TraceKeyCodec<Key>::kind == TRACE_KEY_NONE) {
+        throw std::runtime_error("trace: key type cannot be traced");
+    }
+    // the header's key-size byte cannot describe larger raw keys
+    if(TraceKeyCodec<Key>::kind == TRACE_KEY_RAW && sizeof(Key) >= 256) {
+        throw std::runtime_error("trace: raw keys must be under 256 bytes");
+    }
+    out_.putBytes(traceMagic, sizeof(traceMagic));
+    out_.putByte((uint8_t)TraceKeyCodec<Key>::kind);
+    out_.putByte((uint8_t)sizeof(Key));
+}
+
+#endif
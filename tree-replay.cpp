@@ -0,0 +1,180 @@
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include "bst.h"
+#include "avlbst.h"
+#include "rbbst.h"
+#include "bench.h"
+#include "trace.h"
+
+using namespace std;
+
+// Replays an operation trace (see trace.h) against one or more engines and
+// reports the timing as CSV.  Usage:
+//   ./tree-replay [--engines=bst,avl,rb,splay,map] [--repeat=N] trace-file
+// The whole trace is decoded before timing starts.  Inserted values are the
+// record index; raw (trivially copyable) keys are replayed as byte strings,
+// which keeps the access pattern but orders them bytewise.
+
+template<typename Key>
+struct TraceEntry
+{
+    TraceOp op;
+    Key key;
+};
+
+template<typename Key>
+static vector<TraceEntry<Key> > decodeTrace(TraceReader& in)
+{
+    vector<TraceEntry<Key> > entries;
+    uint64_t prev = 0;
+    while(!in.atEnd()) {
+        TraceEntry<Key> entry;
+        entry.op = (TraceOp)in.getByte();
+        if(entry.op < TRACE_INSERT || entry.op > TRACE_SCAN) {
+            throw runtime_error("trace: bad op code");
+        }
+        if(entry.op != TRACE_SCAN) {
+            entry.key = TraceKeyCodec<Key>::decode(in, prev);
+        }
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+static vector<TraceEntry<string> > decodeRawTrace(TraceReader& in)
+{
+    vector<TraceEntry<string> > entries;
+    while(!in.atEnd()) {
+        TraceEntry<string> entry;
+        entry.op = (TraceOp)in.getByte();
+        if(entry.op < TRACE_INSERT || entry.op > TRACE_SCAN) {
+            throw runtime_error("trace: bad op code");
+        }
+        if(entry.op != TRACE_SCAN) {
+            entry.key.resize(in.keySize());
+            in.getBytes(&entry.key[0], in.keySize());
+        }
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+template<typename Engine, typename Key>
+static void replay(const string& engineName, const string& keyName, const vector<TraceEntry<Key> >& trace)
+{
+    typedef uint64_t Value;
+    uint64_t counts[TRACE_SCAN + 1] = { 0 };
+    uint64_t hits = 0;
+
+    Engine engine;
+    BenchTimer timer;
+    for(size_t i = 0; i < trace.size(); ++i) {
+        const TraceEntry<Key>& e = trace[i];
+        counts[e.op]++;
+        switch(e.op) {
+        case TRACE_INSERT:
+            benchInsert(engine, e.key, (Value)i);
+            break;
+        case TRACE_REMOVE:
+            benchRemove(engine, e.key);
+            break;
+        case TRACE_FIND:
+            if(benchFind(engine, e.key)) hits++;
+            break;
+        case TRACE_INDEX:
+            if(benchIndex(engine, e.key)) hits++;
+            break;
+        case TRACE_SCAN:
+            hits += benchScan(engine);
+            break;
+        }
+    }
+    double seconds = timer.seconds();
+
+    char buf[96];
+    snprintf(buf, sizeof(buf), "%.6f,%.0f,%.1f", seconds,
+        seconds > 0 ? trace.size() / seconds : 0.0,
+        trace.empty() ? 0.0 : seconds * 1e9 / trace.size());
+    cout << engineName << ',' << keyName << ',' << trace.size() << ','
+         << counts[TRACE_INSERT] << ',' << counts[TRACE_REMOVE] << ',' << counts[TRACE_FIND] << ','
+         << counts[TRACE_INDEX] << ',' << counts[TRACE_SCAN] << ',' << buf << ',' << hits << endl;
+}
+
+template<typename Key>
+static void replayAll(const vector<string>& engines, int repeat, const string& keyName, const vector<TraceEntry<Key> >& trace)
+{
+    typedef uint64_t Value;
+    for(int r = 0; r < repeat; ++r) {
+        for(size_t i = 0; i < engines.size(); ++i) {
+            if(engines[i] == "bst") replay<BinarySearchTree<Key, Value> >(engines[i], keyName, trace);
+            else if(engines[i] == "avl") replay<AVLTree<Key, Value> >(engines[i], keyName, trace);
+            else if(engines[i] == "rb") replay<RedBlackTree<Key, Value> >(engines[i], keyName, trace);
+            else if(engines[i] == "splay") replay<SplayTree<Key, Value> >(engines[i], keyName, trace);
+            else if(engines[i] == "map") replay<std::map<Key, Value> >(engines[i], keyName, trace);
+            else cerr << "tree-replay: unknown engine " << engines[i] << endl;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    vector<string> engines;
+    engines.push_back("bst");
+    engines.push_back("avl");
+    engines.push_back("rb");
+    engines.push_back("map");
+    int repeat = 1;
+    string path;
+
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if(arg.compare(0, 10, "--engines=") == 0) {
+            engines.clear();
+            stringstream ss(arg.substr(10));
+            string item;
+            while(getline(ss, item, ',')) engines.push_back(item);
+        }
+        else if(arg.compare(0, 9, "--repeat=") == 0) repeat = atoi(arg.c_str() + 9);
+        else if(arg.compare(0, 2, "--") == 0 || !path.empty()) {
+            cerr << "usage: tree-replay [--engines=bst,avl,rb,splay,map] [--repeat=N] trace-file" << endl;
+            return 1;
+        }
+        else path = arg;
+    }
+    if(path.empty()) {
+        cerr << "usage: tree-replay [--engines=bst,avl,rb,splay,map] [--repeat=N] trace-file" << endl;
+        return 1;
+    }
+
+    try {
+        TraceReader in(path);
+        cout << "engine,key,ops,inserts,removes,finds,indexes,scans,seconds,ops_per_sec,ns_per_op,hits" << endl;
+        switch(in.keyKind()) {
+        case TRACE_KEY_UINT:
+            replayAll(engines, repeat, "uint", decodeTrace<uint64_t>(in));
+            break;
+        case TRACE_KEY_SINT:
+            replayAll(engines, repeat, "sint", decodeTrace<int64_t>(in));
+            break;
+        case TRACE_KEY_BYTES:
+            replayAll(engines, repeat, "bytes", decodeTrace<string>(in));
+            break;
+        case TRACE_KEY_RAW:
+            replayAll(engines, repeat, "raw", decodeRawTrace(in));
+            break;
+        default:
+            cerr << "tree-replay: unsupported key kind" << endl;
+            return 1;
+        }
+    }
+    catch(const exception& e) {
+        cerr << "tree-replay: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
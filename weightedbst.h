@@ -0,0 +1,146 @@
+#ifndef WEIGHTEDBST_H
+#define WEIGHTEDBST_H
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "bst.h"
+
+/**
+* A binary search tree shaped for its lookup distribution.  reoptimize()
+* relinks the nodes into a near-optimal weighted BST for the counts
+* gathered by enableAccessSampling(), so frequently read keys sit near the
+* root and the expected probe depth approaches the entropy of the access
+* distribution instead of log n.
+*
+* Build one from a sampled AVLTree (or any other tree) for read-mostly data
+* with stable popularity:
+*
+*     tree.enableAccessSampling();
+*     ... serve lookups ...
+*     ReadOptimizedTree<Key, Value> readTree(tree);
+*
+* insert and remove work as in BinarySearchTree but do not maintain the
+* shape; call reoptimize() again after bulk changes.
+*/
+template <class Key, class Value>
+class ReadOptimizedTree : public BinarySearchTree<Key, Value>
+{
+public:
+    ReadOptimizedTree();
+    // copies source's items and sampled counts, then reoptimizes
+    explicit ReadOptimizedTree(const BinarySearchTree<Key, Value>& source);
+
+    void reoptimize();
+
+protected:
+    static Node<Key, Value>* linkWeighted(std::vector<Node<Key, Value>*>& nodes, const std::vector<double>& prefix,
+                                          size_t lo, size_t hi, Node<Key, Value>* parent);
+};
+
+/*
+  -----------------------------------------------
+  Begin implementations for the ReadOptimizedTree class.
+  -----------------------------------------------
+*/
+
+template<class Key, class Value>
+ReadOptimizedTree<Key, Value>::ReadOptimizedTree()
+{
+
+}
+
+template<class Key, class Value>
+ReadOptimizedTree<Key, Value>::ReadOptimizedTree(const BinarySearchTree<Key, Value>& source)
+{
+    const std::map<Key, uint64_t>* counts = source.accessCounts();
+    if(counts != NULL) {
+        this->enableAccessSampling();
+        this->sampler_->counts = *counts;
+    }
+
+    // append in key order; linking is left to reoptimize()
+    Node<Key, Value>* prev = NULL;
+    for(typename BinarySearchTree<Key, Value>::iterator it = source.begin(); it != source.end(); ++it) {
+        Node<Key, Value>* node = new Node<Key, Value>(it->first, it->second, prev);
+        if(prev == NULL) this->root_ = node;
+        else prev->setRight(node);
+        prev = node;
+    }
+    reoptimize();
+}
+
+/**
+* Relinks the tree by Mehlhorn's bisection rule: the root of each range is
+* the key whose weight straddles the midpoint of the range's total weight.
+* A key weighs its sampled count plus a floor; the floors add up to a
+* tenth of the sampled total, so unsampled keys still get a balanced place
+* without flattening the skew.  Each root is found by binary search over
+* prefix sums, O(n log n) overall, and the expected depth is within a
+* small constant of the optimal weighted tree's.
+*/
+template<class Key, class Value>
+void ReadOptimizedTree<Key, Value>::reoptimize()
+{
+    std::vector<Node<Key, Value>*> nodes;
+    for(Node<Key, Value>* n = this->getSmallestNode(); n != NULL; n = this->successor(n)) {
+        nodes.push_back(n);
+    }
+    if(nodes.empty()) {
+        return;
+    }
+
+    double floor = 1;
+    typename std::map<Key, uint64_t>::const_iterator count;
+    if(this->sampler_ != NULL) {
+        double sampled = 0;
+        for(count = this->sampler_->counts.begin(); count != this->sampler_->counts.end(); ++count) {
+            sampled += count->second;
+        }
+        if(sampled > 0) floor = 0.1 * sampled / nodes.size();
+        count = this->sampler_->counts.begin();
+    }
+
+    // prefix[i] is the weight of nodes[0, i); counts join the nodes in key order
+    std::vector<double> prefix(nodes.size() + 1, 0.0);
+    for(size_t i = 0; i < nodes.size(); ++i) {
+        double weight = floor;
+        if(this->sampler_ != NULL) {
+            const Key& key = nodes[i]->getKey();
+            while(count != this->sampler_->counts.end() && count->first < key) ++count;
+            if(count != this->sampler_->counts.end() && !(key < count->first)) weight += count->second;
+        }
+        prefix[i + 1] = prefix[i] + weight;
+    }
+
+    this->root_ = linkWeighted(nodes, prefix, 0, nodes.size(), NULL);
+}
+
+template<class Key, class Value>
+Node<Key, Value>* ReadOptimizedTree<Key, Value>::linkWeighted(std::vector<Node<Key, Value>*>& nodes,
+                                                             const std::vector<double>& prefix,
+                                                             size_t lo, size_t hi, Node<Key, Value>* parent)
+{
+    if(lo >= hi) {
+        return NULL;
+    }
+
+    // the node whose weight interval [prefix[r], prefix[r + 1]) holds the midpoint
+    double mid = (prefix[lo] + prefix[hi]) / 2;
+    size_t r = std::upper_bound(prefix.begin() + lo + 1, prefix.begin() + hi + 1, mid) - prefix.begin() - 1;
+    if(r >= hi) r = hi - 1;
+
+    Node<Key, Value>* root = nodes[r];
+    root->setParent(parent);
+    root->setLeft(linkWeighted(nodes, prefix, lo, r, root));
+    root->setRight(linkWeighted(nodes, prefix, r + 1, hi, root));
+    return root;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the ReadOptimizedTree class.
+  -----------------------------------------------
+*/
+
+#endif